@@ -156,6 +156,31 @@ message(STATUS "EXE_LINKER_FLAGS_RELEASE:       ${CMAKE_EXE_LINKER_FLAGS_RELEASE
 # aren't in the C++ standard (e.g. UINT8_MAX, INT64_MIN, etc).
 add_definitions(-D__STDC_CONSTANT_MACROS -D__STDC_FORMAT_MACROS)
 
+# Count the executed CubeScript instructions for benchmarkscripts, costs some interpreter speed.
+option(CUBESCRIPT_PROFILE "Count executed CubeScript instructions (for the script benchmark)" OFF)
+if(CUBESCRIPT_PROFILE)
+  add_definitions(-DCUBESCRIPT_PROFILE)
+endif()
+
+# The RPC load generator (--benchmark-rpc) and the tree variable only it writes.
+option(RPC_BENCHMARK "Build the RPC load generator (--benchmark-rpc)" OFF)
+if(RPC_BENCHMARK)
+  add_definitions(-DRPC_BENCHMARK)
+endif()
+
+# Identifies the CubeScript compiler in the compiled script cache (see scriptcacheheader in engine/command.cpp),
+# so a cache is never run by another compiler. Reconfigures whenever the compiler's sources change.
+set(SCRIPT_COMPILER_SOURCES ${CMAKE_SOURCE_DIR}/inexor/engine/command.cpp ${CMAKE_SOURCE_DIR}/inexor/shared/command.hpp)
+set(SCRIPT_COMPILER_TEXT "")
+foreach(source ${SCRIPT_COMPILER_SOURCES})
+  file(READ ${source} source_text)
+  string(APPEND SCRIPT_COMPILER_TEXT "${source_text}")
+endforeach()
+string(MD5 SCRIPT_COMPILER_HASH "${SCRIPT_COMPILER_TEXT}")
+string(SUBSTRING ${SCRIPT_COMPILER_HASH} 0 8 SCRIPT_COMPILER_HASH)
+add_definitions(-DSCRIPTCACHEBUILD=0x${SCRIPT_COMPILER_HASH}u)
+set_property(DIRECTORY APPEND PROPERTY CMAKE_CONFIGURE_DEPENDS ${SCRIPT_COMPILER_SOURCES})
+
 if(OS_POSIX)
   # Allow the Large File Support (LFS) interface to replace the old interface.
   add_definitions(-D_FILE_OFFSET_BITS=64)
@@ -1,6 +1,9 @@
 // command.cpp: implements the parsing and execution of a tiny script language which
 // is largely backwards compatible with the quake console language.
 
+#include <chrono>
+#include <string>
+
 #include "inexor/engine/engine.hpp"
 #include "inexor/network/SharedTree.hpp"
 #include "inexor/util/Logging.hpp"
@@ -302,8 +305,12 @@ static void debugcode(const char *fmt, ...)
 
 static void debugcodeline(const char *p, const char *fmt, ...) PRINTFARGS(2, 3);
 
+/// number of syntax errors the compiler reported so far, see loadscriptcode()
+static int compileerrors = 0;
+
 static void debugcodeline(const char *p, const char *fmt, ...)
 {
+    compileerrors++;
     if(nodebug) return;
 
     // va_list args;
@@ -1002,6 +1009,59 @@ static inline void compilefloat(vector<uint> &code, const char *word = NULL)
 
 static bool compilearg(vector<uint> &code, const char *&p, int wordtype);
 static void compilestatements(vector<uint> &code, const char *&p, int rettype, int brak = '\0');
+static const uint *runcode(const uint *code, tagval &result);
+
+/// @return the length of the instruction at code if it just pushes a constant, 0 otherwise
+static inline int constlen(const uint *code)
+{
+    uint op = *code;
+    switch(op&0xFF)
+    {
+        case CODE_VAL|RET_NULL:
+        case CODE_VALI|RET_NULL: case CODE_VALI|RET_INT: case CODE_VALI|RET_FLOAT: case CODE_VALI|RET_STR: return 1;
+        case CODE_VAL|RET_INT: case CODE_VAL|RET_FLOAT: return 2;
+        case CODE_VAL|RET_STR: case CODE_MACRO: return (op>>8)/sizeof(uint) + 2;
+        default: return 0;
+    }
+}
+
+static bool isconst(const vector<uint> &code, int start, int end)
+{
+    int i = start;
+    while(i < end)
+    {
+        int len = constlen(&code[i]);
+        if(!len) return false;
+        i += len;
+    }
+    return i == end;
+}
+
+/// Replace the code from start on, which only works on constants and leaves its value in the result, by that value.
+/// It gets run the same way it would be at runtime, so the value is the same in any case.
+/// number of expressions foldconst() replaced so far, see benchmarkscripts()
+static int foldedconsts = 0;
+
+static void foldconst(vector<uint> &code, int start, int rettype)
+{
+    foldedconsts++;
+    vector<uint> buf;
+    buf.reserve(code.length() - start + 2);
+    buf.add(CODE_START);
+    buf.put(&code[start], code.length() - start);
+    buf.add(CODE_EXIT|(rettype < VAL_ANY ? rettype<<CODE_RET : 0));
+    tagval result;
+    runcode(buf.getbuf()+1, result);
+    code.setsize(start);
+    switch(result.type)
+    {
+        case VAL_INT: compileint(code, result.i); break;
+        case VAL_FLOAT: compilefloat(code, result.f); break;
+        case VAL_STR: case VAL_MACRO: compilestr(code, result.s, int(strlen(result.s)), rettype == VAL_STR); break;
+        default: compilenull(code); break;
+    }
+    freearg(result);
+}
 
 static inline void compileval(vector<uint> &code, int wordtype, char *word, int wordlen)
 {
@@ -1197,7 +1257,7 @@ static bool compileblocksub(vector<uint> &code, const char *&p)
 static void compileblock(vector<uint> &code, const char *&p, int wordtype)
 {
     const char *line = p, *start = p;
-    int concs = 0;
+    int concs = 0, strstart = -1;
     for(int brak = 1; brak;)
     {
         p += strcspn(p, "@\"/[]\0");
@@ -1262,6 +1322,7 @@ done:
                 return;
             }
         }
+        strstart = code.length();
         compileblockstr(code, start, p-1, concs > 0);
         if(concs > 1) concs++;
     }        
@@ -1281,7 +1342,12 @@ done:
             if(!concs) 
             {
                 if(p-1 <= start) compileval(code, wordtype, NULL, 0);
-                else code.add(CODE_FORCE|(wordtype<<CODE_RET));
+                else
+                {
+                    // a constant string, convert it now instead of on every run
+                    code.add(CODE_RESULT);
+                    foldconst(code, strstart, wordtype);
+                }
             }
             break;
     }
@@ -1295,16 +1361,26 @@ static bool compileword(vector<uint> &code, const char *&p, int wordtype, char *
         case '\"': word = cutstring(p, wordlen); break;
         case '$': compilelookup(code, p, wordtype); return true;
         case '(':
+        {
             p++;
+            int start = code.length();
             code.add(CODE_ENTER);
             compilestatements(code, p, VAL_ANY, ')');
+            if(wordtype <= VAL_ANY && (code.last()&CODE_OP_MASK) == CODE_RESULT && isconst(code, start+1, code.length()-1))
+            {
+                // (constant) needs no nested run
+                foldconst(code, start+1, wordtype);
+                code.remove(start);
+                return true;
+            }
             code.add(CODE_EXIT|(wordtype < VAL_ANY ? wordtype<<CODE_RET : 0));
             switch(wordtype)
             {
                 case VAL_CODE: code.add(CODE_COMPILE); break;
                 case VAL_IDENT: code.add(CODE_IDENTU); break;
             }
-            return true;        
+            return true;
+        }
         case '[':
             p++;
             compileblock(code, p, wordtype);
@@ -1350,7 +1426,7 @@ static void compilestatements(vector<uint> &code, const char *&p, int rettype, i
                 p++;
                 if(idname) 
                 {
-                    id = newident(idname, IDF_UNKNOWN);
+                    id = idents.access(idname);
                     if(!id || id->type != ID_ALIAS) { compilestr(code, idname, idlen, true); id = NULL; }
                     delete[] idname;
                 }
@@ -1385,7 +1461,7 @@ static void compilestatements(vector<uint> &code, const char *&p, int rettype, i
                     break;
                 case ID_COMMAND:
                 {
-                    int comtype = CODE_COM, fakeargs = 0;
+                    int comtype = CODE_COM, fakeargs = 0, argstart = code.length();
                     bool rep = false;
                     for(const char *fmt = id->args; *fmt; fmt++) switch(*fmt)
                     {
@@ -1430,6 +1506,11 @@ static void compilestatements(vector<uint> &code, const char *&p, int rettype, i
                     }
                 endfmt:
                     code.add(comtype|(rettype < VAL_ANY ? rettype<<CODE_RET : 0)|(id->index<<8));
+                    if(id->flags&IDF_PURE && comtype != CODE_COMD && isconst(code, argstart, code.length()-1))
+                    {
+                        foldconst(code, argstart, rettype);
+                        code.add(CODE_RESULT|(rettype < VAL_ANY ? rettype<<CODE_RET : 0));
+                    }
                     break;
                 }
                 case ID_LOCAL:
@@ -1697,6 +1778,10 @@ cleanup:
 
 #define MAXRUNDEPTH 255
 static int rundepth = 0;
+#ifdef CUBESCRIPT_PROFILE
+/// number of executed instructions, see benchmarkscripts()
+static ullong runops = 0;
+#endif
  
 static const uint *runcode(const uint *code, tagval &result)
 {
@@ -1714,6 +1799,9 @@ static const uint *runcode(const uint *code, tagval &result)
     for(;;)
     {
         uint op = *code++;
+#ifdef CUBESCRIPT_PROFILE
+        ++runops;
+#endif
         switch(op&0xFF)
         {
             case CODE_START: case CODE_OFFSET: continue;
@@ -1768,10 +1856,6 @@ static const uint *runcode(const uint *code, tagval &result)
             case CODE_VAL|RET_FLOAT: args[numargs++].setfloat(*(const float *)code++); continue;
             case CODE_VALI|RET_FLOAT: args[numargs++].setfloat(float(int(op)>>8)); continue;
 
-            case CODE_FORCE|RET_STR: forcestr(args[numargs-1]); continue;
-            case CODE_FORCE|RET_INT: forceint(args[numargs-1]); continue;
-            case CODE_FORCE|RET_FLOAT: forcefloat(args[numargs-1]); continue;
-
             case CODE_RESULT|RET_NULL: case CODE_RESULT|RET_STR: case CODE_RESULT|RET_INT: case CODE_RESULT|RET_FLOAT:
             litval:
                 freearg(result);
@@ -2229,17 +2313,232 @@ bool executebool(const char *p)
     return b;
 }
 
+/// Compiled script cache: the code of every file execfile() compiled, so it needs no compiling next time.
+///
+/// Stored as <homedir>/cache/scripts/<path of the file>.csc (with all path separators replaced by '_'):
+///
+///   scriptcacheheader   in native byte order, the cache is local anyway
+///   ident table         per ident the code refers to: int type, int flags, name '\0', args '\0'
+///   uint code[codelen]  the compiled code, with the ident operands being indices into the ident table
+///
+/// The cache is used as long as the source still has the same length and hash and the idents
+/// still are what the compiler saw (e.g. a command still takes the same arguments), and as long as
+/// it was written by the same compiler: the build system passes SCRIPTCACHEBUILD, a hash of the
+/// compiler's source (this file, including the builtins it folds constants with, see IDF_PURE).
+/// The version only needs a bump when the layout of the cache changes.
+#define SCRIPTCACHEVERSION 3
+#ifndef SCRIPTCACHEBUILD
+#define SCRIPTCACHEBUILD 0u
+#endif
+/// smaller scripts compile about as fast as their cache can be opened
+#define SCRIPTCACHEMINSIZE 4096
+
+struct scriptcacheheader
+{
+    char magic[4];      // "CSCC"
+    int version;
+    uint build;         // SCRIPTCACHEBUILD
+    uint srclen;
+    ullong srchash;     // 64 bit FNV-1a of the source
+    int numidents, codelen;
+};
+
+/// cache compiled scripts, see scriptcacheheader
+VARP(scriptcache, 0, 1, 1);
+
+/// flags which change the code the compiler generates
+static const int CACHEDIDENTFLAGS = IDF_HEX|IDF_PURE;
+
+static ullong scripthash(const char *src, size_t len)
+{
+    ullong h = 14695981039346656037ULL;
+    loopi(len) h = (h ^ uchar(src[i])) * 1099511628211ULL;
+    return h;
+}
+
+/// The header a valid cache of src has.
+static void expectedscriptcache(scriptcacheheader &hdr, const char *src, size_t len)
+{
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, "CSCC", 4);
+    hdr.version = SCRIPTCACHEVERSION;
+    hdr.build = SCRIPTCACHEBUILD;
+    hdr.srclen = uint(len);
+    hdr.srchash = scripthash(src, len);
+}
+
+static void scriptcachename(char *name, const char *file)
+{
+    string flat;
+    copystring(flat, file);
+    for(char *c = flat; *c; c++) if(*c == '/' || *c == '\\' || *c == ':') *c = '_';
+    nformatstring(name, MAXSTRLEN, "cache/scripts/%s.csc", flat);
+    path(name);
+}
+
+/// The number of words the instruction at code takes up.
+static inline int oplen(uint op)
+{
+    switch(op&0xFF)
+    {
+        case CODE_VAL|RET_STR: case CODE_MACRO: return (op>>8)/sizeof(uint) + 2;
+        case CODE_VAL|RET_INT: case CODE_VAL|RET_FLOAT: return 2;
+        default: return 1;
+    }
+}
+
+/// @return whether the operand of op is the index of an ident
+static inline bool hasidentoperand(uint op)
+{
+    switch(op&CODE_OP_MASK)
+    {
+        case CODE_PRINT: case CODE_IDENT: case CODE_IDENTARG:
+        case CODE_COM: case CODE_COMD: case CODE_COMC: case CODE_COMV:
+        case CODE_SVAR: case CODE_SVAR1:
+        case CODE_IVAR: case CODE_IVAR1: case CODE_IVAR2: case CODE_IVAR3:
+        case CODE_FVAR: case CODE_FVAR1:
+        case CODE_LOOKUP: case CODE_LOOKUPARG: case CODE_ALIAS: case CODE_ALIASARG: case CODE_CALL: case CODE_CALLARG:
+            return true;
+        default: return false;
+    }
+}
+
+static void savescriptcache(const char *file, const char *src, size_t len, const vector<uint> &code)
+{
+    vector<uint> out;
+    out.put(code.getbuf(), code.length());
+    out[0] = CODE_START;
+    vector<ident *> ids;
+    vector<int> remap;
+    remap.pad(identmap.length());
+    loopv(remap) remap[i] = -1;
+    for(int i = 0; i < out.length(); i += oplen(out[i]))
+    {
+        if(!hasidentoperand(out[i])) continue;
+        int &n = remap[out[i]>>8];
+        if(n < 0)
+        {
+            n = ids.length();
+            ids.add(identmap[out[i]>>8]);
+        }
+        out[i] = (out[i]&0xFF) | (n<<8);
+    }
+
+    string name, tmp;
+    scriptcachename(name, file);
+    formatstring(tmp, "%s.tmp", name);
+    stream *f = openrawfile(tmp, "wb");
+    if(!f)
+    {
+        // findfile() only creates missing directories within the home directory
+        createdir("cache");
+        createdir(path(copystring(name, "cache/scripts")));
+        scriptcachename(name, file);
+        f = openrawfile(tmp, "wb");
+        if(!f) return;
+    }
+    std::string dstname(findfile(name, "wb")), tmpname(findfile(tmp, "wb"));
+    scriptcacheheader hdr;
+    expectedscriptcache(hdr, src, len);
+    hdr.numidents = ids.length();
+    hdr.codelen = out.length();
+    bool ok = f->write(&hdr, sizeof(hdr)) == sizeof(hdr);
+    loopv(ids)
+    {
+        ident &id = *ids[i];
+        int info[2] = { id.type, id.flags&CACHEDIDENTFLAGS };
+        const char *args = id.type == ID_COMMAND ? id.args : "";
+        ok = ok && f->write(info, sizeof(info)) == sizeof(info)
+                && f->write(id.name, strlen(id.name)+1) == strlen(id.name)+1
+                && f->write(args, strlen(args)+1) == strlen(args)+1;
+    }
+    ok = ok && f->write(out.getbuf(), out.length()*sizeof(uint)) == out.length()*sizeof(uint);
+    delete f;
+    if(ok)
+    {
+        remove(dstname.c_str());
+        ok = !rename(tmpname.c_str(), dstname.c_str());
+    }
+    if(!ok) remove(tmpname.c_str());
+}
+
+/// Read the code of src from the cache.
+/// @return false if there is no up to date cache
+static bool loadscriptcache(const char *file, const char *src, size_t len, vector<uint> &code)
+{
+    string name;
+    scriptcachename(name, file);
+    size_t size = 0;
+    char *buf = loadfile(name, &size, false);
+    if(!buf) return false;
+    scriptcacheheader expected, &hdr = *(scriptcacheheader *)buf;
+    expectedscriptcache(expected, src, len);
+    const char *p = buf + sizeof(hdr), *end = buf + size;
+    bool ok = size >= sizeof(hdr) && !memcmp(&hdr, &expected, offsetof(scriptcacheheader, numidents)) && hdr.numidents >= 0 && hdr.codelen > 0;
+    vector<ident *> ids;
+    for(int i = 0; ok && i < hdr.numidents; i++)
+    {
+        int info[2];
+        if(end - p <= int(sizeof(info))) { ok = false; break; }
+        const char *idname = p + sizeof(info), *args = idname + strnlen(idname, end - idname) + 1;
+        if(args >= end || args + strnlen(args, end - args) >= end) { ok = false; break; }
+        memcpy(info, p, sizeof(info));
+        p = args + strlen(args) + 1;
+        // the compiler creates every alias it comes across
+        ident *id = info[0] == ID_ALIAS ? newident(idname, IDF_UNKNOWN) : idents.access(idname);
+        ok = id && id->type == info[0] && (id->flags&CACHEDIDENTFLAGS) == info[1] && (id->type != ID_COMMAND || !strcmp(id->args, args));
+        ids.add(id);
+    }
+    ok = ok && size_t(end - p) == hdr.codelen*sizeof(uint);
+    if(ok)
+    {
+        code.setsize(0);
+        code.put((const uint *)p, hdr.codelen);
+        ok = code[0] == CODE_START;
+        for(int i = 0; ok && i < code.length(); i += oplen(code[i]))
+        {
+            if(i + oplen(code[i]) > code.length()) ok = false;
+            else if(hasidentoperand(code[i]))
+            {
+                uint n = code[i]>>8;
+                if(n >= uint(ids.length())) ok = false;
+                else code[i] = (code[i]&0xFF) | (ids[n]->index<<8);
+            }
+        }
+    }
+    delete[] buf;
+    return ok;
+}
+
+/// Compile src, the contents of file, or take its code from the cache.
+/// @return whether it came from the cache
+static bool loadscriptcode(const char *file, const char *src, size_t len, vector<uint> &code, bool usecache)
+{
+    if(len < SCRIPTCACHEMINSIZE) usecache = false;
+    if(usecache && loadscriptcache(file, src, len, code)) return true;
+    code.setsize(0);
+    int errors = compileerrors;
+    compilemain(code, src, VAL_INT);
+    // keep reporting the errors instead of hiding them in the cache
+    if(usecache && compileerrors == errors) savescriptcache(file, src, len, code);
+    return false;
+}
+
+/// the files execfile() executed while benchmarkstartup() is running
+static vector<char *> *execlog = NULL;
+
 static string execdir = "";
 const char *getcurexecdir() { return execdir; } //returns the path of the file the command is called from
 
 bool execfile(const char *cfgfile, bool msg)
 {
-    string s;
+    string s, file; // file: where it actually got loaded from
     copystring(s, cfgfile);
-    char *buf = loadfile(path(s), NULL);
+    size_t len = 0;
+    char *buf = loadfile(copystring(file, path(s)), &len);
     if(!buf)
     {
-        buf = loadfile(makerelpath(getcurexecdir(), path(s)), NULL);
+        buf = loadfile(copystring(file, makerelpath(getcurexecdir(), path(s))), &len);
         if(!buf) 
         {
             if(msg) spdlog::get("global")->error("could not read {}", quoted(cfgfile));
@@ -2252,7 +2551,14 @@ bool execfile(const char *cfgfile, bool msg)
 	
     copystring(execdir, parentdir(s)); //make the current path available to the executed commands
 
-    execute(buf);
+    if(execlog) execlog->add(newstring(file));
+    vector<uint> code;
+    code.reserve(64);
+    loadscriptcode(file, buf, len, code, scriptcache != 0);
+    tagval result;
+    runcode(code.getbuf()+1, result);
+    freearg(result);
+    if(int(code[0]) >= 0x100) code.disown();
     
     sourcefile = oldsourcefile;
     sourcestr = oldsourcestr;
@@ -2266,6 +2572,95 @@ bool execfile(const char *cfgfile, bool msg)
 }
 ICOMMAND(exec, "sb", (char *file, int *msg), intret(execfile(file, *msg != 0) ? 1 : 0));
 
+/// Measure the interpreter on the given scripts (e.g. "server-init.cfg"): how long compiling them takes,
+/// how many constant expressions got folded and how long running the compiled code takes.
+/// Build with -DCUBESCRIPT_PROFILE to get the number of executed instructions as well.
+void benchmarkscripts(const char *files, int runs)
+{
+    using clock = std::chrono::steady_clock;
+    vector<char *> names;
+    explodelist(files, names);
+    loopv(names)
+    {
+        string file;
+        copystring(file, names[i]);
+        char *buf = loadfile(path(file), NULL);
+        if(!buf)
+        {
+            spdlog::get("global")->error("[script benchmark] could not read {}", file);
+            continue;
+        }
+        int folds = foldedconsts;
+        clock::time_point start = clock::now();
+        loopj(runs) freecode(compilecode(buf));
+        double compilems = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+        folds = (foldedconsts - folds)/runs;
+
+        uint *code = compilecode(buf);
+#ifdef CUBESCRIPT_PROFILE
+        ullong ops = runops;
+#endif
+        start = clock::now();
+        loopj(runs)
+        {
+            tagval result;
+            executeret(code, result);
+            freearg(result);
+        }
+        double runms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+        freecode(code);
+        delete[] buf;
+#ifdef CUBESCRIPT_PROFILE
+        ops = (runops - ops)/runs;
+        spdlog::get("global")->info("[script benchmark] {0}: compiling {1:.1f} us ({2} constant expressions folded), running {3:.1f} us, {4} instructions",
+                                    file, 1000*compilems/runs, folds, 1000*runms/runs, ops);
+#else
+        spdlog::get("global")->info("[script benchmark] {0}: compiling {1:.1f} us ({2} constant expressions folded), running {3:.1f} us",
+                                    file, 1000*compilems/runs, folds, 1000*runms/runs);
+#endif
+    }
+    names.deletearrays();
+}
+ICOMMAND(benchmarkscripts, "si", (char *files, int *runs), benchmarkscripts(files, max(*runs, 1)));
+
+/// Time init (e.g. the server's startup without listening), then how long getting the code of the scripts
+/// it executed takes, compiling them vs. taking them from the script cache.
+void benchmarkstartup(void (*init)(), int runs)
+{
+    using clock = std::chrono::steady_clock;
+    vector<char *> files;
+    execlog = &files;
+    clock::time_point start = clock::now();
+    init();
+    double initms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+    execlog = NULL;
+    spdlog::get("global")->info("[startup benchmark] init {0:.2f} ms, executed {1} scripts", initms, files.length());
+
+    double compilems = 0, cachems = 0;
+    int cached = 0;
+    loopv(files)
+    {
+        size_t len = 0;
+        char *buf = loadfile(files[i], &len);
+        if(!buf) continue;
+        vector<uint> code;
+        loadscriptcode(files[i], buf, len, code, true); // make sure the cache is up to date
+        loopj(runs)
+        {
+            start = clock::now();
+            loadscriptcode(files[i], buf, len, code, false);
+            compilems += std::chrono::duration<double, std::milli>(clock::now() - start).count();
+            start = clock::now();
+            if(loadscriptcode(files[i], buf, len, code, true) && !j) cached++;
+            cachems += std::chrono::duration<double, std::milli>(clock::now() - start).count();
+        }
+        delete[] buf;
+    }
+    spdlog::get("global")->info("[startup benchmark] getting the code of all scripts: compiling {0:.2f} ms, script cache {1:.2f} ms ({2} of {3} cached)",
+                                compilems/runs, cachems/runs, cached, files.length());
+    files.deletearrays();
+}
+
 const char *escapestring(const char *s)
 {
     static vector<char> strbuf[3];
@@ -3189,6 +3584,25 @@ void strsplice(const char *s, const char *vals, int *skip, int *count)
 }
 COMMAND(strsplice, "ssii");
 
+/// flag the given commands with IDF_PURE
+static bool markpure(const char *names)
+{
+    vector<char *> list;
+    explodelist(names, list);
+    loopv(list)
+    {
+        ident *id = idents.access(list[i]);
+        if(id && id->type == ID_COMMAND) id->flags |= IDF_PURE;
+    }
+    list.deletearrays();
+    return true;
+}
+UNUSED static bool purecommands = markpure(
+    "+ * - +f *f -f = != < > <= >= =f !=f <f >f <=f >=f ^ ! & | ~ ^~ &~ |~ << >> "
+    "div mod divf modf sin cos tan asin acos atan atan2 sqrt pow loge log2 log10 exp min max minf maxf abs absf "
+    "strcmp =s !=s <s >s <=s >=s strstr strlen strcode codestr struni unistr strlower strupper strreplace strsplice "
+    "concat concatword format listlen at substr sublist indexof listdel prettylist escape unescape stripcolors ? result");
+
 #ifndef STANDALONE
 ICOMMAND(getmillis, "i", (int *total), intret(*total ? totalmillis : lastmillis));
 
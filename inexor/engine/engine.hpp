@@ -381,6 +381,7 @@ extern bool resolverwait(const char *name, ENetAddress *address);
 extern int connectwithtimeout(ENetSocket sock, const char *hostname, const ENetAddress &address);
 extern void addserver(const char *name, int port = 0, const char *password = NULL, bool keep = false);
 extern void writeservercfg();
+extern void cleanupserverbrowser();
 
 // client
 extern void localdisconnect(bool cleanup = true);
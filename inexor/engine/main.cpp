@@ -36,6 +36,7 @@ void cleanup()
 
     recorder::stop();
     cleanupserver();
+    cleanupserverbrowser();
 
     screen_manager.cleanupSDL();
 
@@ -933,6 +934,14 @@ int main(int argc, char **argv)
 	loadhistory();
     if(initscript) execute(initscript);
 
+    // e.g. inexor 31415 --benchmark-mapload reissen 5
+    for(int i = 1; i < argc; i++) if(!strcmp(argv[i], "--benchmark-mapload"))
+    {
+        extern void benchmarkmapload(const char *mname, int runs);
+        benchmarkmapload(i+1 < argc ? argv[i+1] : "", i+2 < argc ? max(atoi(argv[i+2]), 1) : 5);
+        quit();
+    }
+
     spdlog::get("global")->debug("init: mainloop");
 
     initmumble();
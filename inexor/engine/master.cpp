@@ -1,15 +1,17 @@
-#ifdef WIN32
-#define FD_SETSIZE 4096
-#else
-#include <sys/types.h>
-#undef __FD_SETSIZE
-#define __FD_SETSIZE 4096
-#endif
-
 #include "inexor/shared/cube.hpp"
+#include "inexor/util/ServerList.hpp"
 #include "inexor/util/Logging.hpp"
+#include <errno.h>
 #include <signal.h>
 #include <enet/time.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <unistd.h>
+#elif defined(WIN32)
+#define poll WSAPoll
+#else
+#include <poll.h>
+#endif
 
 #define INPUT_LIMIT 4096
 #define OUTPUT_LIMIT (64*1024)
@@ -17,13 +19,24 @@
 #define AUTH_TIME (30*1000)
 #define AUTH_LIMIT 100
 #define AUTH_THROTTLE 1000
+#ifdef __linux__
+#define CLIENT_LIMIT 65536
+#else
 #define CLIENT_LIMIT 4096
+#endif
 #define DUP_LIMIT 16
 #define PING_TIME 3000
 #define PING_RETRY 5
 #define KEEPALIVE_TIME (65*60*1000)
+#ifdef __linux__
+#define SERVER_LIMIT 16384
+#else
 #define SERVER_LIMIT 4096
+#endif
 #define SERVER_DUP_LIMIT 10
+#define SWEEP_TIME 1000
+#define SERVERCHANGE_LIMIT 4096
+#define ACCEPT_LIMIT 64
 
 FILE *logfile = NULL;
 
@@ -50,17 +63,17 @@ void clearusers()
 }
 COMMAND(clearusers, "");
 
-vector<ipmask> bans, servbans, gbans;
+ipmasklist bans, servbans, gbans;
 
 void clearbans()
 {
-    bans.shrink(0);
-    servbans.shrink(0);
-    gbans.shrink(0);
+    bans.clear();
+    servbans.clear();
+    gbans.clear();
 }
 COMMAND(clearbans, "");
 
-void addban(vector<ipmask> &bans, const char *name)
+void addban(ipmasklist &bans, const char *name)
 {
     ipmask ban;
     ban.parse(name);
@@ -70,10 +83,16 @@ ICOMMAND(ban, "s", (char *name), addban(bans, name));
 ICOMMAND(servban, "s", (char *name), addban(servbans, name));
 ICOMMAND(gban, "s", (char *name), addban(gbans, name));
 
-bool checkban(vector<ipmask> &bans, enet_uint32 host)
+void updatebans()
 {
-    loopv(bans) if(bans[i].check(host)) return true;
-    return false;
+    bans.update();
+    servbans.update();
+    gbans.update();
+}
+
+bool checkban(ipmasklist &bans, enet_uint32 host)
+{
+    return bans.check(host);
 }
 
 struct authreq
@@ -120,9 +139,38 @@ struct messagebuf
         buf.put(m.buf.getbuf(), m.buf.length());
     }
 };
-vector<messagebuf *> gameserverlists, gbanlists;
+vector<messagebuf *> gameserverlists, gbanlists, binaryserverlists, serverlistdeltas;
 bool updateserverlist = true;
 
+/// Every server which appears in or disappears from the list bumps the version and is journaled,
+/// so clients which send their last version only get the changes since then.
+struct serverchange
+{
+    int version;
+    bool add;
+    enet_uint32 host;
+    int port;
+};
+vector<serverchange> serverchanges;
+int serverlistversion = 0;
+
+/// Cached delta replies from some version to the current one.
+struct serverlistdelta
+{
+    int from;
+    bool binary;
+    messagebuf *message;
+};
+vector<serverlistdelta> deltacache;
+
+/// What a connection is doing at the moment.
+enum
+{
+    MC_COMMANDS = 0,    // reading regserv/reqauth/confauth/list commands and answering them
+    MC_LIST,            // streaming the server list, closed once it is sent
+    MC_CLOSED           // waiting to be purged at the end of the current loop
+};
+
 struct client
 {
     ENetAddress address;
@@ -132,15 +180,20 @@ struct client
     vector<char> output;
     int inputpos, outputpos;
     enet_uint32 connecttime, lastinput;
-    int servport;
+    vector<int> servports;          // every game server registered over this connection, a process can host several
     enet_uint32 lastauth;
     vector<authreq> authreqs;
-    bool shouldpurge;
+    int state, polling, index;
     bool registeredserver;
+    int listepoch, listversion;     // the list version the client already has, if it announced one
+    bool versionedlist, binarylist;
 
-    client() : message(NULL), inputpos(0), outputpos(0), servport(-1), lastauth(0), shouldpurge(false), registeredserver(false) {}
+    client() : message(NULL), inputpos(0), outputpos(0), lastauth(0), state(MC_COMMANDS), polling(0), index(-1), registeredserver(false),
+        listepoch(0), listversion(0), versionedlist(false), binarylist(false) {}
+
+    bool sending() const { return message || output.length(); }
 };
-vector<client *> clients;
+vector<client *> clients, closedclients;
 
 ENetSocket serversocket = ENET_SOCKET_NULL;
 
@@ -157,19 +210,153 @@ void fatal(const char *fmt, ...)
     exit(EXIT_FAILURE);
 }
 
-void purgeclient(int n)
+/// Waits for activity on the master's sockets.
+/// On Linux this uses edge triggered epoll, so a wakeup only costs as much as the sockets which became ready:
+/// a socket gets reported once, so its handler has to read or write until it would block.
+/// Everywhere else it falls back to poll(), which passes all sockets on every wakeup.
+struct socketpoller
+{
+    enum { READ = 1<<0, WRITE = 1<<1, MAXEVENTS = 1024 };
+
+    struct event
+    {
+        void *data;
+        int events;
+    };
+
+#ifdef __linux__
+    int epfd;
+
+    socketpoller() : epfd(-1) {}
+    ~socketpoller() { if(epfd >= 0) close(epfd); }
+
+    bool init()
+    {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        return epfd >= 0;
+    }
+
+    bool control(int op, ENetSocket sock, void *data, int events)
+    {
+        epoll_event ev;
+        // changing the events of a socket reports it again if it is ready already
+        ev.events = EPOLLET | (events&READ ? EPOLLIN : 0) | (events&WRITE ? EPOLLOUT : 0);
+        ev.data.ptr = data;
+        return epoll_ctl(epfd, op, sock, &ev) == 0;
+    }
+
+    bool add(ENetSocket sock, void *data, int events) { return control(EPOLL_CTL_ADD, sock, data, events); }
+    bool modify(ENetSocket sock, void *data, int events) { return control(EPOLL_CTL_MOD, sock, data, events); }
+    void remove(ENetSocket sock) { control(EPOLL_CTL_DEL, sock, NULL, 0); }
+
+    void wait(vector<event> &ready, int timeout)
+    {
+        epoll_event events[MAXEVENTS];
+        ready.setsize(0);
+        int n = epoll_wait(epfd, events, MAXEVENTS, timeout);
+        loopi(n)
+        {
+            event &e = ready.add();
+            e.data = events[i].data.ptr;
+            // errors and hangups are noticed by the following receive
+            e.events = (events[i].events&(EPOLLIN|EPOLLHUP|EPOLLERR) ? READ : 0) | (events[i].events&EPOLLOUT ? WRITE : 0);
+        }
+    }
+#else
+    /// The poll set and the data of each socket, at the same positions.
+    vector<pollfd> fds;
+    vector<void *> datas;
+
+    bool init() { return true; }
+
+    static short pollevents(int events) { return (events&READ ? POLLIN : 0) | (events&WRITE ? POLLOUT : 0); }
+
+    bool add(ENetSocket sock, void *data, int events)
+    {
+        pollfd &p = fds.add();
+        p.fd = sock;
+        p.events = pollevents(events);
+        p.revents = 0;
+        datas.add(data);
+        return true;
+    }
+
+    bool modify(ENetSocket sock, void *data, int events)
+    {
+        loopv(fds) if(fds[i].fd == sock)
+        {
+            fds[i].events = pollevents(events);
+            datas[i] = data;
+            return true;
+        }
+        return false;
+    }
+
+    void remove(ENetSocket sock)
+    {
+        loopv(fds) if(fds[i].fd == sock)
+        {
+            fds.removeunordered(i);
+            datas.removeunordered(i);
+            return;
+        }
+    }
+
+    void wait(vector<event> &ready, int timeout)
+    {
+        ready.setsize(0);
+        if(poll(fds.getbuf(), fds.length(), timeout)<=0) return;
+        loopv(fds)
+        {
+            short revents = fds[i].revents;
+            if(!revents) continue;
+            event &r = ready.add();
+            r.data = datas[i];
+            // errors and hangups are noticed by the following receive
+            r.events = (revents&(POLLIN|POLLHUP|POLLERR) ? READ : 0) | (revents&POLLOUT ? WRITE : 0);
+        }
+    }
+#endif
+} poller;
+
+/// Wait for writability while there is something to send, otherwise for input.
+void updatepoll(client &c)
+{
+    if(c.state == MC_CLOSED) return;
+    int events = c.sending() ? socketpoller::WRITE : socketpoller::READ;
+    if(events == c.polling) return;
+    poller.modify(c.socket, &c, events);
+    c.polling = events;
+}
+
+/// Connections are only marked here and purged by purgeclients(), so pending events never refer to freed clients.
+void closeclient(client &c)
+{
+    if(c.state == MC_CLOSED) return;
+    c.state = MC_CLOSED;
+    closedclients.add(&c);
+}
+
+void purgeclients()
 {
-    client &c = *clients[n];
-    if(c.message) c.message->purge();
-    enet_socket_destroy(c.socket);
-    delete clients[n];
-    clients.remove(n);
+    loopv(closedclients)
+    {
+        client *c = closedclients[i];
+        poller.remove(c->socket);
+        if(c->message) c->message->purge();
+        enet_socket_destroy(c->socket);
+        clients.removeunordered(c->index);
+        if(clients.inrange(c->index)) clients[c->index]->index = c->index;
+        delete c;
+    }
+    closedclients.setsize(0);
 }
 
 void output(client &c, const char *msg, int len = 0)
 {
     if(!len) len = strlen(msg);
     c.output.put(msg, len);
+    updatepoll(c);
 }
 
 void outputf(client &c, const char *fmt, ...)
@@ -216,6 +403,10 @@ void setupserver(int port, const char *ip = NULL)
         fatal("failed to make server socket non-blocking");
     if(!setuppingsocket(&address))
         fatal("failed to create ping socket");
+    if(!poller.init() ||
+       !poller.add(serversocket, &serversocket, socketpoller::READ) ||
+       !poller.add(pingsocket, &pingsocket, socketpoller::READ))
+        fatal("failed to set up socket polling");
 
     enet_time_set(0);
 
@@ -243,6 +434,106 @@ void genserverlist()
     updateserverlist = false;
 }
 
+void changeserverlist(gameserver &s, bool add)
+{
+    updateserverlist = true;
+    serverlistversion++;
+    serverchange &c = serverchanges.add();
+    c.version = serverlistversion;
+    c.add = add;
+    c.host = s.address.host;
+    c.port = s.port;
+    if(serverchanges.length() > SERVERCHANGE_LIMIT) serverchanges.remove(0, serverchanges.length() - SERVERCHANGE_LIMIT);
+
+    // cached deltas end at the previous version now
+    loopv(deltacache) deltacache[i].message->purge();
+    deltacache.setsize(0);
+    loopvrev(serverlistdeltas) if(serverlistdeltas[i]->refs<=0) delete serverlistdeltas.remove(i);
+}
+
+void removegameserver(int i)
+{
+    gameserver *s = gameservers.remove(i);
+    if(s->lastpong) changeserverlist(*s, false);
+    delete s;
+}
+
+/// A reply of the current list version, see server_list_reply for the binary format.
+static inexor::util::server_list_reply listreply(bool full)
+{
+    inexor::util::server_list_reply reply;
+    reply.epoch = uint(starttime);
+    reply.version = serverlistversion;
+    reply.full = full;
+    return reply;
+}
+
+static void putserverlist(vector<char> &buf, const inexor::util::server_list_reply &reply)
+{
+    std::string data = reply.write_binary();
+    buf.put(data.data(), int(data.size()));
+}
+
+int binarylistversion = -1;
+
+messagebuf *genbinaryserverlist()
+{
+    if(binaryserverlists.length() && binarylistversion == serverlistversion) return binaryserverlists.last();
+    while(binaryserverlists.length() && binaryserverlists.last()->refs<=0)
+        delete binaryserverlists.pop();
+    messagebuf *l = new messagebuf(binaryserverlists);
+    inexor::util::server_list_reply reply = listreply(true);
+    loopv(gameservers)
+    {
+        gameserver &s = *gameservers[i];
+        if(s.lastpong) reply.added.push_back(inexor::util::listed_server{s.address.host, enet_uint16(s.port)});
+    }
+    putserverlist(l->buf, reply);
+    binaryserverlists.add(l);
+    binarylistversion = serverlistversion;
+    return l;
+}
+
+/// The changes since the given version, or NULL if the journal does not reach back that far.
+messagebuf *genserverlistdelta(int from, bool binary)
+{
+    int oldest = serverchanges.length() ? serverchanges[0].version - 1 : serverlistversion;
+    if(from < oldest || from > serverlistversion) return NULL;
+    loopv(deltacache) if(deltacache[i].from == from && deltacache[i].binary == binary) return deltacache[i].message;
+
+    messagebuf *l = new messagebuf(serverlistdeltas);
+    std::vector<inexor::util::server_change> journal;
+    for(int i = serverchanges.length() - (serverlistversion - from); i < serverchanges.length(); i++)
+    {
+        serverchange &c = serverchanges[i];
+        journal.push_back(inexor::util::server_change{inexor::util::listed_server{c.host, enet_uint16(c.port)}, c.add});
+    }
+    inexor::util::server_list_reply reply = listreply(false);
+    reply.add_changes(journal);
+    if(binary) putserverlist(l->buf, reply);
+    else
+    {
+        loopk(2) for(const inexor::util::listed_server &s : k ? reply.removed : reply.added)
+        {
+            ENetAddress address;
+            address.host = s.host;
+            address.port = s.port;
+            string ip;
+            if(enet_address_get_host_ip(&address, ip, sizeof(ip)) < 0) continue;
+            defformatstring(cmd, "%s %s %d\n", k ? "delserver" : "addserver", ip, s.port);
+            l->buf.put(cmd, strlen(cmd));
+        }
+        l->buf.add('\0');
+    }
+    serverlistdelta &d = deltacache.add();
+    d.from = from;
+    d.binary = binary;
+    d.message = l;
+    l->refs++; // held by the cache until the version changes
+    serverlistdeltas.add(l);
+    return l;
+}
+
 void gengbanlist()
 {
     messagebuf *l = new messagebuf(gbanlists);
@@ -252,7 +543,7 @@ void gengbanlist()
     int cmdlen = strlen(cmd);
     loopv(gbans)
     {
-        ipmask &b = gbans[i];
+        const ipmask &b = gbans[i];
         l->buf.put(cmd, cmdlen + b.print(&cmd[cmdlen])); 
         l->buf.add('\n');
     }
@@ -272,15 +563,16 @@ void gengbanlist()
     loopv(clients)
     {
         client &c = *clients[i];
-        if(c.servport >= 0 && !c.message) 
+        if(c.servports.length() && !c.message && c.state != MC_CLOSED)
         {
             c.message = l;
             c.message->refs++;
+            updatepoll(c);
         }
     }
 }
 
-void addgameserver(client &c)
+void addgameserver(client &c, int port)
 {
     if(gameservers.length() >= SERVER_LIMIT) return;
     int dups = 0;
@@ -289,7 +581,7 @@ void addgameserver(client &c)
         gameserver &s = *gameservers[i];
         if(s.address.host != c.address.host) continue;
         ++dups;
-        if(s.port == c.servport)
+        if(s.port == port)
         {
             s.lastping = 0;
             s.numpings = 0;
@@ -309,9 +601,9 @@ void addgameserver(client &c)
     }
     gameserver &s = *gameservers.add(new gameserver);
     s.address.host = c.address.host;
-    s.address.port = c.servport+1;
+    s.address.port = port+1;
     copystring(s.ip, hostname);
-    s.port = c.servport;
+    s.port = port;
     s.numpings = 0;
     s.lastping = s.lastpong = 0;
 }
@@ -321,7 +613,7 @@ client *findclient(gameserver &s)
     loopv(clients)
     {
         client &c = *clients[i];
-        if(s.address.host == c.address.host && s.port == c.servport)
+        if(s.address.host == c.address.host && c.servports.find(s.port) >= 0 && c.state != MC_CLOSED)
             return &c;
     }
     return NULL;
@@ -360,11 +652,13 @@ void checkserverpongs()
                         {
                             c->message = gbanlists.last();
                             c->message->refs++;
+                            updatepoll(*c);
                         }
                     }
                 }
-                if(!s.lastpong) updateserverlist = true;
+                bool listed = s.lastpong != 0;
                 s.lastpong = servtime ? servtime : 1;
+                if(!listed) changeserverlist(s, true);
                 break;
             }
         }
@@ -373,11 +667,7 @@ void checkserverpongs()
 
 void bangameservers()
 {
-    loopvrev(gameservers) if(checkban(servbans, gameservers[i]->address.host))
-    {
-        delete gameservers.remove(i);
-        updateserverlist = true;
-    }
+    loopvrev(gameservers) if(checkban(servbans, gameservers[i]->address.host)) removegameserver(i);
 }
 
 void checkgameservers()
@@ -388,19 +678,14 @@ void checkgameservers()
         gameserver &s = *gameservers[i];
         if(s.lastping && s.lastpong && ENET_TIME_LESS_EQUAL(s.lastping, s.lastpong))
         {
-            if(ENET_TIME_DIFFERENCE(servtime, s.lastpong) > KEEPALIVE_TIME)
-            {
-                delete gameservers.remove(i--);
-                updateserverlist = true;
-            }
+            if(ENET_TIME_DIFFERENCE(servtime, s.lastpong) > KEEPALIVE_TIME) removegameserver(i--);
         }
         else if(!s.lastping || ENET_TIME_DIFFERENCE(servtime, s.lastping) > PING_TIME)
         {
             if(s.numpings >= PING_RETRY)
             {
                 servermessage(s, "failreg failed pinging server\n");
-                delete gameservers.remove(i--);
-                updateserverlist = true;
+                removegameserver(i--);
             }
             else
             {
@@ -511,6 +796,39 @@ void confauth(client &c, uint id, const char *val)
     outputf(c, "failauth %u\n", id);
 }
 
+/// Legacy clients get the plain addserver list. Clients which announced their version with "listversion"
+/// get the changes since that version if possible, otherwise the full list, as text or binary.
+bool sendserverlist(client &c)
+{
+    c.output.setsize(0);
+    messagebuf *m = NULL;
+    bool known = c.versionedlist && c.listepoch == int(starttime);
+    if(c.versionedlist && c.binarylist)
+    {
+        if(known) m = genserverlistdelta(c.listversion, true);
+        if(!m) m = genbinaryserverlist();
+    }
+    else
+    {
+        if(known) m = genserverlistdelta(c.listversion, false);
+        if(!m)
+        {
+            genserverlist();
+            if(gameserverlists.empty()) return false;
+            m = gameserverlists.last();
+            if(c.versionedlist) c.output.put("clearservers\n", strlen("clearservers\n"));
+        }
+        if(c.versionedlist)
+        {
+            defformatstring(version, "listversion %d %d\n", int(starttime), serverlistversion);
+            c.output.put(version, strlen(version));
+        }
+    }
+    c.message = m;
+    c.message->refs++;
+    return true;
+}
+
 bool checkclientinput(client &c)
 {
     if(c.inputpos<0) return true;
@@ -522,26 +840,28 @@ bool checkclientinput(client &c)
 
         int port;
         uint id;
-        string user, val;
+        string user, val = "";
         if(!strncmp(c.input, "list", 4) && (!c.input[4] || c.input[4] == '\n' || c.input[4] == '\r'))
         {
-            genserverlist();
-            if(gameserverlists.empty() || c.message) return false;
-            c.message = gameserverlists.last();
-            c.message->refs++;
-            c.output.setsize(0);
+            if(c.message) return false;
+            if(!sendserverlist(c)) return false;
             c.outputpos = 0;
-            c.shouldpurge = true;
+            c.state = MC_LIST;
             return true;
         }
+        else if(sscanf(c.input, "listversion %d %d %15s", &c.listepoch, &c.listversion, val) >= 2)
+        {
+            c.versionedlist = true;
+            c.binarylist = !strcmp(val, "binary");
+        }
         else if(sscanf(c.input, "regserv %d", &port) == 1)
         {
             if(checkban(servbans, c.address.host)) return false;
-            if(port < 0 || port > 0xFFFF-1 || (c.servport >= 0 && port != c.servport)) outputf(c, "failreg invalid port\n");
+            if(port < 0 || port > 0xFFFF-1 || (c.servports.find(port) < 0 && c.servports.length() >= SERVER_DUP_LIMIT)) outputf(c, "failreg invalid port\n");
             else
             {
-                c.servport = port;
-                addgameserver(c);
+                if(c.servports.find(port) < 0) c.servports.add(port);
+                addgameserver(c, port);
             }
         }
         else if(sscanf(c.input, "reqauth %u %100s", &id, user) == 2)
@@ -560,105 +880,147 @@ bool checkclientinput(client &c)
     return c.inputpos<(int)sizeof(c.input);
 }
 
-ENetSocketSet readset, writeset;
+/// Whether acceptclients() stopped at ACCEPT_LIMIT: the server socket won't be reported again for the others.
+bool acceptpending = false;
 
-void checkclients()
+void acceptclients()
 {
-    ENetSocketSet readset, writeset;
-    ENetSocket maxsock = max(serversocket, pingsocket);
-    ENET_SOCKETSET_EMPTY(readset);
-    ENET_SOCKETSET_EMPTY(writeset);
-    ENET_SOCKETSET_ADD(readset, serversocket);
-    ENET_SOCKETSET_ADD(readset, pingsocket);
-    loopv(clients)
+    acceptpending = true;
+    loopi(ACCEPT_LIMIT)
     {
-        client &c = *clients[i];
-        if(c.authreqs.length()) purgeauths(c);
-        if(c.message || c.output.length()) ENET_SOCKETSET_ADD(writeset, c.socket);
-        else ENET_SOCKETSET_ADD(readset, c.socket);
-        maxsock = max(maxsock, c.socket);
+        ENetAddress address;
+        ENetSocket clientsocket = enet_socket_accept(serversocket, &address);
+        if(clientsocket==ENET_SOCKET_NULL) { acceptpending = false; break; }
+        // closed connections are only purged after this round of events, they must not take up room meanwhile
+        if(clients.length() - closedclients.length() >= CLIENT_LIMIT || checkban(bans, address.host)) { enet_socket_destroy(clientsocket); continue; }
+
+        int dups = 0, oldest = -1;
+        loopvj(clients) if(clients[j]->address.host == address.host && clients[j]->state != MC_CLOSED)
+        {
+            dups++;
+            if(oldest<0 || clients[j]->connecttime < clients[oldest]->connecttime) oldest = j;
+        }
+        if(dups >= DUP_LIMIT) closeclient(*clients[oldest]);
+
+        client *c = new client;
+        c->address = address;
+        c->socket = clientsocket;
+        c->connecttime = servtime;
+        c->lastinput = servtime;
+        c->polling = socketpoller::READ;
+        if(!poller.add(clientsocket, c, c->polling))
+        {
+            enet_socket_destroy(clientsocket);
+            delete c;
+            continue;
+        }
+        c->index = clients.length();
+        clients.add(c);
     }
-    if(enet_socketset_select(maxsock, &readset, &writeset, 1000)<=0) return;
+}
 
-    if(ENET_SOCKETSET_CHECK(readset, pingsocket)) checkserverpongs();
-    if(ENET_SOCKETSET_CHECK(readset, serversocket))
+/// Send until everything is out or the socket would block.
+void sendclient(client &c)
+{
+    while(c.sending())
     {
-        ENetAddress address;
-        ENetSocket clientsocket = enet_socket_accept(serversocket, &address);
-        if(clients.length()>=CLIENT_LIMIT || checkban(bans, address.host)) enet_socket_destroy(clientsocket);
-        else if(clientsocket!=ENET_SOCKET_NULL)
+        const char *data = c.output.length() ? c.output.getbuf() : c.message->getbuf();
+        int len = c.output.length() ? c.output.length() : c.message->length();
+        ENetBuffer buf;
+        buf.data = (void *)&data[c.outputpos];
+        buf.dataLength = len-c.outputpos;
+        int res = enet_socket_send(c.socket, NULL, &buf, 1);
+        if(res<0) { closeclient(c); return; }
+        c.outputpos += res;
+        if(c.outputpos<len) return;
+        if(c.output.length()) c.output.setsize(0);
+        else
         {
-            int dups = 0, oldest = -1;
-            loopv(clients) if(clients[i]->address.host == address.host)
-            {
-                dups++;
-                if(oldest<0 || clients[i]->connecttime < clients[oldest]->connecttime) oldest = i;
-            }
-            if(dups >= DUP_LIMIT) purgeclient(oldest);
-
-            client *c = new client;
-            c->address = address;
-            c->socket = clientsocket;
-            c->connecttime = servtime;
-            c->lastinput = servtime;
-            clients.add(c);
+            c.message->purge();
+            c.message = NULL;
         }
+        c.outputpos = 0;
+    }
+    if(c.state == MC_LIST) closeclient(c);
+}
+
+/// Receive from a stream socket: the number of bytes, 0 if it would block, -1 if the connection is gone.
+/// enet_socket_receive() returns 0 for both of the last two, edge triggered polling needs to tell them apart.
+int receivestream(ENetSocket sock, void *data, int len)
+{
+    int res;
+#ifdef WIN32
+    res = recv(sock, (char *)data, len, 0);
+    if(res == SOCKET_ERROR) return WSAGetLastError() == WSAEWOULDBLOCK ? 0 : -1;
+#else
+    do res = recv(sock, data, len, 0); while(res < 0 && errno == EINTR);
+    if(res < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+#endif
+    return res > 0 ? res : -1;
+}
+
+/// Read until the socket would block, or until there are replies to send first:
+/// waiting for writability then, the socket gets reported again once we wait for input.
+void receiveclient(client &c)
+{
+    do
+    {
+        int res = receivestream(c.socket, &c.input[c.inputpos], sizeof(c.input) - c.inputpos);
+        if(res<0) { closeclient(c); return; }
+        if(!res) return;
+        c.inputpos += res;
+        c.input[min(c.inputpos, (int)sizeof(c.input)-1)] = '\0';
+        if(!checkclientinput(c)) { closeclient(c); return; }
     }
+    while(!c.sending());
+}
+
+void handleclient(client &c, int events)
+{
+    if(c.state == MC_CLOSED) return;
+    if(events&socketpoller::WRITE && c.sending()) sendclient(c);
+    if(c.state == MC_CLOSED) return;
+    if(events&socketpoller::READ) receiveclient(c);
+    if(c.state == MC_CLOSED) return;
+    if(c.output.length() > OUTPUT_LIMIT) closeclient(c);
+    else updatepoll(c);
+}
 
+/// Expire auth requests and idle connections, only once per SWEEP_TIME instead of on every wakeup.
+void sweepclients()
+{
+    static enet_uint32 lastsweep = 0;
+    if(ENET_TIME_DIFFERENCE(servtime, lastsweep) < SWEEP_TIME) return;
+    lastsweep = servtime;
     loopv(clients)
     {
         client &c = *clients[i];
-        if((c.message || c.output.length()) && ENET_SOCKETSET_CHECK(writeset, c.socket))
-        {
-            const char *data = c.output.length() ? c.output.getbuf() : c.message->getbuf();
-            int len = c.output.length() ? c.output.length() : c.message->length();
-            ENetBuffer buf;
-            buf.data = (void *)&data[c.outputpos];
-            buf.dataLength = len-c.outputpos;
-            int res = enet_socket_send(c.socket, NULL, &buf, 1);
-            if(res>=0)
-            {
-                c.outputpos += res;
-                if(c.outputpos>=len)
-                {
-                    if(c.output.length()) c.output.setsize(0);
-                    else
-                    { 
-                        c.message->purge();
-                        c.message = NULL; 
-                    }
-                    c.outputpos = 0;
-                    if(!c.message && c.output.empty() && c.shouldpurge)
-                    {
-                        purgeclient(i--);
-                        continue;
-                    }
-                }
-            }
-            else { purgeclient(i--); continue; }
-        }
-        if(ENET_SOCKETSET_CHECK(readset, c.socket))
-        {
-            ENetBuffer buf;
-            buf.data = &c.input[c.inputpos];
-            buf.dataLength = sizeof(c.input) - c.inputpos;
-            int res = enet_socket_receive(c.socket, NULL, &buf, 1);
-            if(res>0)
-            {
-                c.inputpos += res;
-                c.input[min(c.inputpos, (int)sizeof(c.input)-1)] = '\0';
-                if(!checkclientinput(c)) { purgeclient(i--); continue; }
-            }
-            else { purgeclient(i--); continue; }
-        }
-        if(c.output.length() > OUTPUT_LIMIT) { purgeclient(i--); continue; }
-        if(ENET_TIME_DIFFERENCE(servtime, c.lastinput) >= (c.registeredserver ? KEEPALIVE_TIME : CLIENT_TIME)) { purgeclient(i--); continue; }
+        if(c.state == MC_CLOSED) continue;
+        if(c.authreqs.length()) purgeauths(c);
+        if(ENET_TIME_DIFFERENCE(servtime, c.lastinput) >= (c.registeredserver ? KEEPALIVE_TIME : CLIENT_TIME)) closeclient(c);
+    }
+}
+
+void checkclients()
+{
+    static vector<socketpoller::event> ready;
+    poller.wait(ready, acceptpending ? 0 : 1000);
+    if(acceptpending) acceptclients();
+    loopv(ready)
+    {
+        socketpoller::event &e = ready[i];
+        if(e.data == &pingsocket) checkserverpongs();
+        else if(e.data == &serversocket) acceptclients();
+        else handleclient(*(client *)e.data, e.events);
     }
+    sweepclients();
+    purgeclients();
 }
 
 void banclients()
 {
-    loopvrev(clients) if(checkban(bans, clients[i]->address.host)) purgeclient(i);
+    loopv(clients) if(checkban(bans, clients[i]->address.host)) closeclient(*clients[i]);
+    purgeclients();
 }
 
 volatile int reloadcfg = 1;
@@ -700,6 +1062,7 @@ int main(int argc, char **argv)
         {
             spdlog::get("global")->info("reloading master.cfg");
             execfile(cfgname);
+            updatebans();
             bangameservers();
             banclients();
             gengbanlist();
@@ -0,0 +1,232 @@
+/// Load generator for the master server.
+///
+/// Registers a number of fake game servers (which answer the master's pings) and
+/// lets many concurrent clients fetch the server list over and over again.
+/// Every second it prints how many lists were fetched and how long a fetch took.
+/// All sockets are driven by one poll() loop, so thousands of connections do not need thousands of threads.
+///
+/// The master allows only a few servers and connections per ip, so every fake server and
+/// client binds to its own loopback address (127.0.0.2 and up): run it on the master's host.
+///
+/// usage: master-loadgen [servers] [clients] [seconds] [masterport]
+
+#include <enet/enet.h>
+#ifdef WIN32
+#define poll WSAPoll
+#else
+#include <poll.h>
+#endif
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+typedef std::chrono::steady_clock steadyclock;
+
+long lists = 0, failures = 0, listmillis = 0, registered = 0;
+
+ENetAddress master;
+
+enum
+{
+    C_PING,     // a game server's info socket, echoes the master's pings
+    C_REGISTER, // a game server's registration at the master
+    C_LIST      // a client fetching the server list
+};
+
+struct connection
+{
+    int type, n;
+    ENetSocket sock;
+    bool connected, succeeded;
+    /// What is still to be sent once the connection is established.
+    std::string output;
+    steadyclock::time_point start, retry;
+
+    connection(int type, int n) : type(type), n(n), sock(ENET_SOCKET_NULL), connected(false), succeeded(false) {}
+};
+
+std::vector<connection> connections;
+
+ENetAddress loopback(int n, int port)
+{
+    ENetAddress address;
+    address.host = ENET_HOST_TO_NET_32(0x7F000002 + n); // 127.0.0.2 + n
+    address.port = port;
+    return address;
+}
+
+int gameserverport(int n) { return 20000 + 2*(n%10); }
+
+void closeconnection(connection &c)
+{
+    if(c.sock != ENET_SOCKET_NULL) enet_socket_destroy(c.sock);
+    c.sock = ENET_SOCKET_NULL;
+}
+
+/// Start a non-blocking connect, the request is sent as soon as it is established.
+bool connectmaster(connection &c, const ENetAddress &source, const std::string &request)
+{
+    c.sock = enet_socket_create(ENET_SOCKET_TYPE_STREAM);
+    c.connected = false;
+    c.output = request;
+    c.start = steadyclock::now();
+    if(c.sock == ENET_SOCKET_NULL) return false;
+    enet_socket_set_option(c.sock, ENET_SOCKOPT_NONBLOCK, 1);
+    if(enet_socket_bind(c.sock, &source) < 0 || enet_socket_connect(c.sock, &master) < 0)
+    {
+        closeconnection(c);
+        return false;
+    }
+    return true;
+}
+
+void startlist(connection &c)
+{
+    if(connectmaster(c, loopback(1000 + c.n/8, 0), "list\n")) return;
+    failures++;
+    c.retry = steadyclock::now() + std::chrono::milliseconds(100);
+}
+
+void failconnection(connection &c)
+{
+    failures++;
+    closeconnection(c);
+    c.retry = steadyclock::now() + std::chrono::milliseconds(100);
+}
+
+/// The master closed the connection: a list is complete, a registration got dropped.
+void finishconnection(connection &c)
+{
+    closeconnection(c);
+    if(c.type != C_LIST) return;
+    lists++;
+    listmillis += long(std::chrono::duration_cast<std::chrono::milliseconds>(steadyclock::now() - c.start).count());
+    startlist(c);
+}
+
+short pollevents(const connection &c)
+{
+    if(c.type == C_PING) return POLLIN;
+    return POLLIN | (!c.connected || c.output.size() ? POLLOUT : 0);
+}
+
+void handleconnection(connection &c, short events)
+{
+    char data[16384];
+    ENetBuffer buf;
+    buf.data = data;
+    buf.dataLength = sizeof(data);
+    if(c.type == C_PING)
+    {
+        ENetAddress from;
+        int len = enet_socket_receive(c.sock, &from, &buf, 1);
+        if(len <= 0) return;
+        buf.dataLength = len;
+        enet_socket_send(c.sock, &from, &buf, 1);
+        return;
+    }
+    if(!c.connected)
+    {
+        int error = 0;
+        if(enet_socket_get_option(c.sock, ENET_SOCKOPT_ERROR, &error) < 0 || error) { failconnection(c); return; }
+        c.connected = true;
+    }
+    if(events&POLLOUT && c.output.size())
+    {
+        ENetBuffer out;
+        out.data = (void *)c.output.data();
+        out.dataLength = c.output.size();
+        int sent = enet_socket_send(c.sock, NULL, &out, 1);
+        if(sent < 0) { failconnection(c); return; }
+        c.output.erase(0, sent);
+    }
+    if(events&(POLLIN|POLLHUP|POLLERR))
+    {
+        // poll() said it is readable, so nothing read means the master closed it
+        int len = enet_socket_receive(c.sock, NULL, &buf, 1);
+        if(len <= 0) { finishconnection(c); return; }
+        if(c.type == C_REGISTER && !c.succeeded && strstr(std::string(data, len).c_str(), "succreg"))
+        {
+            c.succeeded = true;
+            registered++;
+        }
+    }
+}
+
+/// A game server: registers over tcp, then answers the master's pings on port+1.
+void addgameserver(int n)
+{
+    connections.emplace_back(C_PING, n);
+    connection &ping = connections.back();
+    ENetAddress pingaddress = loopback(n/10, gameserverport(n)+1);
+    ping.sock = enet_socket_create(ENET_SOCKET_TYPE_DATAGRAM);
+    if(ping.sock == ENET_SOCKET_NULL || enet_socket_bind(ping.sock, &pingaddress) < 0) { failures++; closeconnection(ping); return; }
+    enet_socket_set_option(ping.sock, ENET_SOCKOPT_NONBLOCK, 1);
+
+    connections.emplace_back(C_REGISTER, n);
+    connection &reg = connections.back();
+    if(!connectmaster(reg, loopback(n/10, 0), "regserv " + std::to_string(gameserverport(n)) + "\n")) failures++;
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv)
+{
+    int numservers = argc > 1 ? atoi(argv[1]) : 100, numclients = argc > 2 ? atoi(argv[2]) : 64, seconds = argc > 3 ? atoi(argv[3]) : 30;
+    master.host = ENET_HOST_TO_NET_32(0x7F000001);
+    master.port = argc > 4 ? atoi(argv[4]) : 31416;
+    if(enet_initialize() < 0) { fprintf(stderr, "unable to initialise network module\n"); return EXIT_FAILURE; }
+
+    connections.reserve(2*numservers + numclients);
+    for(int i = 0; i < numservers; i++) addgameserver(i);
+    for(int i = 0; i < numclients; i++)
+    {
+        connections.emplace_back(C_LIST, i);
+        startlist(connections.back());
+    }
+
+    std::vector<pollfd> fds;
+    std::vector<size_t> owners;
+    steadyclock::time_point report = steadyclock::now() + std::chrono::seconds(1);
+    for(int t = 1; t <= seconds;)
+    {
+        steadyclock::time_point now = steadyclock::now();
+        fds.clear();
+        owners.clear();
+        for(size_t i = 0; i < connections.size(); i++)
+        {
+            connection &c = connections[i];
+            if(c.sock == ENET_SOCKET_NULL && c.type == C_LIST && now >= c.retry) startlist(c);
+            if(c.sock == ENET_SOCKET_NULL) continue;
+            pollfd p;
+            p.fd = c.sock;
+            p.events = pollevents(c);
+            p.revents = 0;
+            fds.push_back(p);
+            owners.push_back(i);
+        }
+
+        int timeout = int(std::chrono::duration_cast<std::chrono::milliseconds>(report - now).count());
+        if(poll(fds.data(), fds.size(), timeout < 0 ? 0 : timeout) > 0)
+        {
+            for(size_t i = 0; i < fds.size(); i++) if(fds[i].revents) handleconnection(connections[owners[i]], fds[i].revents);
+        }
+
+        if(steadyclock::now() < report) continue;
+        printf("%3ds: %ld lists/s, %.1f ms per list, %ld/%d servers registered, %ld failures\n",
+               t, lists, lists ? double(listmillis)/lists : 0.0, registered, numservers, failures);
+        fflush(stdout);
+        lists = listmillis = 0;
+        report += std::chrono::seconds(1);
+        t++;
+    }
+    for(connection &c : connections) closeconnection(c);
+    enet_deinitialize();
+    return EXIT_SUCCESS;
+}
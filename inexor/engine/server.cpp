@@ -1,9 +1,16 @@
 // server.cpp: little more than enhanced multicaster
 // runs dedicated or as client coroutine
 
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
 #include "inexor/engine/engine.hpp"
 #include "inexor/crashreporter/CrashReporter.hpp"
 #include "inexor/util/Logging.hpp"
+#include "inexor/util/SpscByteQueue.hpp"
 #include "inexor/fpsgame/network_types.hpp"
 
 #define LOGSTRLEN 512
@@ -55,18 +62,22 @@ struct client                   // server side version of "dynent" type
 {
     int type;
     int num;
+    /// With the network thread running only its identity may be used, the network thread owns it.
     ENetPeer *peer;
+    /// The number the network thread gave this connection, see servernet.
+    int connection;
+    uint ip;
     string hostname;
     void *info;
 };
 
-vector<client *> clients;
+SERVERLOCAL vector<client *> clients;
 
-ENetHost *serverhost = NULL;
-int laststatus = 0; 
-ENetSocket pongsock = ENET_SOCKET_NULL, lansock = ENET_SOCKET_NULL;
+SERVERLOCAL ENetHost *serverhost = NULL;
+SERVERLOCAL int laststatus = 0; 
+SERVERLOCAL ENetSocket pongsock = ENET_SOCKET_NULL, lansock = ENET_SOCKET_NULL;
 
-int localclients = 0, nonlocalclients = 0;
+SERVERLOCAL int localclients = 0, nonlocalclients = 0;
 
 bool hasnonlocalclients() { return nonlocalclients!=0; }
 bool haslocalclients() { return localclients!=0; }
@@ -95,12 +106,360 @@ client &addclient(int type)
     return *c;
 }
 
+/// A loopback datagram socket to wake up a thread which waits for it in select.
+struct wakesocket
+{
+    ENetSocket sock = ENET_SOCKET_NULL;
+    ENetAddress address;
+
+    bool open()
+    {
+        sock = enet_socket_create(ENET_SOCKET_TYPE_DATAGRAM);
+        if(sock == ENET_SOCKET_NULL) return false;
+        address.host = ENET_HOST_TO_NET_32(0x7F000001);
+        address.port = ENET_PORT_ANY;
+        if(enet_socket_bind(sock, &address) < 0 || enet_socket_get_address(sock, &address) < 0)
+        {
+            close();
+            return false;
+        }
+        enet_socket_set_option(sock, ENET_SOCKOPT_NONBLOCK, 1);
+        return true;
+    }
+
+    void close()
+    {
+        if(sock != ENET_SOCKET_NULL) enet_socket_destroy(sock);
+        sock = ENET_SOCKET_NULL;
+    }
+
+    /// Any thread: make the socket readable.
+    void wake()
+    {
+        char c = 0;
+        ENetBuffer buf;
+        buf.data = &c;
+        buf.dataLength = 1;
+        enet_socket_send(sock, &address, &buf, 1);
+    }
+
+    /// The waiting thread: read all wakeups, once the socket was readable.
+    void drain()
+    {
+        char data[64];
+        ENetBuffer buf;
+        buf.data = data;
+        buf.dataLength = sizeof(data);
+        while(enet_socket_receive(sock, NULL, &buf, 1) > 0);
+    }
+};
+
+/// Records passed between the game thread and the network thread of a dedicated server.
+enum
+{
+    // network thread -> game thread
+    NET_CONNECT = 0,    // a client connected from host
+    NET_RECEIVE,        // a packet arrived on channel arg
+    NET_DISCONNECT,     // the peer disconnected or timed out
+    NET_RELEASE,        // ENet is done with a packet the game sent, drop the reference held for it
+    // game thread -> network thread
+    NET_SEND,           // send the packet on channel arg
+    NET_KICK,           // disconnect the peer for reason arg
+    NET_FLUSH,          // send everything queued so far
+    NET_DUPLICATEPEERS  // allow arg connections per ip
+};
+
+struct netrecord
+{
+    int type, peer, connection, arg;
+    ENetPacket *packet;
+    enet_uint32 host;
+};
+
+/// The network thread of a dedicated server.
+///
+/// It alone touches the ENet host: it services it, sends and disconnects, while the game thread runs the simulation.
+/// They talk through two single producer single consumer queues of netrecords: events go to the game thread,
+/// requests to the network thread. A burst of traffic therefore never stalls a tick on socket I/O,
+/// and a long tick does not keep ENet from acknowledging and resending.
+///
+/// Packets stay owned by the game thread: it holds a reference for every send it hands over and the network thread
+/// sends a NO_ALLOCATE wrapper around the packet's data. Once ENet is done with the wrapper the reference comes back
+/// as NET_RELEASE, so referenceCount and freeCallback are still only touched on the game thread.
+/// Peers are addressed by their index plus a connection number which changes with every connect, so requests
+/// for a peer which disconnected in between get dropped instead of reaching whoever got that peer next.
+struct servernet
+{
+    enum { QUEUESIZE = 1<<20, WAITTIME = 5 };
+
+    ENetHost *host;
+    inexor::util::SpscByteQueue events, requests;
+    std::thread thread;
+    std::atomic<bool> running;
+    /// The game thread sleeps on this while there are no events.
+    std::mutex eventlock;
+    std::condition_variable hasevents;
+    /// Wakes the network thread up.
+    wakesocket waker;
+    /// The info sockets (owned by the game thread) are only watched to wake the game thread up,
+    /// not again until it handled them.
+    ENetSocket infosocks[2];
+    std::atomic<bool> infopending;
+    /// How long the network thread sleeps without any connected peer.
+    int idlemillis;
+    /// Host statistics and round trip times, published for the game thread on every flush.
+    std::atomic<enet_uint32> sentdata, receiveddata;
+    std::unique_ptr<std::atomic<int>[]> roundtrips;
+
+    // only used by the network thread
+    vector<int> connections;
+    vector<ENetPacket *> released;
+    int nextconnection;
+
+    servernet(ENetHost *host, ENetSocket pongsock, ENetSocket lansock, int idlemillis)
+        : host(host), events(QUEUESIZE), requests(QUEUESIZE), running(false), infopending(false),
+          idlemillis(idlemillis), sentdata(0), receiveddata(0), roundtrips(new std::atomic<int>[host->peerCount]), nextconnection(0)
+    {
+        infosocks[0] = pongsock;
+        infosocks[1] = lansock;
+        loopi(host->peerCount) roundtrips[i] = ENET_PEER_DEFAULT_ROUND_TRIP_TIME;
+        connections.pad(host->peerCount);
+        loopv(connections) connections[i] = -1;
+    }
+
+    ~servernet() { stop(); }
+
+    bool start()
+    {
+        if(!waker.open()) return false;
+        running = true;
+        thread = std::thread([this] { run(); });
+        return true;
+    }
+
+    void stop()
+    {
+        if(!running) return;
+        running = false;
+        wakeup();
+        thread.join();
+        waker.close();
+    }
+
+    /// A whole record or nothing, the reader never sees half of one.
+    static bool push(inexor::util::SpscByteQueue &q, const netrecord &r)
+    {
+        if(q.space() < sizeof(r)) return false;
+        q.write(&r, sizeof(r));
+        return true;
+    }
+
+    static bool pop(inexor::util::SpscByteQueue &q, netrecord &r)
+    {
+        if(q.size() < sizeof(r)) return false;
+        q.read(&r, sizeof(r));
+        return true;
+    }
+
+    /// Game thread: let the network thread look at the requests.
+    void wakeup() { waker.wake(); }
+
+    /// Game thread: hand a request over, waits only while the network thread is backed up.
+    void request(const netrecord &r)
+    {
+        while(!push(requests, r))
+        {
+            wakeup();
+            std::this_thread::yield();
+        }
+    }
+
+    /// Game thread: the info sockets were handled, watch them again.
+    void infohandled()
+    {
+        if(!infopending) return;
+        infopending = false;
+        wakeup();
+    }
+
+    /// Game thread: wait up to timeout milliseconds for an event or readable info sockets.
+    void wait(uint timeout)
+    {
+        std::unique_lock<std::mutex> lock(eventlock);
+        hasevents.wait_for(lock, std::chrono::milliseconds(timeout), [this] { return !events.empty() || infopending || !running; });
+    }
+
+    /// Network thread: wake the game thread up if it sleeps in wait().
+    void notify()
+    {
+        // taking the lock orders this after the game thread's last check of the queue
+        { std::lock_guard<std::mutex> lock(eventlock); }
+        hasevents.notify_one();
+    }
+
+    /// The servernet running on this thread, for releasewrapper().
+    static thread_local servernet *current;
+
+    /// Called by ENet when it destroys a wrapper, always on the network thread while it is running.
+    static void releasewrapper(ENetPacket *wrapper);
+
+    int peerindex(ENetPeer *peer) { return int(peer - host->peers); }
+
+    void send(const netrecord &r)
+    {
+        ENetPeer *peer = &host->peers[r.peer];
+        if(connections[r.peer] != r.connection || peer->state != ENET_PEER_STATE_CONNECTED) { released.add(r.packet); return; }
+        ENetPacket *wrapper = enet_packet_create(r.packet->data, r.packet->dataLength, r.packet->flags | ENET_PACKET_FLAG_NO_ALLOCATE);
+        wrapper->userData = r.packet;
+        wrapper->freeCallback = releasewrapper;
+        if(enet_peer_send(peer, r.arg, wrapper) < 0) enet_packet_destroy(wrapper);
+    }
+
+    void publishstats()
+    {
+        sentdata += host->totalSentData;
+        receiveddata += host->totalReceivedData;
+        host->totalSentData = host->totalReceivedData = 0;
+        loopi(host->peerCount) roundtrips[i] = int(host->peers[i].roundTripTime + host->peers[i].roundTripTimeVariance);
+    }
+
+    void handlerequests()
+    {
+        netrecord r;
+        while(pop(requests, r)) switch(r.type)
+        {
+            case NET_SEND:
+                send(r);
+                break;
+
+            case NET_KICK:
+                if(connections[r.peer] == r.connection) enet_peer_disconnect(&host->peers[r.peer], r.arg);
+                break;
+
+            case NET_FLUSH:
+                enet_host_flush(host);
+                publishstats();
+                break;
+
+            case NET_DUPLICATEPEERS:
+                host->duplicatePeers = r.arg;
+                break;
+        }
+    }
+
+    /// Pass the releases on, they may not get lost, so they wait here while the game thread is backed up.
+    bool pushreleased()
+    {
+        int n = 0;
+        netrecord r = { NET_RELEASE, -1, -1, 0, NULL, 0 };
+        for(; n < released.length(); n++)
+        {
+            r.packet = released[n];
+            if(!push(events, r)) break;
+        }
+        released.remove(0, n);
+        return n > 0;
+    }
+
+    /// Hand ENet's events to the game thread until there are none or the game thread is backed up.
+    bool serviceevents()
+    {
+        bool pushed = false;
+        ENetEvent event;
+        // a single service may also destroy wrappers, keep room for their releases
+        while(events.space() >= 64*sizeof(netrecord) && enet_host_service(host, &event, 0) > 0)
+        {
+            int peer = peerindex(event.peer);
+            netrecord r = { NET_CONNECT, peer, connections[peer], 0, NULL, event.peer->address.host };
+            switch(event.type)
+            {
+                case ENET_EVENT_TYPE_CONNECT:
+                    r.connection = connections[peer] = nextconnection++;
+                    break;
+
+                case ENET_EVENT_TYPE_RECEIVE:
+                    r.type = NET_RECEIVE;
+                    r.arg = event.channelID;
+                    r.packet = event.packet;
+                    break;
+
+                case ENET_EVENT_TYPE_DISCONNECT:
+                    r.type = NET_DISCONNECT;
+                    connections[peer] = -1;
+                    break;
+
+                default:
+                    continue;
+            }
+            push(events, r);
+            pushed = true;
+        }
+        return pushed;
+    }
+
+    /// Sleep until a datagram arrives for the host, the wake socket or an info socket.
+    void waitsockets()
+    {
+        bool active = false;
+        loopi(host->peerCount) if(host->peers[i].state != ENET_PEER_STATE_DISCONNECTED) { active = true; break; }
+        // backed up: check again soon, the game thread does not wake us up when it drained the events
+        int timeout = events.space() < 64*sizeof(netrecord) || released.length() ? 1 : (active || !idlemillis ? WAITTIME : idlemillis);
+        ENetSocketSet readset;
+        ENET_SOCKETSET_EMPTY(readset);
+        ENetSocket maxsock = max(host->socket, waker.sock);
+        ENET_SOCKETSET_ADD(readset, host->socket);
+        ENET_SOCKETSET_ADD(readset, waker.sock);
+        if(!infopending) loopi(2) if(infosocks[i] != ENET_SOCKET_NULL)
+        {
+            maxsock = max(maxsock, infosocks[i]);
+            ENET_SOCKETSET_ADD(readset, infosocks[i]);
+        }
+        if(enet_socketset_select(maxsock, &readset, NULL, timeout) <= 0) return;
+        if(ENET_SOCKETSET_CHECK(readset, waker.sock)) waker.drain();
+        if(!infopending) loopi(2) if(infosocks[i] != ENET_SOCKET_NULL && ENET_SOCKETSET_CHECK(readset, infosocks[i]))
+        {
+            infopending = true;
+            notify();
+            break;
+        }
+    }
+
+    void run()
+    {
+        current = this;
+        while(running)
+        {
+            handlerequests();
+            bool pushed = pushreleased();
+            if(serviceevents()) pushed = true;
+            if(pushreleased()) pushed = true;
+            if(pushed) notify();
+            waitsockets();
+        }
+    }
+};
+
+static SERVERLOCAL servernet *network = NULL;
+/// The client of every peer while the network thread runs, it owns the peers' data field.
+static SERVERLOCAL vector<client *> netclients;
+
+thread_local servernet *servernet::current = NULL;
+
+void servernet::releasewrapper(ENetPacket *wrapper)
+{
+    if(current) current->released.add((ENetPacket *)wrapper->userData);
+}
+
 void delclient(client *c)
 {
     if(!c) return;
     switch(c->type)
     {
-        case ST_TCPIP: nonlocalclients--; if(c->peer) c->peer->data = NULL; break;
+        case ST_TCPIP:
+            nonlocalclients--;
+            if(c->peer && network) { int peer = network->peerindex(c->peer); if(netclients[peer] == c) netclients[peer] = NULL; }
+            else if(c->peer) c->peer->data = NULL;
+            break;
         case ST_LOCAL: localclients--; break;
         case ST_EMPTY: return;
     }
@@ -115,6 +474,9 @@ void delclient(client *c)
 
 void cleanupserver()
 {
+    // the packets still held for the network thread die with the process
+    if(network) network->stop();
+    DELETEP(network);
     if(serverhost) enet_host_destroy(serverhost);
     serverhost = NULL;
 
@@ -124,16 +486,29 @@ void cleanupserver()
 }
 
 VARF(maxclients, 0, DEFAULTCLIENTS, MAXCLIENTS, { if(!maxclients) maxclients = DEFAULTCLIENTS; });
-VARF(maxdupclients, 0, 0, MAXCLIENTS, { if(serverhost) serverhost->duplicatePeers = maxdupclients ? maxdupclients : MAXCLIENTS; });
+VARF(maxdupclients, 0, 0, MAXCLIENTS,
+{
+    int duplicates = maxdupclients ? maxdupclients : MAXCLIENTS;
+    if(network) network->request({ NET_DUPLICATEPEERS, -1, -1, duplicates, NULL, 0 });
+    else if(serverhost) serverhost->duplicatePeers = duplicates;
+});
 
 void process(ENetPacket *packet, int sender, int chan);
 //void disconnect_client(int n, int reason);
 
 int getservermtu() { return serverhost ? serverhost->mtu : -1; }
 void *getclientinfo(int i) { return !clients.inrange(i) || clients[i]->type==ST_EMPTY ? NULL : clients[i]->info; }
-ENetPeer *getclientpeer(int i) { return clients.inrange(i) && clients[i]->type==ST_TCPIP ? clients[i]->peer : NULL; }
+/// NULL while the network thread runs: the peer belongs to it then, see getclientroundtrip().
+ENetPeer *getclientpeer(int i) { return !network && clients.inrange(i) && clients[i]->type==ST_TCPIP ? clients[i]->peer : NULL; }
 int getnumclients()        { return clients.length(); }
-uint getclientip(int n)    { return clients.inrange(n) && clients[n]->type==ST_TCPIP ? clients[n]->peer->address.host : 0; }
+uint getclientip(int n)    { return clients.inrange(n) && clients[n]->type==ST_TCPIP ? clients[n]->ip : 0; }
+
+int getclientroundtrip(int i)
+{
+    if(!clients.inrange(i) || clients[i]->type!=ST_TCPIP) return -1;
+    if(network) return network->roundtrips[network->peerindex(clients[i]->peer)];
+    return int(clients[i]->peer->roundTripTime + clients[i]->peer->roundTripTimeVariance);
+}
 
 void sendpacket(int n, int chan, ENetPacket *packet, int exclude)
 {
@@ -147,7 +522,13 @@ void sendpacket(int n, int chan, ENetPacket *packet, int exclude)
     {
         case ST_TCPIP:
         {
-            enet_peer_send(clients[n]->peer, chan, packet);
+            if(network)
+            {
+                // the reference comes back as NET_RELEASE once ENet is done with it
+                packet->referenceCount++;
+                network->request({ NET_SEND, network->peerindex(clients[n]->peer), clients[n]->connection, chan, packet, 0 });
+            }
+            else enet_peer_send(clients[n]->peer, chan, packet);
             break;
         }
 
@@ -268,7 +649,8 @@ const char *disconnectreason(int reason)
 void disconnect_client(int n, int reason)
 {
     if(!clients.inrange(n) || clients[n]->type!=ST_TCPIP) return;
-    enet_peer_disconnect(clients[n]->peer, reason);
+    if(network) network->request({ NET_KICK, network->peerindex(clients[n]->peer), clients[n]->connection, reason, NULL, 0 });
+    else enet_peer_disconnect(clients[n]->peer, reason);
     server::clientdisconnect(n);
     delclient(clients[n]);
     const char *msg = disconnectreason(reason);
@@ -317,11 +699,50 @@ vector<char> masterout, masterin;
 int masteroutpos = 0, masterinpos = 0;
 VARN(updatemaster, allowupdatemaster, 0, 1, 1);
 
+/// A game instance of a dedicated server which hosts several of them (see serverinstances).
+/// Each one runs on a thread of its own with its own clients, host and info sockets. Only the master server connection
+/// stays with the main thread, which passes the requests and replies of the instances along.
+struct serverinstance
+{
+    int num, port;
+    std::thread thread;
+    /// Guards the master server data below.
+    std::mutex lock;
+    /// Requests for the master server which the main thread still has to send, the lines it got for this instance.
+    vector<char> masterout, masterin;
+    /// Whether the main thread connected to or lost the master server since the instance looked.
+    bool masterconnected = false, masterdisconnected = false;
+
+    serverinstance(int num, int port) : num(num), port(port) {}
+};
+
+/// All game instances, empty unless there are several of them.
+static vector<serverinstance *> instances;
+/// The game instance running on this thread, NULL on the main thread.
+static SERVERLOCAL serverinstance *curinstance = NULL;
+/// Wakes the main thread up when an instance has requests for the master server.
+static wakesocket masterwaker;
+
+int getserverinstance() { return curinstance ? curinstance->num : 0; }
+
+/// Main thread: tell every game instance that the master server connection went up or down.
+static void notifyinstances(bool connected)
+{
+    loopv(instances)
+    {
+        serverinstance &inst = *instances[i];
+        std::lock_guard<std::mutex> guard(inst.lock);
+        if(connected) inst.masterconnected = true;
+        else inst.masterdisconnected = true;
+    }
+}
+
 void disconnectmaster()
 {
     if(mastersock != ENET_SOCKET_NULL) 
     {
-        server::masterdisconnected();
+        if(instances.length()) notifyinstances(false);
+        else server::masterdisconnected();
         enet_socket_destroy(mastersock);
         mastersock = ENET_SOCKET_NULL;
     }
@@ -370,6 +791,19 @@ ENetSocket connectmaster(bool wait)
 
 bool requestmaster(const char *req)
 {
+    if(curinstance)
+    {
+        // the main thread sends it along with the requests of the other instances
+        if(!mastername[0]) return false;
+        {
+            std::lock_guard<std::mutex> guard(curinstance->lock);
+            if(curinstance->masterout.length() >= 4096) return false;
+            curinstance->masterout.put(req, strlen(req));
+        }
+        masterwaker.wake();
+        return true;
+    }
+
     if(mastersock == ENET_SOCKET_NULL)
     {
         mastersock = connectmaster(false);
@@ -389,11 +823,10 @@ bool requestmasterf(const char *fmt, ...)
     return requestmaster(req);
 }
 
-void processmasterinput()
+/// Call handle(line, cmdlen, args) for every complete line in the buffer from pos on, pos ends up behind the last one.
+template<class F> static void splitmasterlines(vector<char> &in, int &pos, F handle)
 {
-    if(masterinpos >= masterin.length()) return;
-
-    char *input = &masterin[masterinpos], *end = (char *)memchr(input, '\n', masterin.length() - masterinpos);
+    char *input = &in[pos], *end = (char *)memchr(input, '\n', in.length() - pos);
     while(end)
     {
         *end++ = '\0';
@@ -403,16 +836,39 @@ void processmasterinput()
         int cmdlen = args - input;
         while(args < end && iscubespace(*args)) args++;
 
-        if(matchstring(input, cmdlen, "failreg"))
-            spdlog::get("global")->error("master server registration failed: {0}", args);
-        else if(matchstring(input, cmdlen, "succreg"))
-            spdlog::get("global")->info("master server registration succeeded");
-        else server::processmasterinput(input, cmdlen, args);
+        handle(input, cmdlen, args);
 
-        masterinpos = end - masterin.getbuf();
+        pos = end - in.getbuf();
         input = end;
-        end = (char *)memchr(input, '\n', masterin.length() - masterinpos);
-    } 
+        end = (char *)memchr(input, '\n', in.length() - pos);
+    }
+}
+
+void processmasterinput()
+{
+    if(masterinpos >= masterin.length()) return;
+
+    splitmasterlines(masterin, masterinpos, [](const char *line, int cmdlen, const char *args)
+    {
+        if(matchstring(line, cmdlen, "failreg"))
+            spdlog::get("global")->error("master server registration failed: {0}", args);
+        else if(matchstring(line, cmdlen, "succreg"))
+            spdlog::get("global")->info("master server registration succeeded");
+        else if(instances.length())
+        {
+            // replies to auth requests carry ids unique over all instances, the others ignore them
+            int len = strlen(line);
+            loopv(instances)
+            {
+                serverinstance &inst = *instances[i];
+                std::lock_guard<std::mutex> guard(inst.lock);
+                inst.masterin.put(line, len);
+                inst.masterin.add('\n');
+            }
+        }
+        else server::processmasterinput(line, cmdlen, args);
+    });
+    if(instances.empty()) server::masterinputprocessed();
 
     if(masterinpos >= masterin.length())
     {
@@ -463,7 +919,27 @@ void flushmasterinput()
     else disconnectmaster();
 }
 
-static ENetAddress pongaddr;
+/// Game instance: hand what the main thread got from the master server for it to the game.
+static void processinstancemaster()
+{
+    vector<char> input;
+    bool connected, disconnected;
+    {
+        std::lock_guard<std::mutex> guard(curinstance->lock);
+        input.move(curinstance->masterin);
+        connected = curinstance->masterconnected;
+        disconnected = curinstance->masterdisconnected;
+        curinstance->masterconnected = curinstance->masterdisconnected = false;
+    }
+    if(disconnected) server::masterdisconnected();
+    if(connected) server::masterconnected();
+    if(input.empty()) return;
+    int pos = 0;
+    splitmasterlines(input, pos, server::processmasterinput);
+    server::masterinputprocessed();
+}
+
+static SERVERLOCAL ENetAddress pongaddr;
 
 void sendserverinforeply(ucharbuf &p)
 {
@@ -475,14 +951,15 @@ void sendserverinforeply(ucharbuf &p)
 
 #define MAXPINGDATA 32
 
-void checkserversockets()        // reply all server info requests
+/// Fill the socket sets with the info, lan and master sockets.
+/// @return the highest socket added.
+static ENetSocket buildserversocketsets(ENetSocketSet &readset, ENetSocketSet &writeset)
 {
-    static ENetSocketSet readset, writeset;
     ENET_SOCKETSET_EMPTY(readset);
     ENET_SOCKETSET_EMPTY(writeset);
     ENetSocket maxsock = pongsock;
     ENET_SOCKETSET_ADD(readset, pongsock);
-    if(mastersock != ENET_SOCKET_NULL)
+    if(!curinstance && mastersock != ENET_SOCKET_NULL)
     {
         maxsock = max(maxsock, mastersock);
         ENET_SOCKETSET_ADD(readset, mastersock);
@@ -493,6 +970,39 @@ void checkserversockets()        // reply all server info requests
         maxsock = max(maxsock, lansock);
         ENET_SOCKETSET_ADD(readset, lansock);
     }
+    return maxsock;
+}
+
+/// Main thread: finish connecting to the master server or read from it, once select found its socket ready.
+static void checkmastersocket(ENetSocketSet &readset, ENetSocketSet &writeset)
+{
+    if(mastersock == ENET_SOCKET_NULL) return;
+    if(!masterconnected)
+    {
+        if(ENET_SOCKETSET_CHECK(readset, mastersock) || ENET_SOCKETSET_CHECK(writeset, mastersock)) 
+        { 
+            int error = 0;
+            if(enet_socket_get_option(mastersock, ENET_SOCKOPT_ERROR, &error) < 0 || error)
+            {
+                spdlog::get("global")->warn("could not connect to master server");
+                disconnectmaster();
+            }
+            else
+            {
+                masterconnecting = 0; 
+                masterconnected = totalmillis ? totalmillis : 1; 
+                if(instances.length()) notifyinstances(true);
+                else server::masterconnected(); 
+            }
+        }
+    }
+    if(mastersock != ENET_SOCKET_NULL && ENET_SOCKETSET_CHECK(readset, mastersock)) flushmasterinput();
+}
+
+void checkserversockets()        // reply all server info requests
+{
+    static SERVERLOCAL ENetSocketSet readset, writeset;
+    ENetSocket maxsock = buildserversocketsets(readset, writeset);
     if(enet_socketset_select(maxsock, &readset, &writeset, 0) <= 0) return;
 
     ENetBuffer buf;
@@ -511,28 +1021,7 @@ void checkserversockets()        // reply all server info requests
         server::serverinforeply(req, p);
     }
 
-    if(mastersock != ENET_SOCKET_NULL)
-    {
-        if(!masterconnected)
-        {
-            if(ENET_SOCKETSET_CHECK(readset, mastersock) || ENET_SOCKETSET_CHECK(writeset, mastersock)) 
-            { 
-                int error = 0;
-                if(enet_socket_get_option(mastersock, ENET_SOCKOPT_ERROR, &error) < 0 || error)
-                {
-                    spdlog::get("global")->warn("could not connect to master server");
-                    disconnectmaster();
-                }
-                else
-                {
-                    masterconnecting = 0; 
-                    masterconnected = totalmillis ? totalmillis : 1; 
-                    server::masterconnected(); 
-                }
-            }
-        }
-        if(mastersock != ENET_SOCKET_NULL && ENET_SOCKETSET_CHECK(readset, mastersock)) flushmasterinput();
-    }
+    if(!curinstance) checkmastersocket(readset, writeset);
 }
 
 VAR(serveruprate, 0, 0, INT_MAX);
@@ -540,21 +1029,25 @@ SVAR(serverip, "");
 VARF(serverport, 0, INEXOR_SERVER_PORT, MAX_POSSIBLE_PORT, { if(!serverport) serverport = server::serverport(); });
 
 #ifdef STANDALONE
-int curtime = 0, lastmillis = 0, elapsedtime = 0, totalmillis = 0;
+SERVERLOCAL int curtime = 0, lastmillis = 0, elapsedtime = 0, totalmillis = 0;
 #endif
 
 void updatemasterserver()
 {
     if(!masterconnected && lastconnectmaster && totalmillis-lastconnectmaster <= 5*60*1000) return;
-    if(mastername[0] && allowupdatemaster) requestmasterf("regserv %d\n", *serverport);
+    if(mastername[0] && allowupdatemaster)
+    {
+        if(instances.empty()) requestmasterf("regserv %d\n", *serverport);
+        else loopv(instances) requestmasterf("regserv %d\n", instances[i]->port);
+    }
     lastupdatemaster = totalmillis ? totalmillis : 1;
 }
 
-uint totalsecs = 0;
+SERVERLOCAL uint totalsecs = 0;
 
 void updatetime()
 {
-    static int lastsec = 0;
+    static SERVERLOCAL int lastsec = 0;
     if(totalmillis - lastsec >= 1000) 
     {
         int cursecs = (totalmillis - lastsec) / 1000;
@@ -563,12 +1056,140 @@ void updatetime()
     }
 }
 
+static const char * const tickphasenames[NUMTICKPHASES] = { "network", "update", "events", "ai", "gamemode", "worldstate", "demo" };
+SERVERLOCAL inexor::util::TickProfiler tickprofiler(tickphasenames, NUMTICKPHASES);
+
+VARF(tickprofiling, 0, 1, 1, { tickprofiler.enabled = tickprofiling != 0; tickprofiler.reset(); });
+/// Per phase timings of the last status interval (see serverslice), readable over RPC.
+SVAR(tickprofile, "");
+
+/// Write the current tick profile to a file, relative to the home directory.
+void dumptickprofile(const char *filename)
+{
+    stream *f = openutf8file(path(filename[0] ? filename : "tickprofile.txt", true), "w");
+    if(!f) { spdlog::get("global")->error("could not write tick profile to {0}", filename); return; }
+    f->putstring(tickprofiler.summary().c_str());
+    delete f;
+}
+COMMAND(dumptickprofile, "s");
+
+#ifndef WIN32
+/// Counts the dump requests, every game instance dumps its profile once it sees a new one.
+static volatile sig_atomic_t tickprofiledumps = 0;
+static SERVERLOCAL sig_atomic_t tickprofiledumped = 0;
+static void tickprofilesignal(int) { tickprofiledumps = tickprofiledumps + 1; }
+#endif
+
+/// Upper bound for the milliseconds a single server slice spends on handling incoming network events.
+/// Remaining events stay queued inside ENet and get handled in the next slice,
+/// so a burst of edit or map traffic delays the game simulation by at most this much (see server-loadgen).
+VAR(maxeventmillis, 0, 8, 1000);
+
+/// Handle an event of the host while the server runs on a single thread.
+static void handleserverevent(ENetEvent &event)
+{
+    switch(event.type)
+    {
+        case ENET_EVENT_TYPE_CONNECT:
+        {
+            client &c = addclient(ST_TCPIP);
+            c.peer = event.peer;
+            c.peer->data = &c;
+            c.ip = c.peer->address.host;
+            string hn;
+            copystring(c.hostname, (enet_address_get_host_ip(&c.peer->address, hn, sizeof(hn))==0) ? hn : "unknown");
+            spdlog::get("global")->info("client connected ({0})", c.hostname);
+            int reason = server::clientconnect(c.num, c.peer->address.host);
+            if(reason) disconnect_client(c.num, reason);
+            break;
+        }
+        case ENET_EVENT_TYPE_RECEIVE:
+        {
+            client *c = (client *)event.peer->data;
+            if(c) process(event.packet, c->num, event.channelID);
+            if(event.packet->referenceCount==0) enet_packet_destroy(event.packet);
+            break;
+        }
+        case ENET_EVENT_TYPE_DISCONNECT: 
+        {
+            client *c = (client *)event.peer->data;
+            if(!c) break;
+            spdlog::get("global")->info("disconnected client ({0})", c->hostname);
+            server::clientdisconnect(c->num);
+            delclient(c);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+/// Handle the events the network thread passed on, waiting up to timeout milliseconds for the first one.
+static void handlenetevents(uint timeout)
+{
+    if(network->events.empty()) network->wait(timeout);
+    enet_uint32 eventstart = enet_time_get();
+    netrecord r;
+    while(servernet::pop(network->events, r))
+    {
+        inexor::util::ScopedPhaseTimer timer(tickprofiler, TICK_NETWORK);
+        client *c = r.peer >= 0 ? netclients[r.peer] : NULL;
+        if(c && c->connection != r.connection) c = NULL;
+        switch(r.type)
+        {
+            case NET_CONNECT:
+            {
+                client &n = addclient(ST_TCPIP);
+                n.peer = &serverhost->peers[r.peer];
+                n.connection = r.connection;
+                n.ip = r.host;
+                netclients[r.peer] = &n;
+                ENetAddress address = { r.host, 0 };
+                string hn;
+                copystring(n.hostname, (enet_address_get_host_ip(&address, hn, sizeof(hn))==0) ? hn : "unknown");
+                spdlog::get("global")->info("client connected ({0})", n.hostname);
+                int reason = server::clientconnect(n.num, n.ip);
+                if(reason) disconnect_client(n.num, reason);
+                break;
+            }
+            case NET_RECEIVE:
+                if(c) process(r.packet, c->num, r.arg);
+                if(r.packet->referenceCount==0) enet_packet_destroy(r.packet);
+                break;
+
+            case NET_DISCONNECT:
+                if(!c) break;
+                spdlog::get("global")->info("disconnected client ({0})", c->hostname);
+                server::clientdisconnect(c->num);
+                delclient(c);
+                break;
+
+            case NET_RELEASE:
+                if(!--r.packet->referenceCount) enet_packet_destroy(r.packet);
+                break;
+        }
+        if(maxeventmillis && ENET_TIME_DIFFERENCE(enet_time_get(), eventstart) >= (enet_uint32)maxeventmillis) break;
+    }
+}
+
+/// Send everything queued for the clients.
+static void flushserverhost()
+{
+    if(!network) enet_host_flush(serverhost);
+    else
+    {
+        network->request({ NET_FLUSH, -1, -1, 0, NULL, 0 });
+        network->wakeup();
+    }
+}
+
 void serverslice(bool dedicated, uint timeout)   // main server update, called from main loop in sp, or from below in dedicated server
 {
     if(!serverhost) 
     {
         server::serverupdate();
         server::sendpackets();
+        tickprofiler.endtick();
         return;
     }
        
@@ -578,7 +1199,7 @@ void serverslice(bool dedicated, uint timeout)   // main server update, called f
     {
         int millis = (int)enet_time_get();
         elapsedtime = millis - totalmillis;
-        static int timeerr = 0;
+        static SERVERLOCAL int timeerr = 0;
         int scaledtime = server::scaletime(elapsedtime) + timeerr;
         curtime = scaledtime/100;
         timeerr = scaledtime%100;
@@ -587,72 +1208,80 @@ void serverslice(bool dedicated, uint timeout)   // main server update, called f
         totalmillis = millis;
         updatetime();
     }
-    server::serverupdate();
+    {
+        inexor::util::ScopedPhaseTimer timer(tickprofiler, TICK_UPDATE);
+        server::serverupdate();
+    }
 
-    flushmasteroutput();
+    if(curinstance) processinstancemaster();
+    else flushmasteroutput();
     checkserversockets();
+    if(network) network->infohandled();
 
-    if(!lastupdatemaster || totalmillis-lastupdatemaster>60*60*1000)       // send alive signal to masterserver every hour of uptime
+    if(!curinstance && (!lastupdatemaster || totalmillis-lastupdatemaster>60*60*1000))       // send alive signal to masterserver every hour of uptime
         updatemasterserver();
     
     if(totalmillis-laststatus>60*1000)   // display bandwidth stats, useful for server ops
     {
         laststatus = totalmillis;     
-        if(nonlocalclients || serverhost->totalSentData || serverhost->totalReceivedData)
-            spdlog::get("global")->debug("status: {0} remote clients, {1} send, {2} rec (K/sec)",
-                                         nonlocalclients, (serverhost->totalSentData/60.0f/1024), (serverhost->totalReceivedData/60.0f/1024));
-        serverhost->totalSentData = serverhost->totalReceivedData = 0;
+        int wshits, wsmisses;
+        server::getworldstatestats(wshits, wsmisses);
+        enet_uint32 sent, received;
+        if(network)
+        {
+            sent = network->sentdata.exchange(0);
+            received = network->receiveddata.exchange(0);
+        }
+        else
+        {
+            sent = serverhost->totalSentData;
+            received = serverhost->totalReceivedData;
+            serverhost->totalSentData = serverhost->totalReceivedData = 0;
+        }
+        if(nonlocalclients || sent || received)
+            spdlog::get("global")->debug("status: {0} remote clients, {1} send, {2} rec (K/sec), worldstate pool: {3} hits, {4} misses",
+                                         nonlocalclients, (sent/60.0f/1024), (received/60.0f/1024), wshits, wsmisses);
+        if(tickprofiling)
+        {
+            std::string profile = tickprofiler.summary();
+            spdlog::get("global")->debug("tick profile of game instance {0}:\n{1}", getserverinstance(), profile);
+            if(!getserverinstance()) setsvar("tickprofile", profile.c_str());
+            tickprofiler.reset();
+        }
     }
+#ifndef WIN32
+    if(tickprofiledumped != tickprofiledumps)
+    {
+        tickprofiledumped = tickprofiledumps;
+        dumptickprofile(curinstance ? tempformatstring("tickprofile%d.txt", curinstance->num) : "");
+    }
+#endif
 
-    ENetEvent event;
-    bool serviced = false;
-    while(!serviced)
+    if(network) handlenetevents(timeout);
+    else
     {
-        if(enet_host_check_events(serverhost, &event) <= 0)
+        ENetEvent event;
+        bool serviced = false;
+        enet_uint32 eventstart = enet_time_get();
+        while(!serviced)
         {
-            if(enet_host_service(serverhost, &event, timeout) <= 0) break;
-            serviced = true;
-        }
-        switch(event.type)
-        {
-            case ENET_EVENT_TYPE_CONNECT:
-            {
-                client &c = addclient(ST_TCPIP);
-                c.peer = event.peer;
-                c.peer->data = &c;
-                string hn;
-                copystring(c.hostname, (enet_address_get_host_ip(&c.peer->address, hn, sizeof(hn))==0) ? hn : "unknown");
-                spdlog::get("global")->info("client connected ({0})", c.hostname);
-                int reason = server::clientconnect(c.num, c.peer->address.host);
-                if(reason) disconnect_client(c.num, reason);
-                break;
-            }
-            case ENET_EVENT_TYPE_RECEIVE:
+            if(maxeventmillis && ENET_TIME_DIFFERENCE(enet_time_get(), eventstart) >= (enet_uint32)maxeventmillis) break;
+            if(enet_host_check_events(serverhost, &event) <= 0)
             {
-                client *c = (client *)event.peer->data;
-                if(c) process(event.packet, c->num, event.channelID);
-                if(event.packet->referenceCount==0) enet_packet_destroy(event.packet);
-                break;
+                if(enet_host_service(serverhost, &event, timeout) <= 0) break;
+                serviced = true;
             }
-            case ENET_EVENT_TYPE_DISCONNECT: 
-            {
-                client *c = (client *)event.peer->data;
-                if(!c) break;
-                spdlog::get("global")->info("disconnected client ({0})", c->hostname);
-                server::clientdisconnect(c->num);
-                delclient(c);
-                break;
-            }
-            default:
-                break;
+            inexor::util::ScopedPhaseTimer timer(tickprofiler, TICK_NETWORK);
+            handleserverevent(event);
         }
     }
-    if(server::sendpackets()) enet_host_flush(serverhost);
+    if(server::sendpackets()) flushserverhost();
+    tickprofiler.endtick();
 }
 
 void flushserver(bool force)
 {
-    if(server::sendpackets(force) && serverhost) enet_host_flush(serverhost);
+    if(server::sendpackets(force) && serverhost) flushserverhost();
 }
 
 #ifndef STANDALONE
@@ -930,13 +1559,79 @@ int WINAPI WinMain(HINSTANCE hInst, HINSTANCE hPrev, LPSTR szCmdLine, int sw)
 
 #endif
 
+/// Milliseconds an empty dedicated server sleeps until any of its sockets become readable.
+/// Keeps idle servers from waking up every few milliseconds, 0 disables it.
+VAR(serveridlemillis, 0, 100, 1000);
+
+/// Whether a dedicated server services its clients' connections on a network thread of its own.
+/// The game thread then only simulates, it is read when the server starts.
+VAR(servernetthread, 0, 1, 1);
+
+/// Whether anything still waits to be sent: a sleeping server would delay it.
+static bool serverhaspendingoutput()
+{
+    if(!curinstance && masterout.length()) return true;
+    // the network thread services handshakes and resends itself, only the master connection needs the game thread
+    if(!serverhost || network) return false;
+    // peers which are still connecting or disconnecting need their handshakes and resends serviced
+    loopi(serverhost->peerCount) if(serverhost->peers[i].state != ENET_PEER_STATE_DISCONNECTED) return true;
+    return false;
+}
+
+/// Block until the game host, the info sockets or the master connection got activity or the timeout elapsed.
+static void waitserversockets(uint timeout)
+{
+    if(!serverhost) return;
+    ENetSocketSet readset, writeset;
+    ENetSocket maxsock = buildserversocketsets(readset, writeset);
+    maxsock = max(maxsock, serverhost->socket);
+    ENET_SOCKETSET_ADD(readset, serverhost->socket);
+    enet_socketset_select(maxsock, &readset, &writeset, timeout);
+}
+
+#ifdef RPC_BENCHMARK
+/// Only written by the RPC load generator (--benchmark-rpc): microseconds since the benchmark started.
+SharedVar<int> rpcbenchmarkstamp(0);
+#endif
+
 static bool dedicatedserver = false;
 
 bool isdedicatedserver() { return dedicatedserver; }
 
+/// Let a network thread service the clients of the game instance on this thread, if servernetthread is set.
+static void startservernet()
+{
+    if(!servernetthread) return;
+    network = new servernet(serverhost, pongsock, lansock, serveridlemillis);
+    netclients.setsize(0);
+    netclients.pad(serverhost->peerCount);
+    loopv(netclients) netclients[i] = NULL;
+    if(!network->start())
+    {
+        spdlog::get("global")->warn("could not start the network thread, servicing clients on the game thread");
+        DELETEP(network);
+    }
+}
+
+/// One pass of a dedicated server's game loop, an empty server sleeps until anything happens.
+static void dedicatedserverslice()
+{
+    bool idle = !nonlocalclients && serveridlemillis && !serverhaspendingoutput();
+    if(network) serverslice(true, idle ? serveridlemillis : 5);
+    else
+    {
+        if(idle) waitserversockets(serveridlemillis);
+        serverslice(true, 5);
+    }
+}
+
 void rundedicatedserver()
 {
     dedicatedserver = true;
+#ifndef WIN32
+    signal(SIGUSR2, tickprofilesignal);
+#endif
+    startservernet();
     spdlog::get("global")->info("dedicated server started, waiting for clients...");
 #ifdef WIN32
     SetPriorityClass(GetCurrentProcess(), HIGH_PRIORITY_CLASS);
@@ -952,7 +1647,7 @@ void rundedicatedserver()
 		serverslice(true, 5);
 	}
 #else
-    for(;;) serverslice(true, 5);
+    for(;;) dedicatedserverslice();
 #endif
     dedicatedserver = false;
 }
@@ -973,16 +1668,16 @@ bool servererror(bool dedicated, const char *desc)
   
 bool setuplistenserver(bool dedicated)
 {
-    ENetAddress address = { ENET_HOST_ANY, enet_uint16(serverport <= 0 ? server::serverport() : serverport) };
+    ENetAddress address = { ENET_HOST_ANY, enet_uint16(curinstance ? curinstance->port : (serverport <= 0 ? server::serverport() : serverport)) };
     if(*serverip)
     {
         if(enet_address_set_host(&address, serverip)<0) spdlog::get("global")->warn("WARNING: server ip not resolved");
-        else serveraddress.host = address.host;
+        else if(!curinstance) serveraddress.host = address.host; // the main thread already set it for its instances
     }
     serverhost = enet_host_create(&address, min(maxclients + server::reserveclients(), MAXCLIENTS), server::numchannels(), 0, serveruprate);
     if(!serverhost) return servererror(dedicated, "could not create server host");
     serverhost->duplicatePeers = maxdupclients ? maxdupclients : MAXCLIENTS;
-    address.port = server::serverinfoport(serverport > 0 ? serverport : -1);
+    address.port = server::serverinfoport(curinstance ? curinstance->port : (serverport > 0 ? serverport : -1));
     pongsock = enet_socket_create(ENET_SOCKET_TYPE_DATAGRAM);
     if(pongsock != ENET_SOCKET_NULL && enet_socket_bind(pongsock, &address) < 0)
     {
@@ -1003,6 +1698,97 @@ bool setuplistenserver(bool dedicated)
     return true;
 }
 
+#ifdef STANDALONE
+/// The number of game instances a dedicated server runs, each one on a thread of its own.
+/// Instance n listens on serverport + 2n and answers info requests on the port after it. They share the master
+/// server connection, which registers every port, and the maps they play (see loadsharedmap()).
+/// Read when the server starts: set it in server-init.cfg or with -g.
+VAR(serverinstances, 1, 1, 64);
+
+static void runserverinstance(serverinstance *inst)
+{
+    curinstance = inst;
+    tickprofiler.enabled = tickprofiling != 0;
+    server::serverinit();
+    setuplistenserver(true);
+    startservernet();
+    for(;;) dedicatedserverslice();
+}
+
+/// The main thread of a dedicated server with several game instances: it only talks to the master server for them.
+static void runserverinstances()
+{
+    dedicatedserver = true;
+#ifndef WIN32
+    signal(SIGUSR2, tickprofilesignal);
+#endif
+    if(*serverip)
+    {
+        ENetAddress address;
+        if(enet_address_set_host(&address, serverip) >= 0) serveraddress.host = address.host;
+    }
+    if(!masterwaker.open()) fatal("could not create master server wakeup socket");
+    int port = serverport <= 0 ? server::serverport() : serverport;
+    loopi(serverinstances) instances.add(new serverinstance(i, port + 2*i));
+    loopv(instances) instances[i]->thread = std::thread(runserverinstance, instances[i]);
+    spdlog::get("global")->info("dedicated server started {0} game instances on ports {1} to {2}, waiting for clients...",
+                                instances.length(), port, instances.last()->port);
+#ifdef WIN32
+    SetPriorityClass(GetCurrentProcess(), HIGH_PRIORITY_CLASS);
+    const enet_uint32 timeout = 5;
+#else
+    const enet_uint32 timeout = 1000;
+#endif
+    for(;;)
+    {
+#ifdef WIN32
+        MSG msg;
+        while(PeekMessage(&msg, NULL, 0, 0, PM_REMOVE))
+        {
+            if(msg.message == WM_QUIT) exit(EXIT_SUCCESS);
+            TranslateMessage(&msg);
+            DispatchMessage(&msg);
+        }
+#endif
+        totalmillis = (int)enet_time_get();
+        loopv(instances)
+        {
+            serverinstance &inst = *instances[i];
+            vector<char> req;
+            {
+                std::lock_guard<std::mutex> guard(inst.lock);
+                req.move(inst.masterout);
+            }
+            if(req.empty()) continue;
+            req.add('\0');
+            if(!requestmaster(req.getbuf()))
+            {
+                // its pending auth requests fail
+                std::lock_guard<std::mutex> guard(inst.lock);
+                inst.masterdisconnected = true;
+            }
+        }
+        flushmasteroutput();
+        if(!lastupdatemaster || totalmillis-lastupdatemaster>60*60*1000) updatemasterserver();
+
+        ENetSocketSet readset, writeset;
+        ENET_SOCKETSET_EMPTY(readset);
+        ENET_SOCKETSET_EMPTY(writeset);
+        ENetSocket maxsock = masterwaker.sock;
+        ENET_SOCKETSET_ADD(readset, masterwaker.sock);
+        if(mastersock != ENET_SOCKET_NULL)
+        {
+            maxsock = max(maxsock, mastersock);
+            ENET_SOCKETSET_ADD(readset, mastersock);
+            if(!masterconnected || masterout.length()) ENET_SOCKETSET_ADD(writeset, mastersock);
+        }
+        if(enet_socketset_select(maxsock, &readset, &writeset, timeout) <= 0) continue;
+        if(ENET_SOCKETSET_CHECK(readset, masterwaker.sock)) masterwaker.drain();
+        checkmastersocket(readset, writeset);
+    }
+}
+#endif
+
 void initserver(bool listen, bool dedicated)
 {
     if(dedicated)
@@ -1017,6 +1803,10 @@ void initserver(bool listen, bool dedicated)
     if(initscript) execfile(initscript);
     else execfile("server-init.cfg", false);
 
+#ifdef STANDALONE
+    if(listen && dedicated && serverinstances > 1) runserverinstances(); // never returns
+#endif
+
     if(listen) setuplistenserver(dedicated);
 
     if(listen)
@@ -1070,6 +1860,7 @@ bool serveroption(char *opt)
 #ifdef STANDALONE
         case 'k': spdlog::get("global")->debug("Adding package directory: {}", opt); addpackagedir(opt+2); return true;
         case 'x': spdlog::get("global")->debug("Setting server init script: {}", opt); initscript = opt+2; return true;
+        case 'g': setvar("serverinstances", atoi(opt+2)); return true;
 #endif
         default: return false;
     }
@@ -1088,8 +1879,34 @@ int main(int argc, char **argv)
     if(enet_initialize()<0) fatal("Unable to initialise network module");
     atexit(enet_deinitialize);
     enet_time_set(0);
-    for(int i = 1; i<argc; i++) if(argv[i][0]!='-' || !serveroption(argv[i])) gameargs.add(argv[i]);
+    // e.g. inexor-core-server --benchmark-cubescript "server-init.cfg" 1000
+    for(int i = 1; i < argc; i++) if(!strcmp(argv[i], "--benchmark-cubescript"))
+    {
+        extern void benchmarkscripts(const char *files, int runs);
+        benchmarkscripts(i+1 < argc ? argv[i+1] : "server-init.cfg", i+2 < argc ? max(atoi(argv[i+2]), 1) : 1000);
+        return EXIT_SUCCESS;
+    }
+    // e.g. inexor-core-server --benchmark-positions "demos/ctf.dmo"
+    for(int i = 1; i+1 < argc; i++) if(!strcmp(argv[i], "--benchmark-positions"))
+    {
+        server::benchmarkpositions(argv[i+1]);
+        return EXIT_SUCCESS;
+    }
+    int benchmarkruns = 0;
+    for(int i = 1; i<argc; i++)
+    {
+        // e.g. inexor-core-server --benchmark-startup 20
+        if(!strcmp(argv[i], "--benchmark-startup")) benchmarkruns = i+1 < argc && isdigit(argv[i+1][0]) ? max(atoi(argv[++i]), 1) : 10;
+        else if(argv[i][0]!='-' || !serveroption(argv[i])) gameargs.add(argv[i]);
+    }
     game::parseoptions(gameargs);
+    if(benchmarkruns)
+    {
+        // the whole startup, just without listening
+        extern void benchmarkstartup(void (*init)(), int runs);
+        benchmarkstartup([] { initserver(false, true); }, benchmarkruns);
+        return EXIT_SUCCESS;
+    }
     initserver(true, true);
     return EXIT_SUCCESS;
 }
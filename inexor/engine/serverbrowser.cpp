@@ -1,6 +1,23 @@
 #include "inexor/engine/engine.hpp"
 #include "inexor/ui/input/InputRouter.hpp"
 #include "inexor/util/Logging.hpp"
+#include "inexor/util/ServerList.hpp"
+#include "inexor/util/SpscByteQueue.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#ifdef __linux__
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+#ifndef WIN32
+#include <poll.h>
+#endif
 
 using namespace inexor::io;
 
@@ -212,7 +229,224 @@ int connectwithtimeout(ENetSocket sock, const char *hostname, const ENetAddress
 
     return -1;
 }
- 
+
+/// Sends the server pings and receives the replies on its own thread.
+///
+/// The main thread only hands datagrams over through two lock-free single producer/single consumer
+/// queues, so pinging a list of thousands of servers costs it no syscalls at all.
+/// The engine thread moves them in batches: sendmmsg()/recvmmsg() on linux, a plain loop elsewhere.
+/// It sleeps on a condition variable whenever no ping is queued and all replies are overdue.
+struct pingengine
+{
+    enum { BATCH = 64, QUEUESIZE = 1<<20, WAITTIME = 5, REPLYTIME = 1000 };
+
+    struct datagram
+    {
+        enet_uint32 host;
+        enet_uint16 port, len;
+    };
+
+    struct batch
+    {
+        ENetAddress addr[BATCH];
+        int len[BATCH], num;
+        uchar data[BATCH][MAXTRANS];
+    };
+
+    ENetSocket sock;
+    inexor::util::SpscByteQueue requests, replies;
+    batch *out, *in;
+    std::thread thread;
+    std::mutex wakelock;
+    std::condition_variable wake;
+    std::atomic<bool> running;
+    std::atomic<int> dropped;
+
+    pingengine() : sock(ENET_SOCKET_NULL), requests(QUEUESIZE), replies(QUEUESIZE), out(NULL), in(NULL), running(false), dropped(0) {}
+    ~pingengine() { stop(); }
+
+    bool start()
+    {
+        if(running) return true;
+        sock = enet_socket_create(ENET_SOCKET_TYPE_DATAGRAM);
+        if(sock == ENET_SOCKET_NULL) return false;
+        enet_socket_set_option(sock, ENET_SOCKOPT_NONBLOCK, 1);
+        enet_socket_set_option(sock, ENET_SOCKOPT_BROADCAST, 1);
+        if(!out) out = new batch;
+        if(!in) in = new batch;
+        running = true;
+        thread = std::thread([this] { run(); });
+        return true;
+    }
+
+    void stop()
+    {
+        if(running)
+        {
+            running = false;
+            wakeup();
+            thread.join();
+            enet_socket_destroy(sock);
+            sock = ENET_SOCKET_NULL;
+        }
+        DELETEP(out);
+        DELETEP(in);
+    }
+
+    /// Queue a whole datagram or nothing, so the reader never sees half of one.
+    static bool push(inexor::util::SpscByteQueue &q, const ENetAddress &addr, const void *data, int len)
+    {
+        if(len < 0 || len > MAXTRANS || q.space() < sizeof(datagram) + len) return false;
+        uchar rec[sizeof(datagram) + MAXTRANS];
+        datagram d = { addr.host, addr.port, enet_uint16(len) };
+        memcpy(rec, &d, sizeof(d));
+        memcpy(rec + sizeof(d), data, len);
+        q.write(rec, sizeof(d) + len);
+        return true;
+    }
+
+    static int pop(inexor::util::SpscByteQueue &q, ENetAddress &addr, uchar *data)
+    {
+        datagram d;
+        if(q.size() < sizeof(d)) return -1;
+        q.read(&d, sizeof(d));
+        addr.host = d.host;
+        addr.port = d.port;
+        q.read(data, d.len);
+        return d.len;
+    }
+
+    /// Main thread: queue a ping, false if the engine is backed up.
+    bool send(const ENetAddress &addr, const ENetBuffer &buf) { return push(requests, addr, buf.data, int(buf.dataLength)); }
+
+    /// Main thread: take the next reply, -1 if there is none. data must hold MAXTRANS bytes.
+    int receive(ENetAddress &addr, uchar *data) { return pop(replies, addr, data); }
+
+    /// Main thread: let an idle engine thread see the pings queued with send().
+    void wakeup()
+    {
+        // taking the lock orders this after the engine thread's last check of the queue
+        { std::lock_guard<std::mutex> lock(wakelock); }
+        wake.notify_one();
+    }
+
+    void sendbatch(batch &b)
+    {
+#ifdef __linux__
+        mmsghdr msgs[BATCH];
+        sockaddr_in names[BATCH];
+        iovec iov[BATCH];
+        memset(msgs, 0, b.num*sizeof(mmsghdr));
+        memset(names, 0, b.num*sizeof(sockaddr_in));
+        loopi(b.num)
+        {
+            names[i].sin_family = AF_INET;
+            names[i].sin_addr.s_addr = b.addr[i].host;
+            names[i].sin_port = ENET_HOST_TO_NET_16(b.addr[i].port);
+            iov[i].iov_base = b.data[i];
+            iov[i].iov_len = b.len[i];
+            msgs[i].msg_hdr.msg_name = &names[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        // a full socket buffer just loses the rest of the batch: the browser pings again later
+        for(int sent = 0; sent < b.num;)
+        {
+            int n = sendmmsg(sock, &msgs[sent], b.num - sent, 0);
+            if(n <= 0) break;
+            sent += n;
+        }
+#else
+        loopi(b.num)
+        {
+            ENetBuffer buf;
+            buf.data = b.data[i];
+            buf.dataLength = b.len[i];
+            enet_socket_send(sock, &b.addr[i], &buf, 1);
+        }
+#endif
+    }
+
+    int receivebatch(batch &b)
+    {
+#ifdef __linux__
+        mmsghdr msgs[BATCH];
+        sockaddr_in names[BATCH];
+        iovec iov[BATCH];
+        memset(msgs, 0, sizeof(msgs));
+        loopi(BATCH)
+        {
+            iov[i].iov_base = b.data[i];
+            iov[i].iov_len = MAXTRANS;
+            msgs[i].msg_hdr.msg_name = &names[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = recvmmsg(sock, msgs, BATCH, MSG_DONTWAIT, NULL);
+        b.num = max(n, 0);
+        loopi(b.num)
+        {
+            b.addr[i].host = names[i].sin_addr.s_addr;
+            b.addr[i].port = ENET_NET_TO_HOST_16(names[i].sin_port);
+            b.len[i] = msgs[i].msg_len;
+        }
+#else
+        for(b.num = 0; b.num < BATCH; b.num++)
+        {
+            ENetBuffer buf;
+            buf.data = b.data[b.num];
+            buf.dataLength = MAXTRANS;
+            int len = enet_socket_receive(sock, &b.addr[b.num], &buf, 1);
+            if(len <= 0) break;
+            b.len[b.num] = len;
+        }
+#endif
+        return b.num;
+    }
+
+    void run()
+    {
+        bool inflight = false;
+        enet_uint32 lastsent = 0;
+        while(running)
+        {
+            do
+            {
+                for(out->num = 0; out->num < BATCH; out->num++)
+                {
+                    int len = pop(requests, out->addr[out->num], out->data[out->num]);
+                    if(len < 0) break;
+                    out->len[out->num] = len;
+                }
+                if(out->num)
+                {
+                    sendbatch(*out);
+                    lastsent = enet_time_get();
+                    inflight = true;
+                }
+            }
+            while(out->num == BATCH);
+
+            if(inflight && ENET_TIME_DIFFERENCE(enet_time_get(), lastsent) >= REPLYTIME) inflight = false;
+            if(!inflight)
+            {
+                std::unique_lock<std::mutex> lock(wakelock);
+                wake.wait(lock, [this] { return !running || requests.size() > 0; });
+                continue;
+            }
+
+            enet_uint32 events = ENET_SOCKET_WAIT_RECEIVE;
+            if(enet_socket_wait(sock, &events, WAITTIME) < 0 || !events) continue;
+            while(receivebatch(*in) > 0) loopi(in->num)
+            {
+                if(!push(replies, in->addr[i], in->data[i], in->len[i])) dropped++;
+            }
+        }
+    }
+};
+
 struct pingattempts
 {
     enum { MAXATTEMPTS = 2 };
@@ -268,15 +502,15 @@ struct serverinfo : pingattempts
     };
 
     string name, map, sdesc;
-    int port, numplayers, resolved, ping, lastping, nextping;
+    int port, numplayers, resolved, ping, lastping, nextping, lastsent;
     int pings[MAXPINGS];
     vector<int> attr;
     ENetAddress address;
-    bool keep;
+    bool keep, inflight;
     const char *password;
 
     serverinfo()
-        : port(-1), numplayers(0), resolved(UNRESOLVED), keep(false), password(NULL)
+        : port(-1), numplayers(0), resolved(UNRESOLVED), lastsent(-1), keep(false), inflight(false), password(NULL)
     {
         name[0] = map[0] = sdesc[0] = '\0';
         clearpings();
@@ -307,6 +541,8 @@ struct serverinfo : pingattempts
     void reset()
     {
         lastping = -1;
+        lastsent = -1;
+        inflight = false;
     }
 
     void checkdecay(int decay)
@@ -352,12 +588,47 @@ struct serverinfo : pingattempts
 };
 
 vector<serverinfo *> servers;
-ENetSocket pingsock = ENET_SOCKET_NULL;
-int lastinfo = 0;
+pingengine pinger;
+
+static inline uint hthash(const ENetAddress &a) { return a.host ^ (uint(a.port) << 16); }
+static inline bool htcmp(const ENetAddress &x, const ENetAddress &y) { return x.host == y.host && x.port == y.port; }
+
+/// The servers by address, to match the ping replies.
+hashtable<ENetAddress, serverinfo *> serverindex;
+
+/// Whether anything that changes the order of the list happened since it was last sorted.
+static bool resortservers = false;
+
+static void indexserver(serverinfo *si)
+{
+    if(si->address.host != ENET_HOST_ANY) serverindex.access(si->address, si);
+    resortservers = true;
+}
+
+/// Drop a server which is about to be deleted from the index, without rebuilding all of it.
+static void unindexserver(serverinfo *si)
+{
+    if(serverindex.find(si->address, NULL) != si) return;
+    serverindex.remove(si->address);
+    // another entry with the same address gets its replies now
+    loopvrev(servers) if(servers[i] != si && htcmp(servers[i]->address, si->address)) { indexserver(servers[i]); break; }
+}
+
+/// Numeric addresses, as the master sends them, need no trip through the resolver threads.
+static bool parseip(const char *name, enet_uint32 &host)
+{
+    uint b[4];
+    char end;
+    if(sscanf(name, "%u.%u.%u.%u%c", &b[0], &b[1], &b[2], &b[3], &end) != 4) return false;
+    loopi(4) if(b[i] > 255) return false;
+    host = ENET_HOST_TO_NET_32((b[0]<<24) | (b[1]<<16) | (b[2]<<8) | b[3]);
+    return true;
+}
 
 static serverinfo *newserver(const char *name, int port, uint ip = ENET_HOST_ANY)
 {
     serverinfo *si = new serverinfo;
+    if(ip==ENET_HOST_ANY && name) parseip(name, ip);
     si->address.host = ip;
     si->address.port = server::serverinfoport(port);
     if(ip!=ENET_HOST_ANY) si->resolved = RESOLVED;
@@ -372,6 +643,7 @@ static serverinfo *newserver(const char *name, int port, uint ip = ENET_HOST_ANY
     }
 
     servers.add(si);
+    indexserver(si);
 
     return si;
 }
@@ -400,7 +672,10 @@ void addserver(const char *name, int port, const char *password, bool keep)
 VARP(searchlan, 0, 0, 1);
 VARP(servpingrate, 1000, 5000, 60000);
 VARP(servpingdecay, 1000, 15000, 60000);
-VARP(maxservpings, 0, 10, 1000);
+VARP(maxservpings, 0, 10, 1000); // servers pinged per refresh, 0 for all which are due
+VARP(servpingsinflight, 0, 256, 4096); // pings awaiting their reply at once, 0 for no limit
+
+#define PINGTIMEOUT 1000
 
 pingattempts lanpings;
 
@@ -414,44 +689,51 @@ template<size_t N> static inline void buildping(ENetBuffer &buf, uchar (&ping)[N
 
 void pingservers()
 {
-    if(pingsock == ENET_SOCKET_NULL) 
+    if(!pinger.running)
     {
-        pingsock = enet_socket_create(ENET_SOCKET_TYPE_DATAGRAM);
-        if(pingsock == ENET_SOCKET_NULL)
-        {
-            lastinfo = totalmillis;
-            return;
-        }
-        enet_socket_set_option(pingsock, ENET_SOCKOPT_NONBLOCK, 1);
-        enet_socket_set_option(pingsock, ENET_SOCKOPT_BROADCAST, 1);
-
+        if(!pinger.start()) return;
         lanpings.setoffset();
     }
 
     ENetBuffer buf;
     uchar ping[MAXTRANS];
 
+    int inflight = 0;
+    loopv(servers)
+    {
+        serverinfo &si = *servers[i];
+        if(si.inflight && totalmillis - si.lastsent >= PINGTIMEOUT) si.inflight = false;
+        if(si.inflight) inflight++;
+    }
+
     static int lastping = 0;
-    if(lastping >= servers.length()) lastping = 0;
-    loopi(maxservpings ? min(servers.length(), maxservpings) : servers.length())
+    int sent = 0;
+    loopi(servers.length())
     {
-        serverinfo &si = *servers[lastping];
-        if(++lastping >= servers.length()) lastping = 0;
-        if(si.address.host == ENET_HOST_ANY) continue;
+        if((servpingsinflight && inflight >= servpingsinflight) || (maxservpings && sent >= maxservpings)) break;
+        if(lastping >= servers.length()) lastping = 0;
+        serverinfo &si = *servers[lastping++];
+        if(si.address.host == ENET_HOST_ANY || si.inflight || (si.lastsent >= 0 && totalmillis - si.lastsent < servpingrate)) continue;
         buildping(buf, ping, si);
-        enet_socket_send(pingsock, &si.address, &buf, 1);
-        
+        if(!pinger.send(si.address, buf)) break;
+        si.lastsent = totalmillis;
+        si.inflight = true;
+        inflight++;
+        sent++;
+
         si.checkdecay(servpingdecay);
     }
-    if(searchlan)
+
+    static int lastlanping = -1;
+    if(searchlan && (lastlanping < 0 || totalmillis - lastlanping >= servpingrate))
     {
         ENetAddress address;
         address.host = ENET_HOST_BROADCAST;
         address.port = server::laninfoport();
         buildping(buf, ping, lanpings);
-        enet_socket_send(pingsock, &address, &buf, 1);
+        if(pinger.send(address, buf)) lastlanping = totalmillis;
     }
-    lastinfo = totalmillis;
+    pinger.wakeup();
 }
   
 void checkresolver()
@@ -481,6 +763,7 @@ void checkresolver()
             {
                 si.resolved = RESOLVED; 
                 si.address.host = addr.host;
+                indexserver(&si);
                 break;
             }
         }
@@ -491,26 +774,20 @@ static int lastreset = 0;
 
 void checkpings()
 {
-    if(pingsock==ENET_SOCKET_NULL) return;
-    enet_uint32 events = ENET_SOCKET_WAIT_RECEIVE;
-    ENetBuffer buf;
+    if(!pinger.running) return;
     ENetAddress addr;
     uchar ping[MAXTRANS];
     char text[MAXTRANS];
-    buf.data = ping; 
-    buf.dataLength = sizeof(ping);
-    while(enet_socket_wait(pingsock, &events, 0) >= 0 && events)
+    for(int len; (len = pinger.receive(addr, ping)) >= 0;)
     {
-        int len = enet_socket_receive(pingsock, &addr, &buf, 1);
-        if(len <= 0) return;  
         ucharbuf p(ping, len);
         int millis = getint(p);
-        serverinfo *si = NULL;
-        loopv(servers) if(addr.host == servers[i]->address.host && addr.port == servers[i]->address.port) { si = servers[i]; break; }
+        serverinfo *si = serverindex.find(addr, NULL);
         if(si)
         {
             if(!si->checkattempt(millis)) continue;
             millis = si->decodeping(millis);
+            si->inflight = false;
         }
         else if(!searchlan || !lanpings.checkattempt(millis, false)) continue;
         else
@@ -528,15 +805,19 @@ void checkpings()
         filtertext(si->map, text, false);
         getstring(text, p);
         filtertext(si->sdesc, text);
+        resortservers = true;
     }
 }
 
 void sortservers()
 {
     servers.sort(serverinfo::compare);
+    resortservers = false;
 }
 COMMAND(sortservers, "");
 
+#define SORTRATE 250
+
 VARP(autosortservers, 0, 1, 1);
 VARP(autoupdateservers, 0, 1, 1);
 
@@ -553,10 +834,117 @@ void refreshservers()
 
     checkresolver();
     checkpings();
-    if(totalmillis - lastinfo >= servpingrate/(maxservpings ? max(1, (servers.length() + maxservpings - 1) / maxservpings) : 1)) pingservers();
-    if(autosortservers) sortservers();
+    pingservers();
+    // pongs trickle in every frame: sorting thousands of servers for each one would stall the ui
+    static int lastsort = 0;
+    if(autosortservers && resortservers && totalmillis - lastsort >= SORTRATE)
+    {
+        sortservers();
+        lastsort = totalmillis;
+    }
 }
 
+#ifndef WIN32
+#define BENCHPORT 42000
+#define BENCHLIMIT 20000
+
+/// Headless benchmark of the ping engine: "benchpingservers 2000" works without opening the browser.
+/// Answers the pings from numservers fake servers on local ports and reports how long it took
+/// until each of them replied, keeping at most servpingsinflight pings in flight like the browser.
+void benchpingservers(int *numservers)
+{
+    vector<ENetSocket> fakes;
+    loopi(clamp(*numservers, 1, 20000))
+    {
+        ENetAddress address = { ENET_HOST_TO_NET_32(0x7F000001), enet_uint16(BENCHPORT + i) };
+        ENetSocket sock = enet_socket_create(ENET_SOCKET_TYPE_DATAGRAM);
+        if(sock == ENET_SOCKET_NULL) break;
+        if(enet_socket_bind(sock, &address) < 0) { enet_socket_destroy(sock); break; }
+        enet_socket_set_option(sock, ENET_SOCKOPT_NONBLOCK, 1);
+        fakes.add(sock);
+    }
+    if(fakes.length() < *numservers) spdlog::get("global")->warn("benchpingservers: could only open {0} of {1} fake servers", fakes.length(), *numservers);
+
+    std::atomic<bool> responding(true);
+    std::thread responder([&fakes, &responding] {
+        vector<pollfd> fds;
+        loopv(fakes)
+        {
+            pollfd &fd = fds.add();
+            fd.fd = fakes[i];
+            fd.events = POLLIN;
+            fd.revents = 0;
+        }
+        uchar data[MAXTRANS];
+        while(responding)
+        {
+            if(poll(fds.getbuf(), fds.length(), 10) <= 0) continue;
+            loopv(fds) if(fds[i].revents & POLLIN)
+            {
+                ENetAddress from;
+                ENetBuffer buf;
+                buf.data = data;
+                buf.dataLength = sizeof(data) - 4;
+                int len = enet_socket_receive(fakes[i], &from, &buf, 1);
+                if(len <= 0) continue;
+                memset(&data[len], 0, 4); // no players, no attributes, no map and no description
+                buf.dataLength = len + 4;
+                enet_socket_send(fakes[i], &from, &buf, 1);
+            }
+        }
+    });
+
+    pingengine bench;
+    vector<double> senttime, rtts;
+    if(bench.start())
+    {
+        auto start = std::chrono::steady_clock::now();
+        auto elapsed = [&start] { return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(); };
+        loopv(fakes) senttime.add(-1);
+        int next = 0, inflight = 0;
+        while(rtts.length() < fakes.length() && elapsed() < BENCHLIMIT)
+        {
+            for(; next < fakes.length() && (!servpingsinflight || inflight < servpingsinflight); next++, inflight++)
+            {
+                ENetAddress address = { ENET_HOST_TO_NET_32(0x7F000001), enet_uint16(BENCHPORT + next) };
+                uchar ping[16];
+                ucharbuf p(ping, sizeof(ping));
+                putint(p, next + 1);
+                ENetBuffer buf;
+                buf.data = ping;
+                buf.dataLength = p.length();
+                if(!bench.send(address, buf)) break;
+                senttime[next] = elapsed();
+            }
+            ENetAddress from;
+            uchar reply[MAXTRANS];
+            for(int len; (len = bench.receive(from, reply)) >= 0;)
+            {
+                ucharbuf p(reply, len);
+                int id = getint(p) - 1;
+                if(!senttime.inrange(id) || senttime[id] < 0) continue;
+                rtts.add(elapsed() - senttime[id]);
+                senttime[id] = -1;
+                inflight--;
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+        double total = elapsed();
+        std::sort(rtts.getbuf(), rtts.getbuf() + rtts.length());
+        spdlog::get("global")->info("benchpingservers: {0}/{1} servers answered in {2:.1f} ms ({3:.0f} pings/s), rtt median {4:.2f} ms, max {5:.2f} ms, {6} replies dropped",
+                                    rtts.length(), fakes.length(), total, total > 0 ? rtts.length()*1000/total : 0.0,
+                                    rtts.length() ? rtts[rtts.length()/2] : 0.0, rtts.length() ? rtts.last() : 0.0, bench.dropped.load());
+        bench.stop();
+    }
+    else spdlog::get("global")->error("benchpingservers: could not open a socket");
+
+    responding = false;
+    responder.join();
+    loopv(fakes) enet_socket_destroy(fakes[i]);
+}
+COMMAND(benchpingservers, "i");
+#endif
+
 serverinfo *selectedserver = NULL;
 
 const char *showservers(g3d_gui *cgui, uint *header, int pagemin, int pagemax)
@@ -606,14 +994,78 @@ void connectselected()
 
 COMMAND(connectselected, "");
 
+/// The master's list version we already have, so it can reply with the changes only.
+int masterlistepoch = 0, masterlistversion = 0;
+ICOMMAND(listversion, "ii", (int *epoch, int *version), { masterlistepoch = *epoch; masterlistversion = *version; });
+
 void clearservers(bool full = false)
 {
     resolverclear();
-    if(full) servers.deletecontents();
-    else loopvrev(servers) if(!servers[i]->keep) delete servers.remove(i);
+    // what is left no longer matches any list version, ask for the full list next time
+    masterlistepoch = masterlistversion = 0;
+    if(full)
+    {
+        servers.deletecontents();
+        serverindex.clear();
+    }
+    else loopvrev(servers) if(!servers[i]->keep)
+    {
+        serverinfo *s = servers.remove(i);
+        if(serverindex.find(s->address, NULL) == s) serverindex.remove(s->address);
+        delete s;
+    }
+    // a kept server may share its address with one that got removed
+    loopv(servers) if(!serverindex.access(servers[i]->address)) indexserver(servers[i]);
     selectedserver = NULL;
 }
 
+void delserver(const char *name, int port)
+{
+    loopv(servers)
+    {
+        serverinfo *s = servers[i];
+        if(s->keep || strcmp(s->name, name) || s->port != port) continue;
+        if(selectedserver == s) selectedserver = NULL;
+        servers.remove(i);
+        unindexserver(s);
+        delete s;
+        return;
+    }
+}
+ICOMMAND(delserver, "si", (const char *name, int *port), delserver(name, *port));
+
+VARP(masterbinarylist, 0, 1, 1);
+
+static bool getserverip(const inexor::util::listed_server &s, char *ip)
+{
+    ENetAddress address;
+    address.host = s.host;
+    address.port = s.port;
+    return enet_address_get_host_ip(&address, ip, MAXSTRLEN) >= 0;
+}
+
+/// Apply a binary list reply, see genbinaryserverlist() in the master.
+static bool parsebinarylist(const uchar *p, int len)
+{
+    inexor::util::server_list_reply reply;
+    if(len < 0 || !reply.read_binary(p, size_t(len))) return false;
+    reply.apply([] { clearservers(); },
+        [](const inexor::util::listed_server &s)
+        {
+            string ip;
+            if(getserverip(s, ip)) addserver(ip, s.port, NULL);
+        },
+        [](const inexor::util::listed_server &s)
+        {
+            string ip;
+            if(getserverip(s, ip)) delserver(ip, s.port);
+        });
+    // after clearservers(), which forgets the list version
+    masterlistepoch = int(reply.epoch);
+    masterlistversion = int(reply.version);
+    return true;
+}
+
 #define RETRIEVELIMIT 20000
 
 void retrieveservers(vector<char> &data)
@@ -626,7 +1078,9 @@ void retrieveservers(vector<char> &data)
     renderprogress(0, text);
 
     int starttime = SDL_GetTicks(), timeout = 0;
-    const char *req = "list\n";
+    // masters which do not know "listversion" ignore it and just send the full list
+    defformatstring(request, "listversion %d %d%s\nlist\n", masterlistepoch, masterlistversion, masterbinarylist ? " binary" : "");
+    const char *req = request;
     int reqlen = strlen(req);
     ENetBuffer buf;
     while(reqlen > 0)
@@ -677,9 +1131,11 @@ void updatefrommaster()
     vector<char> data;
     retrieveservers(data);
     if(data.empty()) spdlog::get("global")->error("master server not replying");
+    else if(parsebinarylist((const uchar *)data.getbuf(), data.length()-1)) {}
     else
     {
-        clearservers();
+        // versioned replies start with clearservers themselves if they are not just the changes
+        if(!strstr(data.getbuf(), "listversion ")) clearservers();
         execute(data.getbuf());
     }
     refreshservers();
@@ -698,6 +1154,11 @@ ICOMMAND(clearservers, "i", (int *full), clearservers(*full!=0));
 COMMAND(updatefrommaster, "");
 COMMAND(initservers, "");
 
+void cleanupserverbrowser()
+{
+    pinger.stop();
+}
+
 void writeservercfg()
 {
     if(!game::savedservers()) return;
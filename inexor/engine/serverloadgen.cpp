@@ -0,0 +1,300 @@
+/// Stress harness for the dedicated server.
+///
+/// Connects a number of synthetic clients to a running server and lets them flood it, while every client
+/// pings the server ten times a second. The server answers a N_PING while it handles the packet and the
+/// N_PONG leaves with the next flush, so on the loopback the round trip follows how long a server tick takes.
+/// Every second it prints the round trip percentiles, run it once with and once without traffic to compare.
+/// The server's own tick profile is printed on SIGUSR2 (kill -USR2 <pid>).
+///
+/// traffic:
+///   idle  the clients only ping
+///   pos   every client sends [rate] position updates per second (default), the synthetic players never
+///         spawn, so the server parses the positions but does not relay them
+///   edit  the clients vote for coop edit, enter edit mode and send [rate] bursts of 16 edits per second,
+///         positions and edits get relayed to everyone
+///
+/// The server accepts only maxclients clients (8 by default): start it with -c<clients>.
+///
+/// usage: server-loadgen [clients] [seconds] [traffic] [rate] [serverport]
+
+#include <enet/enet.h>
+
+#include "inexor/fpsgame/network_types.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+typedef std::chrono::steady_clock steadyclock;
+
+enum
+{
+    T_IDLE,
+    T_POS,
+    T_EDIT
+};
+
+const int PINGMILLIS = 100, EDITBURST = 16;
+
+struct client
+{
+    int n, cn;
+    ENetPeer *peer;
+    /// The server sends N_WELCOME once it accepted our N_CONNECT, game messages before that get us kicked.
+    bool connected, welcomed, voted;
+    int nextsend, nextping, nexteditmode;
+
+    client(int n) : n(n), cn(-1), peer(NULL), connected(false), welcomed(false), voted(false), nextsend(0), nextping(0), nexteditmode(0) {}
+};
+
+std::vector<client> clients;
+std::vector<int> roundtrips;
+long disconnects = 0;
+
+steadyclock::time_point start;
+
+int millis() { return int(std::chrono::duration_cast<std::chrono::milliseconds>(steadyclock::now() - start).count()); }
+
+/// The protocol's integer encoding, see putint() in shared/tools.cpp.
+void putint(std::vector<unsigned char> &p, int n)
+{
+    if(n < 128 && n > -127) p.push_back(n);
+    else if(n < 0x8000 && n >= -0x8000) { p.push_back(0x80); p.push_back(n); p.push_back(n >> 8); }
+    else { p.push_back(0x81); p.push_back(n); p.push_back(n >> 8); p.push_back(n >> 16); p.push_back(n >> 24); }
+}
+
+void putuint(std::vector<unsigned char> &p, int n)
+{
+    if(n < 0 || n >= (1<<21))
+    {
+        p.push_back(0x80 | (n & 0x7F)); p.push_back(0x80 | ((n >> 7) & 0x7F)); p.push_back(0x80 | ((n >> 14) & 0x7F)); p.push_back(n >> 21);
+    }
+    else if(n < (1<<7)) p.push_back(n);
+    else if(n < (1<<14)) { p.push_back(0x80 | (n & 0x7F)); p.push_back(n >> 7); }
+    else { p.push_back(0x80 | (n & 0x7F)); p.push_back(0x80 | ((n >> 7) & 0x7F)); p.push_back(n >> 14); }
+}
+
+void sendstring(const char *t, std::vector<unsigned char> &p)
+{
+    while(*t) putint(p, *t++);
+    putint(p, 0);
+}
+
+int getint(const unsigned char *&p, const unsigned char *end)
+{
+    if(p >= end) return -1;
+    int c = (signed char)*p++;
+    if(c == -128 && end - p >= 2) { int n = p[0] | (int(p[1]) << 8); p += 2; return short(n); }
+    if(c == -127 && end - p >= 4) { int n = p[0] | (p[1] << 8) | (p[2] << 16) | (int(p[3]) << 24); p += 4; return n; }
+    return c;
+}
+
+void send(client &c, int chan, const std::vector<unsigned char> &p, bool reliable)
+{
+    ENetPacket *packet = enet_packet_create(p.data(), p.size(), reliable ? ENET_PACKET_FLAG_RELIABLE : 0);
+    if(enet_peer_send(c.peer, chan, packet) < 0) enet_packet_destroy(packet);
+}
+
+void sendintro(client &c)
+{
+    std::vector<unsigned char> p;
+    putint(p, N_CONNECT);
+    sendstring(("loadgen" + std::to_string(c.n)).c_str(), p);
+    putint(p, 0);   // playermodel
+    putint(p, 100); // fov
+    sendstring("", p); // password
+    sendstring("", p); // authdesc
+    sendstring("", p); // authname
+    send(c, 1, p, true);
+}
+
+int msgsize(int type)
+{
+    for(const int *p = msgsizes; *p >= 0; p += 2) if(p[0] == type) return p[1];
+    return -1;
+}
+
+void sendvote(client &c)
+{
+    std::vector<unsigned char> p;
+    putint(p, N_MAPVOTE);
+    sendstring("", p); // a new map
+    putint(p, 1);      // coop edit
+    send(c, 1, p, true);
+}
+
+/// A player walking in a circle around the middle of a 1024 sized map.
+void sendposition(client &c, int now)
+{
+    std::vector<unsigned char> p;
+    putint(p, N_POS);
+    putuint(p, c.cn);
+    p.push_back(0); // physstate
+    putuint(p, 0);  // flags: 2 byte coordinates, 1 byte velocity, no fall
+    float angle = (now + 100*c.n) / 1000.0f;
+    int pos[3] = { int((512 + 200*cosf(angle))*16), int((512 + 200*sinf(angle))*16), 512*16 };
+    for(int k = 0; k < 3; k++) { p.push_back(pos[k]); p.push_back(pos[k] >> 8); }
+    int yaw = int(angle*180/3.14159265f) % 360;
+    p.push_back(yaw); p.push_back(0); p.push_back(0); // yaw, pitch, roll
+    p.push_back(100);                                  // velocity
+    p.push_back(yaw); p.push_back(yaw >> 8);           // direction
+    send(c, 0, p, false);
+}
+
+void sendedits(client &c)
+{
+    std::vector<unsigned char> p;
+    for(int i = 0; i < EDITBURST; i++)
+    {
+        putint(p, N_EDITF);
+        for(int k = 1; k < msgsize(N_EDITF); k++) putint(p, 0);
+    }
+    send(c, 1, p, true);
+}
+
+void sendsimple(client &c, int type, int arg, bool reliable)
+{
+    std::vector<unsigned char> p;
+    putint(p, type);
+    putint(p, arg);
+    send(c, 1, p, reliable);
+}
+
+/// Only the first message of a packet is looked at: N_SERVINFO, N_WELCOME and N_PONG start packets of their own.
+void receive(client &c, const ENetPacket *packet)
+{
+    const unsigned char *p = packet->data, *end = packet->data + packet->dataLength;
+    switch(getint(p, end))
+    {
+        case N_SERVINFO:
+            c.cn = getint(p, end);
+            break;
+
+        case N_WELCOME:
+            c.welcomed = true;
+            break;
+
+        case N_PONG:
+            roundtrips.push_back(millis() - getint(p, end));
+            break;
+    }
+}
+
+int percentile(int p)
+{
+    if(roundtrips.empty()) return 0;
+    size_t i = std::min(roundtrips.size() - 1, roundtrips.size() * p / 100);
+    std::nth_element(roundtrips.begin(), roundtrips.begin() + i, roundtrips.end());
+    return roundtrips[i];
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv)
+{
+    int numclients = argc > 1 ? atoi(argv[1]) : 8, seconds = argc > 2 ? atoi(argv[2]) : 30;
+    const char *mode = argc > 3 ? argv[3] : "pos";
+    int traffic = !strcmp(mode, "idle") ? T_IDLE : !strcmp(mode, "edit") ? T_EDIT : T_POS;
+    int rate = std::max(argc > 4 ? atoi(argv[4]) : 100, 1);
+    ENetAddress server;
+    server.host = ENET_HOST_TO_NET_32(0x7F000001);
+    server.port = argc > 5 ? atoi(argv[5]) : INEXOR_SERVER_PORT;
+    if(enet_initialize() < 0) { fprintf(stderr, "unable to initialise network module\n"); return EXIT_FAILURE; }
+
+    ENetHost *host = enet_host_create(NULL, numclients, 3, 0, 0);
+    if(!host) { fprintf(stderr, "could not create client host\n"); return EXIT_FAILURE; }
+    start = steadyclock::now();
+    clients.reserve(numclients);
+    for(int i = 0; i < numclients; i++)
+    {
+        clients.emplace_back(i);
+        clients.back().peer = enet_host_connect(host, &server, 3, 0);
+    }
+    for(client &c : clients) if(c.peer) c.peer->data = &c;
+
+    long sentpackets = 0;
+    int report = 1000;
+    for(int t = 1; t <= seconds;)
+    {
+        ENetEvent event;
+        while(enet_host_service(host, &event, 1) > 0)
+        {
+            client *c = (client *)event.peer->data;
+            switch(event.type)
+            {
+                case ENET_EVENT_TYPE_CONNECT:
+                    c->connected = true;
+                    sendintro(*c);
+                    break;
+
+                case ENET_EVENT_TYPE_RECEIVE:
+                    receive(*c, event.packet);
+                    enet_packet_destroy(event.packet);
+                    break;
+
+                case ENET_EVENT_TYPE_DISCONNECT:
+                    if(c->connected) disconnects++;
+                    c->connected = c->welcomed = c->voted = false;
+                    c->cn = -1;
+                    c->peer = enet_host_connect(host, &server, 3, 0);
+                    if(c->peer) c->peer->data = c;
+                    break;
+
+                default:
+                    break;
+            }
+        }
+
+        int now = millis();
+        for(client &c : clients)
+        {
+            if(!c.connected || !c.welcomed) continue;
+            if(now >= c.nextping)
+            {
+                sendsimple(c, N_PING, now, true);
+                c.nextping = now + PINGMILLIS;
+            }
+            if(traffic == T_EDIT && !c.voted)
+            {
+                sendvote(c);
+                c.voted = true;
+            }
+            if(traffic == T_EDIT && now >= c.nexteditmode)
+            {
+                // again after every map change, the server ignores it while we are editing
+                sendsimple(c, N_EDITMODE, 1, true);
+                c.nexteditmode = now + 1000;
+            }
+            if(traffic == T_IDLE || now < c.nextsend) continue;
+            if(traffic == T_EDIT) sendedits(c);
+            sendposition(c, now);
+            sentpackets++;
+            c.nextsend = std::max(c.nextsend + std::max(1000/rate, 1), now - 1000);
+        }
+        enet_host_flush(host);
+
+        if(now < report) continue;
+        int connected = 0;
+        for(client &c : clients) if(c.connected && c.welcomed) connected++;
+        printf("%3ds: %d/%d clients, %ld packets/s sent, %.0f kB/s received, round trip p50 %d ms, p99 %d ms, max %d ms (%d pongs), %ld disconnects\n",
+               t, connected, numclients, sentpackets, host->totalReceivedData/1024.0, percentile(50), percentile(99), percentile(100),
+               int(roundtrips.size()), disconnects);
+        fflush(stdout);
+        roundtrips.clear();
+        sentpackets = 0;
+        host->totalReceivedData = 0;
+        report += 1000;
+        t++;
+    }
+    for(client &c : clients) if(c.peer && c.connected) enet_peer_disconnect_now(c.peer, 0);
+    enet_host_destroy(host);
+    enet_deinitialize();
+    return EXIT_SUCCESS;
+}
@@ -1,5 +1,11 @@
 // worldio.cpp: loading & saving of maps and savegames
 
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
 #include "inexor/engine/engine.hpp"
 #include "inexor/filesystem/mediadirs.hpp"
 #include "inexor/util/Logging.hpp"
@@ -55,19 +61,331 @@ static void fixent(entity &e, int version)
 	if(version <= 39 && e.type >= ET_OBSTACLE) e.type += 8; /// old sauerbomber maps
 }
 
+/// Map cache: the decompressed contents of an .ogz, so loading the map again needs no inflating.
+///
+/// Stored as <homedir>/cache/<path of the .ogz>.ogc:
+///
+///   mapcacheheader      all fields little endian
+///   uchar data[size]    the decompressed .ogz, exactly what the loaders read
+///
+/// The cache gets mapped into memory and is only used as long as the crc (which is getmapcrc())
+/// and size from the gzip trailer of the .ogz and the size of the .ogz itself still match,
+/// and the mapped data still has that crc. The crc goes to the server's modified map check, so it is never taken on trust.
+/// It is written by the prefetch thread of the first load, from the data it inflates.
+#define MAPCACHEVERSION 1
+
+struct mapcacheheader
+{
+    char magic[4];  // "OCTC"
+    int version;
+    uint crc, size; // of the decompressed data
+    uint ogzsize;
+};
+
+/// cache decompressed maps, see mapcacheheader
+VARP(mapcache, 0, 1, 1);
+
+static std::atomic<bool> writingmapcache(false);
+
+/// The header a valid cache of the given .ogz has, using its gzip trailer.
+static bool expectedmapcache(const char *ogzname, mapcacheheader &hdr)
+{
+    stream *f = openfile(ogzname, "rb");
+    if(!f) return false;
+    stream::offset size = f->size();
+    bool ok = size >= 18 && size < 0x7FFFFFFF && f->seek(-8, SEEK_END) && f->read(&hdr.crc, 2*sizeof(uint)) == 2*sizeof(uint);
+    delete f;
+    if(!ok) return false;
+    memcpy(hdr.magic, "OCTC", 4);
+    hdr.version = MAPCACHEVERSION;
+    lilswap(&hdr.crc, 2);
+    hdr.ogzsize = uint(size);
+    return true;
+}
+
+/// Writes the map cache from what the loader inflates anyway (see openprefetchstream()), into a temporary file
+/// which is moved in place when closed, if it received the complete and intact map.
+struct mapcachewriter : stream
+{
+    stream *out;
+    mapcacheheader hdr;
+    std::string dstname, tmpname;
+    uint crc;
+    size_t total;
+    bool ok;
+
+    mapcachewriter(stream *out, const mapcacheheader &hdr, const std::string &dstname)
+        : out(out), hdr(hdr), dstname(dstname), tmpname(dstname + ".tmp"), crc(crc32(0, NULL, 0)), total(0)
+    {
+        mapcacheheader lilhdr = hdr;
+        lilswap(&lilhdr.version, 4);
+        ok = out->write(&lilhdr, sizeof(lilhdr)) == sizeof(lilhdr);
+    }
+
+    ~mapcachewriter() { close(); }
+
+    void close()
+    {
+        if(!out) return;
+        DELETEP(out);
+        ok = ok && total == hdr.size && crc == hdr.crc;
+        if(ok)
+        {
+            remove(dstname.c_str());
+            ok = !rename(tmpname.c_str(), dstname.c_str());
+        }
+        if(!ok) remove(tmpname.c_str());
+        writingmapcache = false;
+    }
+
+    bool end() { return false; }
+
+    size_t write(const void *buf, size_t len)
+    {
+        if(ok) ok = out->write(buf, len) == len;
+        crc = crc32(crc, (const Bytef *)buf, len);
+        total += len;
+        return len;
+    }
+};
+
+/// NULL if another cache is being written right now.
+static stream *openmapcachewriter(const char *cachename, const mapcacheheader &hdr)
+{
+    if(writingmapcache.exchange(true)) return NULL;
+    string tmp;
+    formatstring(tmp, "%s.tmp", cachename);
+    stream *out = openrawfile(tmp, "wb");
+    if(!out)
+    {
+        writingmapcache = false;
+        return NULL;
+    }
+    // where openrawfile() put it
+    return new mapcachewriter(out, hdr, findfile(cachename, "wb"));
+}
+
+/// Open the decompressed contents of a map: straight from the map cache if that is up to date,
+/// otherwise inflating the .ogz on a background thread, which refreshes the cache with the inflated data as well.
+/// @param cached set if it came from the cache, crc is set to the checksum of the whole map then
+static stream *openmapdata(const char *ogzname, bool &cached, uint &crc)
+{
+    cached = false;
+    mapcacheheader expected;
+    if(mapcache && expectedmapcache(ogzname, expected))
+    {
+        string cachename;
+        formatstring(cachename, "cache/%s", ogzname);
+        cutogz(cachename);
+        concatstring(cachename, ".ogc");
+        path(cachename);
+        stream *f = openmappedfile(findfile(cachename, "rb"));
+        if(f)
+        {
+            mapcacheheader hdr;
+            if(f->read(&hdr, sizeof(hdr)) == sizeof(hdr))
+            {
+                lilswap(&hdr.version, 4);
+                if(!memcmp(&hdr, &expected, sizeof(hdr)) && f->size() == stream::offset(sizeof(hdr) + hdr.size))
+                {
+                    // the header only says which .ogz the cache was made from, the data has to match it as well
+                    uint datacrc = crc32(0, NULL, 0);
+                    uchar buf[64*1024];
+                    for(size_t len; (len = f->read(buf, sizeof(buf))) > 0;) datacrc = crc32(datacrc, buf, len);
+                    if(datacrc == hdr.crc && f->seek(sizeof(hdr), SEEK_SET))
+                    {
+                        cached = true;
+                        crc = datacrc;
+                        return f;
+                    }
+                    spdlog::get("global")->warn("map cache {} does not match {}, discarding it", cachename, ogzname);
+                    delete f;
+                    remove(findfile(cachename, "rb"));
+                    f = NULL;
+                }
+            }
+            delete f;
+        }
+        stream *gz = opengzfile(ogzname, "rb");
+        return openprefetchstream(gz, gz ? openmapcachewriter(cachename, expected) : NULL);
+    }
+    return openprefetchstream(opengzfile(ogzname, "rb"));
+}
+
+
+/// OCTREE children type enumeration
+enum 
+{
+    OCTSAV_CHILDREN = 0,
+    OCTSAV_EMPTY, 
+    OCTSAV_SOLID, 
+    OCTSAV_NORMAL,
+    OCTSAV_LODCUBE
+};
+
+/// convert a material index from Cube2 to a material index from Cube1
+/// @return the index in the old material format
+static inline int convertoldmaterial(int mat)
+{
+    /// weird bit operations
+    return ((mat&7)<<MATF_VOLUME_SHIFT) | (((mat>>3)&3)<<MATF_CLIP_SHIFT) | (((mat>>5)&7)<<MATF_FLAG_SHIFT);
+}
+
+/// skip the vslots in front of the octree, see loadvslots()
+static void skipvslots(stream *f, int numvslots)
+{
+    /// the sizes of the VSLOT_SCALE .. VSLOT_COLOR fields, VSLOT_SHPARAM has a variable size
+    static const int fieldsizes[] = { 0, 4, 4, 8, 8, 4, 8, 12 };
+    while(numvslots > 0)
+    {
+        int changed = f->getlil<int>();
+        if(changed < 0)
+        {
+            numvslots += changed;
+            continue;
+        }
+        f->getlil<int>(); // prev
+        if(changed & 1)
+        {
+            int numparams = f->getlil<ushort>();
+            loopi(numparams)
+            {
+                int nlen = f->getlil<ushort>();
+                f->seek(nlen + 4*sizeof(float), SEEK_CUR);
+            }
+        }
+        for(int i = 1; i < int(sizeof(fieldsizes)/sizeof(fieldsizes[0])); i++) if(changed & (1<<i)) f->seek(fieldsizes[i], SEEK_CUR);
+        numvslots--;
+    }
+}
+
+/// skip the surfaces of a cube, see loadc()
+static void skipsurfaces(stream *f)
+{
+    int surfmask = f->getchar();
+    f->getchar(); // totalverts
+    loopi(6) if(surfmask&(1<<i))
+    {
+        uchar surf[4]; // surfaceinfo: lmid[2], verts, numverts
+        f->read(surf, sizeof(surf));
+        int vertmask = surf[2], layerverts = surf[3]&0xF; // MAXFACEVERTS
+        bool dup = (surf[3]&0x80) != 0; // LAYER_DUP
+        if(!layerverts) continue;
+        bool hasxyz = (vertmask&0x04)!=0, hasuv = (vertmask&0x40)!=0, hasnorm = (vertmask&0x80)!=0;
+        int len = 0;
+        if(layerverts == 4)
+        {
+            if(hasxyz && vertmask&0x01) { len += 4*sizeof(ushort); hasxyz = false; }
+            if(hasuv && vertmask&0x02) { len += (dup ? 8 : 4)*sizeof(ushort); hasuv = false; }
+        }
+        if(hasnorm && vertmask&0x08) { len += sizeof(ushort); hasnorm = false; }
+        len += layerverts*((hasxyz ? 2 : 0) + (hasuv ? 2 : 0) + (hasnorm ? 1 : 0))*sizeof(ushort);
+        if(dup && hasuv) len += layerverts*2*sizeof(ushort);
+        f->seek(len, SEEK_CUR);
+    }
+}
+
+static bool loadcollisionchildren(stream *f, collisionmap &geom, int parent, int version);
+
+/// read the shape and material of a cube and skip everything else
+static bool loadcollisionnode(stream *f, collisionmap &geom, int n, int version)
+{
+    bool haschildren = false;
+    int octsav = f->getchar();
+    collisionmap::node *c = &geom.nodes[n];
+    switch(octsav&0x7)
+    {
+        case OCTSAV_CHILDREN: return loadcollisionchildren(f, geom, n, version);
+        case OCTSAV_LODCUBE: haschildren = true; break;
+        case OCTSAV_EMPTY: memset(c->edges, 0, sizeof(c->edges)); break;
+        case OCTSAV_SOLID: memset(c->edges, 0x80, sizeof(c->edges)); break;
+        case OCTSAV_NORMAL: f->read(c->edges, sizeof(c->edges)); break;
+        default: return false;
+    }
+    f->seek(6*sizeof(ushort), SEEK_CUR); // textures
+    if(octsav&0x40) c->material = version <= 32 ? convertoldmaterial(f->getchar()) : f->getlil<ushort>();
+    if(octsav&0x80) f->getchar(); // merged
+    if(octsav&0x20) skipsurfaces(f);
+    return !haschildren || loadcollisionchildren(f, geom, n, version);
+}
+
+static bool loadcollisionchildren(stream *f, collisionmap &geom, int parent, int version)
+{
+    int first = geom.nodes.length();
+    memset(geom.nodes.pad(8), 0, 8*sizeof(collisionmap::node));
+    geom.nodes[parent].children = first;
+    loopi(8) if(!loadcollisionnode(f, geom, first + i, version)) return false;
+    return true;
+}
+
+const collisionmap::node &collisionmap::lookup(const ivec &o, ivec &co, int &size) const
+{
+    const node *n = &nodes[0];
+    co = ivec(0, 0, 0);
+    size = worldsize;
+    while(n->children)
+    {
+        size >>= 1;
+        int i = (o.x&size ? 1 : 0) | (o.y&size ? 2 : 0) | (o.z&size ? 4 : 0);
+        co = ivec(i, co, size);
+        n = &nodes[n->children + i];
+    }
+    return *n;
+}
+
+float collisionmap::raycube(const vec &o, const vec &ray, float maxdist) const
+{
+    if(nodes.empty()) return maxdist;
+    // clip the ray to the world box
+    float dist = 0, limit = maxdist;
+    loopi(3)
+    {
+        if(ray[i])
+        {
+            float t1 = (0 - o[i])/ray[i], t2 = (worldsize - o[i])/ray[i];
+            if(t1 > t2) swap(t1, t2);
+            dist = max(dist, t1);
+            limit = min(limit, t2);
+        }
+        else if(o[i] < 0 || o[i] >= worldsize) return maxdist;
+    }
+    while(dist < limit)
+    {
+        vec v = vec(ray).mul(dist).add(o);
+        ivec p(clamp(int(floor(v.x)), 0, worldsize-1), clamp(int(floor(v.y)), 0, worldsize-1), clamp(int(floor(v.z)), 0, worldsize-1)), co;
+        int size;
+        const node &n = lookup(p, co, size);
+        uint faces[3];
+        memcpy(faces, n.edges, sizeof(faces));
+        if(faces[0] == 0x80808080 && faces[1] == 0x80808080 && faces[2] == 0x80808080) return dist; // F_SOLID
+        // step out of the leaf
+        float exit = 1e16f;
+        loopi(3)
+        {
+            if(ray[i] > 0) exit = min(exit, (co[i] + size - v[i])/ray[i]);
+            else if(ray[i] < 0) exit = min(exit, (co[i] - v[i])/ray[i]);
+        }
+        dist += max(exit, 0.0f) + 0.01f;
+    }
+    return maxdist;
+}
+
 
 /// load/parse entities from a file
 /// @param fname file name which conains compressed OGZ content (a map)
 /// @param ents a reference to a vector of entites in which parsed entities from this file will be copied
 /// @param crc the CRC32 hash sum of this map
+/// @param geom if given, the octree is read into it as well (only supported for map version 32 and newer)
 /// @see getmapfilename
-bool loadents(const char *fname, vector<entity> &ents, uint *crc)
+bool loadents(const char *fname, vector<entity> &ents, uint *crc, collisionmap *geom)
 {
     string mapname, ogzname;
     getmapfilename(fname, NULL, mapname);
     formatstring(ogzname, "%s/%s.ogz", *mapdir, mapname);
     path(ogzname);
-    stream *f = opengzfile(ogzname, "rb");
+    bool cached;
+    uint cachedcrc = 0;
+    stream *f = openmapdata(ogzname, cached, cachedcrc);
     if(!f) return false;
     octaheader hdr;
     if(f->read(&hdr, 7*sizeof(int)) != 7*sizeof(int)) { spdlog::get("global")->error("map {} has malformatted header", ogzname); delete f; return false; }
@@ -162,11 +480,34 @@ bool loadents(const char *fname, vector<entity> &ents, uint *crc)
         }
     }
 
+    if(geom)
+    {
+        geom->clear();
+        if(hdr.version <= 31) spdlog::get("global")->warn("map {} is too old to load its geometry only", ogzname);
+        else
+        {
+            if(hdr.numents > MAXENTS) f->seek((hdr.numents-MAXENTS)*(sizeof(entity) + eif), SEEK_CUR);
+            skipvslots(f, hdr.numvslots);
+            geom->worldsize = hdr.worldsize;
+            geom->nodes.add(collisionmap::node());
+            memset(geom->nodes.getbuf(), 0, sizeof(collisionmap::node));
+            if(!loadcollisionchildren(f, *geom, 0, hdr.version))
+            {
+                spdlog::get("global")->error("garbage in map {}", ogzname);
+                geom->clear();
+            }
+        }
+    }
+
     /// calculate CRC32 hash sum from file stream
     if(crc)
     {
-        f->seek(0, SEEK_END);
-        *crc = f->getcrc();
+        if(cached) *crc = cachedcrc;
+        else
+        {
+            f->seek(0, SEEK_END);
+            *crc = f->getcrc();
+        }
     }
     
     delete f;
@@ -174,6 +515,34 @@ bool loadents(const char *fname, vector<entity> &ents, uint *crc)
     return true;
 }
 
+/// The maps loaded by loadsharedmap(), only while anyone still holds them.
+static std::mutex sharedmaplock;
+static std::unordered_map<std::string, std::weak_ptr<sharedmap>> sharedmaps;
+
+std::shared_ptr<const sharedmap> loadsharedmap(const char *fname, bool geometry)
+{
+    std::shared_ptr<sharedmap> map;
+    {
+        std::lock_guard<std::mutex> lock(sharedmaplock);
+        std::weak_ptr<sharedmap> &entry = sharedmaps[fname];
+        map = entry.lock();
+        if(!map || (geometry && !map->geometry))
+        {
+            for(auto i = sharedmaps.begin(); i != sharedmaps.end();)
+            {
+                if(i->second.expired() && &i->second != &entry) i = sharedmaps.erase(i);
+                else ++i;
+            }
+            map = std::make_shared<sharedmap>();
+            map->geometry = geometry;
+            entry = map;
+        }
+    }
+    // the others asking for it meanwhile wait here until it is loaded
+    std::call_once(map->loading, [&] { map->loaded = loadents(fname, map->ents, &map->crc, map->geometry ? &map->geom : NULL); });
+    if(!map->loaded) return NULL;
+    return map;
+}
 
 
 
@@ -239,16 +608,6 @@ void backup(char *name, char *backupname)
 }
 
 
-/// OCTREE children type enumeration
-enum 
-{
-    OCTSAV_CHILDREN = 0,
-    OCTSAV_EMPTY, 
-    OCTSAV_SOLID, 
-    OCTSAV_NORMAL,
-    OCTSAV_LODCUBE
-};
-
 static int savemapprogress = 0;
 
 
@@ -561,14 +920,6 @@ void convertoldsurfaces(cube &c, const ivec &co, int size, surfacecompat *srcsur
     setsurfaces(c, dstsurfs, verts, totalverts);
 }
 
-/// convert a material index from Cube2 to a material index from Cube1
-/// @return the index in the old material format
-static inline int convertoldmaterial(int mat)
-{
-    /// weird bit operations
-    return ((mat&7)<<MATF_VOLUME_SHIFT) | (((mat>>3)&3)<<MATF_CLIP_SHIFT) | (((mat>>5)&7)<<MATF_FLAG_SHIFT);
-}
- 
 
 
 
@@ -1168,11 +1519,45 @@ void clearmapcrc()
     mapcrc = 0;
 }
 
+/// Timings of the phases of the last load_world().
+struct maploadtimer
+{
+    struct phase
+    {
+        const char *name;
+        double millis;
+    };
+    vector<phase> phases;
+    std::chrono::steady_clock::time_point last;
+
+    void start()
+    {
+        phases.setsize(0);
+        last = std::chrono::steady_clock::now();
+    }
+
+    void mark(const char *name)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        phase &p = phases.add();
+        p.name = name;
+        p.millis = std::chrono::duration<double, std::milli>(now - last).count();
+        last = now;
+    }
+};
+static maploadtimer maploadtimes;
+
+/// print the time each phase of loading a map took
+VAR(dbgmapload, 0, 0, 1);
+
 bool load_world(const char *mname, const char *cname)        // still supports all map formats that have existed since the earliest cube betas!
 {
     int loadingstart = SDL_GetTicks();
+    maploadtimes.start();
     setmapfilenames(mname, cname);
-    stream *f = opengzfile(ogzname, "rb");
+    bool cached;
+    uint cachedcrc = 0;
+    stream *f = openmapdata(ogzname, cached, cachedcrc);
     if(!f) { spdlog::get("global")->error("could not read map {0}", ogzname); return false; }
     octaheader hdr;
     if(f->read(&hdr, 7*sizeof(int)) != 7*sizeof(int)) { spdlog::get("global")->error("map {0} has malformatted header", ogzname); delete f; return false; }
@@ -1318,6 +1703,7 @@ bool load_world(const char *mname, const char *cname)        // still supports a
         ushort nummru = f->getlil<ushort>();
         loopi(nummru) texmru.add(f->getlil<ushort>());
     }
+    maploadtimes.mark("header, vars");
 
     renderprogress(0, "loading entities...");
 
@@ -1367,17 +1753,21 @@ bool load_world(const char *mname, const char *cname)        // still supports a
         spdlog::get("global")->warn("warning: map has {} entities", hdr.numents);
         f->seek((hdr.numents-MAXENTS)*(samegame ? sizeof(entity) + einfosize : eif), SEEK_CUR);
     }
+    maploadtimes.mark("entities");
 
     renderprogress(0, "loading slots...");
     loadvslots(f, hdr.numvslots);
+    maploadtimes.mark("slots");
 
     renderprogress(0, "loading octree...");
     bool failed = false;
     worldroot = loadchildren(f, ivec(0, 0, 0), hdr.worldsize>>1, failed);
     if(failed) spdlog::get("global")->error("garbage in map");
+    maploadtimes.mark("octree");
 
     renderprogress(0, "validating...");
     validatec(worldroot, hdr.worldsize>>1);
+    maploadtimes.mark("validating");
 
     if(!failed)
     {
@@ -1405,8 +1795,9 @@ bool load_world(const char *mname, const char *cname)        // still supports a
         if(hdr.version >= 28 && hdr.blendmap) loadblendmap(f, hdr.blendmap);
     }
 
-    mapcrc = f->getcrc();
+    mapcrc = cached ? cachedcrc : f->getcrc();
     delete f;
+    maploadtimes.mark("lightmaps, pvs, blendmap");
 
     spdlog::get("global")->info("read map {} ({} seconds)", ogzname, ((SDL_GetTicks()-loadingstart)/1000.0f));
 
@@ -1417,6 +1808,7 @@ bool load_world(const char *mname, const char *cname)        // still supports a
     execfile(cfgname, false);
 
     identflags &= ~IDF_OVERRIDDEN;
+    maploadtimes.mark("map config");
 
     extern void fixlightmapnormals();
     if(hdr.version <= 25) fixlightmapnormals();
@@ -1427,13 +1819,18 @@ bool load_world(const char *mname, const char *cname)        // still supports a
 
     game::preload();
     flushpreloadedmodels();
+    maploadtimes.mark("models");
 
     preloadmapsounds();
+    maploadtimes.mark("sounds");
 
     entitiesinoctanodes();
     attachentities();
     initlights();
+    maploadtimes.mark("entities in octree, lights");
     allchanged(true);
+    maploadtimes.mark("geometry");
+    if(dbgmapload) loopv(maploadtimes.phases) spdlog::get("global")->debug("map load: {0} {1:.1f} ms", maploadtimes.phases[i].name, maploadtimes.phases[i].millis);
 
     renderbackground("loading...", mapshot, mname);
 
@@ -1444,6 +1841,53 @@ bool load_world(const char *mname, const char *cname)        // still supports a
     return true;
 }
 
+/// Load a map a number of times and print how long each phase took (best and average run).
+/// Started with --benchmark-mapload <map> [runs], the client quits afterwards.
+void benchmarkmapload(const char *mname, int runs)
+{
+    vector<maploadtimer::phase> best, sum;
+    loopi(runs)
+    {
+        if(!load_world(mname)) { spdlog::get("global")->error("[map load benchmark] could not load map {}", mname); return; }
+        if(!i)
+        {
+            best = maploadtimes.phases;
+            sum = maploadtimes.phases;
+            continue;
+        }
+        loopvj(maploadtimes.phases) if(best.inrange(j))
+        {
+            best[j].millis = min(best[j].millis, maploadtimes.phases[j].millis);
+            sum[j].millis += maploadtimes.phases[j].millis;
+        }
+    }
+    double besttotal = 0, avgtotal = 0;
+    loopv(best)
+    {
+        spdlog::get("global")->info("[map load benchmark] {0:<28} best {1:8.1f} ms, avg {2:8.1f} ms", best[i].name, best[i].millis, sum[i].millis/runs);
+        besttotal += best[i].millis;
+        avgtotal += sum[i].millis/runs;
+    }
+    spdlog::get("global")->info("[map load benchmark] {0}: {1} runs, best {2:.1f} ms, avg {3:.1f} ms", mname, runs, besttotal, avgtotal);
+
+    // what a dedicated server does with the same map
+    double geombest = 1e9, geomsum = 0;
+    vector<entity> ents;
+    collisionmap geom;
+    loopi(runs)
+    {
+        ents.setsize(0);
+        maploadtimer timer;
+        timer.start();
+        loadents(mname, ents, NULL, &geom);
+        timer.mark("entities, geometry");
+        geombest = min(geombest, timer.phases[0].millis);
+        geomsum += timer.phases[0].millis;
+    }
+    spdlog::get("global")->info("[map load benchmark] {0}: geometry only ({1} nodes, {2} KB), best {3:.1f} ms, avg {4:.1f} ms",
+                                mname, geom.nodes.length(), geom.nodes.length()*sizeof(collisionmap::node)/1024, geombest, geomsum/runs);
+}
+
 /// Export/Convert the current octree map, texture coordinates, material information 
 /// and more to an Object File and a Material Library File
 /// @param name the .OBJ file name
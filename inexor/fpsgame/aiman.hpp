@@ -4,7 +4,7 @@
 
 namespace aiman
 {
-    bool dorefresh = false, botbalance = true;
+    SERVERLOCAL bool dorefresh = false, botbalance = true;
 
     // limit amount of computer controlled players on your server
     VARN(serverbotlimit, botlimit, 0, 8, MAXBOTS);
@@ -176,6 +176,8 @@ namespace game
 
     bool connected = false, remote = false, demoplayback = false, gamepaused = false, teamspersisted = false;
     int sessionid = 0, mastermode = MM_OPEN, gamespeed = 100;
+    /// The demo jumped, the item list of the keyframe which follows replaces ours.
+    bool demoseeked = false;
     string servinfo = "", servauth = "", connectpass = "";
 
     /// push dead bodies (?)
@@ -1156,11 +1158,9 @@ namespace game
 
     /// network message parser
 
-	/// format position in network packet
-	static void sendposition(fpsent *d, packetbuf &q)
+	/// format position in network packet (without message type and client number)
+	static void putposition(fpsent *d, ucharbuf &q)
     {
-        putint(q, N_POS);
-        putuint(q, d->clientnum);
         // 3 bits phys state, 1 bit life sequence, 2 bits move, 2 bits strafe
         uchar physstate = d->physstate | ((d->lifesequence&1)<<3) | ((d->move&3)<<4) | ((d->strafe&3)<<6);
         q.put(physstate);
@@ -1212,12 +1212,21 @@ namespace game
         }
     }
 
+    /// write position as full N_POS keyframe or as N_POSDELTA against the last keyframe
+    static void sendposition(fpsent *d, packetbuf &q, bool keyframe = false)
+    {
+        uchar buf[MAXPOSBYTES];
+        ucharbuf b(buf, sizeof(buf));
+        putposition(d, b);
+        encodeposition(q, d->clientnum, buf, b.length(), d->poskey, d->posdeltas, keyframe);
+    }
+
     /// send my own player position to server (call function above)
     void sendposition(fpsent *d, bool reliable)
     {
         if(d->state != CS_ALIVE && d->state != CS_EDITING) return; // do not send position in spectator mode
         packetbuf q(100, reliable ? ENET_PACKET_FLAG_RELIABLE : 0);
-        sendposition(d, q);
+        sendposition(d, q, true);
         sendclientpacket(q.finalize(), 0);
     }
 
@@ -1345,6 +1354,82 @@ namespace game
         }
     }
 
+    /// apply the payload of a N_POS (everything after the client number) to client cn
+    static void parseposition(int cn, ucharbuf &p)
+    {
+        int physstate = p.get(), flags = getuint(p);
+        vec o, vel, falling;
+        float yaw, pitch, roll;
+        loopk(3)
+        {
+            int n = p.get(); 
+			n |= p.get()<<8; 
+			if(flags&(1<<k)) 
+			{ 
+				n |= p.get()<<16; 
+                if(n&0x800000) n |= -1<<24;
+			}
+            o[k] = n/DMF;
+        }
+        int dir = p.get(); dir |= p.get()<<8;
+        yaw = dir%360;
+        pitch = clamp(dir/360, 0, 180)-90;
+        roll = clamp(int(p.get()), 0, 180)-90;
+        int mag = p.get(); if(flags&(1<<3)) mag |= p.get()<<8;
+        dir = p.get(); dir |= p.get()<<8;
+        vecfromyawpitch(dir%360, clamp(dir/360, 0, 180)-90, 1, 0, vel);
+        vel.mul(mag/DVELF);
+        if(flags&(1<<4))
+        {
+            mag = p.get(); if(flags&(1<<5)) mag |= p.get()<<8;
+            if(flags&(1<<6))
+            {
+                dir = p.get(); dir |= p.get()<<8;
+                vecfromyawpitch(dir%360, clamp(dir/360, 0, 180)-90, 1, 0, falling);
+            }
+            else falling = vec(0, 0, -1);
+            falling.mul(mag/DVELF);
+        }
+        else falling = vec(0, 0, 0);
+        int seqcolor = (physstate>>3)&1;
+        fpsent *d = getclient(cn);
+        if(!d || d->lifesequence < 0 || seqcolor!=(d->lifesequence&1) || d->state==CS_DEAD) return;
+        float oldyaw = d->yaw, oldpitch = d->pitch, oldroll = d->roll;
+        d->yaw = yaw;
+        d->pitch = pitch;
+        d->roll = roll;
+        d->move = (physstate>>4)&2 ? -1 : (physstate>>4)&1;
+        d->strafe = (physstate>>6)&2 ? -1 : (physstate>>6)&1;
+        vec oldpos(d->o);
+        d->o = o;
+        d->o.z += d->eyeheight;
+        d->vel = vel;
+        d->falling = falling;
+        d->physstate = physstate&7;
+        updatephysstate(d);
+        updatepos(d);
+        if(smoothmove && d->smoothmillis>=0 && oldpos.dist(d->o) < smoothdist)
+        {
+            d->newpos = d->o;
+            d->newyaw = d->yaw;
+            d->newpitch = d->pitch;
+            d->newroll = d->roll;
+            d->o = oldpos;
+            d->yaw = oldyaw;
+            d->pitch = oldpitch;
+            d->roll = oldroll;
+            (d->deltapos = oldpos).sub(d->newpos);
+            d->deltayaw = oldyaw - d->newyaw;
+            if(d->deltayaw > 180) d->deltayaw -= 360;
+            else if(d->deltayaw < -180) d->deltayaw += 360;
+            d->deltapitch = oldpitch - d->newpitch;
+            d->deltaroll = oldroll - d->newroll;
+            d->smoothmillis = lastmillis;
+        }
+        else d->smoothmillis = 0;
+        if(d->state==CS_LAGGED || d->state==CS_SPAWNING) d->state = CS_ALIVE;
+    }
+
 	// parse player positions from network packages
     void parsepositions(ucharbuf &p)
     {
@@ -1354,77 +1439,22 @@ namespace game
             case N_DEMOPACKET: break;
             case N_POS:                        // position of another client
             {
-                int cn = getuint(p), physstate = p.get(), flags = getuint(p);
-                vec o, vel, falling;
-                float yaw, pitch, roll;
-                loopk(3)
-                {
-                    int n = p.get(); 
-					n |= p.get()<<8; 
-					if(flags&(1<<k)) 
-					{ 
-						n |= p.get()<<16; 
-                        if(n&0x800000) n |= -1<<24;
-					}
-                    o[k] = n/DMF;
-                }
-                int dir = p.get(); dir |= p.get()<<8;
-                yaw = dir%360;
-                pitch = clamp(dir/360, 0, 180)-90;
-                roll = clamp(int(p.get()), 0, 180)-90;
-                int mag = p.get(); if(flags&(1<<3)) mag |= p.get()<<8;
-                dir = p.get(); dir |= p.get()<<8;
-                vecfromyawpitch(dir%360, clamp(dir/360, 0, 180)-90, 1, 0, vel);
-                vel.mul(mag/DVELF);
-                if(flags&(1<<4))
-                {
-                    mag = p.get(); if(flags&(1<<5)) mag |= p.get()<<8;
-                    if(flags&(1<<6))
-                    {
-                        dir = p.get(); dir |= p.get()<<8;
-                        vecfromyawpitch(dir%360, clamp(dir/360, 0, 180)-90, 1, 0, falling);
-                    }
-                    else falling = vec(0, 0, -1);
-                    falling.mul(mag/DVELF);
-                }
-                else falling = vec(0, 0, 0);
-                int seqcolor = (physstate>>3)&1;
+                int cn = getuint(p), start = p.length();
+                parseposition(cn, p);
                 fpsent *d = getclient(cn);
-                if(!d || d->lifesequence < 0 || seqcolor!=(d->lifesequence&1) || d->state==CS_DEAD) continue;
-                float oldyaw = d->yaw, oldpitch = d->pitch, oldroll = d->roll;
-                d->yaw = yaw;
-                d->pitch = pitch;
-                d->roll = roll;
-                d->move = (physstate>>4)&2 ? -1 : (physstate>>4)&1;
-                d->strafe = (physstate>>6)&2 ? -1 : (physstate>>6)&1;
-                vec oldpos(d->o);
-                d->o = o;
-                d->o.z += d->eyeheight;
-                d->vel = vel;
-                d->falling = falling;
-                d->physstate = physstate&7;
-                updatephysstate(d);
-                updatepos(d);
-                if(smoothmove && d->smoothmillis>=0 && oldpos.dist(d->o) < smoothdist)
-                {
-                    d->newpos = d->o;
-                    d->newyaw = d->yaw;
-                    d->newpitch = d->pitch;
-                    d->newroll = d->roll;
-                    d->o = oldpos;
-                    d->yaw = oldyaw;
-                    d->pitch = oldpitch;
-                    d->roll = oldroll;
-                    (d->deltapos = oldpos).sub(d->newpos);
-                    d->deltayaw = oldyaw - d->newyaw;
-                    if(d->deltayaw > 180) d->deltayaw -= 360;
-                    else if(d->deltayaw < -180) d->deltayaw += 360;
-                    d->deltapitch = oldpitch - d->newpitch;
-                    d->deltaroll = oldroll - d->newroll;
-                    d->smoothmillis = lastmillis;
-                }
-                else d->smoothmillis = 0;
-                if(d->state==CS_LAGGED || d->state==CS_SPAWNING) d->state = CS_ALIVE;
+                if(d) d->poskey.set(&p.buf[start], p.length()-start);
+                break;
+            }
+
+            case N_POSDELTA:
+            {
+                int cn = getuint(p), len = 0;
+                fpsent *d = getclient(cn);
+                static const poskeyframe unknown;
+                uchar buf[MAXPOSBYTES];
+                if(!(d ? d->poskey : unknown).getdelta(p, buf, len)) break;
+                ucharbuf q(buf, len);
+                parseposition(cn, q);
                 break;
             }
 
@@ -1633,6 +1663,7 @@ namespace game
                 getstring(text, p);
                 changemapserv(text, getint(p));
                 mapchanged = true;
+                demoseeked = false;
                 if(getint(p)) entities::spawnitems();
                 else senditemstoserver = false;
                 break;
@@ -1658,9 +1689,10 @@ namespace game
                 int n;
                 while((n = getint(p))>=0 && !p.overread())
                 {
-                    if(mapchanged) entities::setspawn(n, true);
+                    if(mapchanged || demoseeked) entities::setspawn(n, true);
                     getint(p); // type
                 }
+                demoseeked = false;
                 break;
             }
 
@@ -2123,6 +2155,17 @@ namespace game
                 break;
             }
 
+            case N_SEEKDEMO:
+            {
+                getint(p); // the demo time jumped to
+                if(!demoplayback) break;
+                // a keyframe rebuilds the game state, the map stays and no demo hooks fire
+                clearclients(false);
+                entities::resetspawns();
+                demoseeked = true;
+                break;
+            }
+
             case N_CURRENTMASTER:
             {
                 int mm = getint(p), mn;
@@ -2292,6 +2335,27 @@ namespace game
         }
     }
 
+    /// the coop edit map which is being downloaded in chunks
+    static vector<uchar> mapdownload;
+    static uint mapdownloadcrc = 0;
+
+    static void receivemap(const uchar *data, int len)
+    {
+        string oldname;
+        copystring(oldname, getclientmap());
+        defformatstring(mname, "getmap_%d", lastmillis);
+        Path fname = getmediapath(mname, DIR_MAP);
+        fname.replace_extension(".ogz");
+        stream *map = openrawfile(fname.string().c_str(), "wb");
+        if(!map) return;
+        spdlog::get("edit")->info("received map");
+        map->write(data, len);
+        delete map;
+        if(load_world(mname, oldname[0] ? oldname : NULL))
+            entities::spawnitems(true);
+        remove(findfile(fname.string().c_str(), "rb"));
+    }
+
     // accept file download from server
     void receivefile(packetbuf &p)
     {
@@ -2314,20 +2378,30 @@ namespace game
             case N_SENDMAP:
             {
                 if(!m_edit) return;
-                string oldname;
-                copystring(oldname, getclientmap());
-                defformatstring(mname, "getmap_%d", lastmillis);
-                Path fname = getmediapath(mname, DIR_MAP);
-                fname.replace_extension(".ogz");
-                stream *map = openrawfile(fname.string().c_str(), "wb");
-                if(!map) return;
-                spdlog::get("edit")->info("received map");
                 ucharbuf b = p.subbuf(p.remaining());
-                map->write(b.buf, b.maxlen);
-                delete map;
-                if(load_world(mname, oldname[0] ? oldname : NULL))
-                    entities::spawnitems(true);
-                remove(findfile(fname.string().c_str(), "rb"));
+                receivemap(b.buf, b.maxlen);
+                break;
+            }
+
+            case N_SENDMAPCHUNK:
+            {
+                uint crc = uint(getint(p));
+                int len = getint(p), offset = getint(p);
+                ucharbuf b = p.subbuf(p.remaining());
+                if(!m_edit || len <= 0 || offset + b.maxlen > len) return;
+                if(crc != mapdownloadcrc || offset != mapdownload.length())
+                {
+                    // a new download (or the server restarted it because the map changed)
+                    mapdownload.setsize(0);
+                    mapdownloadcrc = crc;
+                    if(offset) return;
+                }
+                mapdownload.put(b.buf, b.maxlen);
+                if(mapdownload.length() == len)
+                {
+                    receivemap(mapdownload.getbuf(), len);
+                    mapdownload.setsize(0);
+                }
                 break;
             }
         }
@@ -2375,6 +2449,13 @@ namespace game
     }
     COMMAND(stopdemo, ""); 
 
+    void seekdemo(int secs)
+    {
+        if(remote && player1->privilege<PRIV_MASTER) return;
+        addmsg(N_SEEKDEMO, "ri", secs*1000);
+    }
+    ICOMMAND(seekdemo, "i", (int *secs), seekdemo(*secs));
+
     void recorddemo(int val)
     {
         if(remote && player1->privilege<PRIV_MASTER) return;
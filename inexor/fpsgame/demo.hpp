@@ -0,0 +1,233 @@
+// demo container: included by server.cpp inside namespace server
+
+/// Demo files (DEMO_VERSION 2) are laid out as
+///
+///   demoheader                        uncompressed
+///   { demochunk, zlib data }*         the records, compressed chunk by chunk
+///   demochunk[numchunks]              the chunk index
+///   demotrailer                       locates the index
+///
+/// A record is { int millis, int chan, int len, uchar data[len] }, just like in the old gzipped stream.
+/// The recorder regularly starts a new chunk with a DEMO_KEYFRAME record (a full welcome packet),
+/// so seeking only has to decompress the chunks between the closest keyframe and the target.
+enum { DEMO_KEYFRAME = -1 };
+
+struct demochunk
+{
+    int millis, offset, len, rawlen, keyframe;
+};
+
+struct demotrailer
+{
+    char magic[8];
+    int numchunks, indexoffset;
+};
+
+static const char DEMO_INDEXMAGIC[8] = "DEMOIDX";
+
+/// Reads and byteswaps a demoheader, false if it is not a demo at all.
+static bool readdemoheader(stream *f, demoheader &hdr)
+{
+    if(f->read(&hdr, sizeof(demoheader))!=sizeof(demoheader) || memcmp(hdr.magic, DEMO_MAGIC, sizeof(hdr.magic))) return false;
+    lilswap(&hdr.version, 2);
+    return true;
+}
+
+static void writedemoheader(stream *f, int protocol = PROTOCOL_VERSION)
+{
+    demoheader hdr;
+    memcpy(hdr.magic, DEMO_MAGIC, sizeof(hdr.magic));
+    hdr.version = DEMO_VERSION;
+    hdr.protocol = protocol;
+    lilswap(&hdr.version, 2);
+    f->write(&hdr, sizeof(demoheader));
+}
+
+/// Collects records into chunks and writes them compressed, followed by the index on finish().
+struct demochunkwriter
+{
+    enum { MAXCHUNKSIZE = 256*1024 };
+
+    stream *out;
+    vector<uchar> buf;
+    vector<demochunk> index;
+    int millis;
+    bool keyframe;
+
+    demochunkwriter(stream *out) : out(out), millis(0), keyframe(false) {}
+
+    void add(int recmillis, int chan, const uchar *data, int len)
+    {
+        if(buf.length() && (chan==DEMO_KEYFRAME || buf.length() + len > MAXCHUNKSIZE)) flush();
+        if(buf.empty())
+        {
+            millis = recmillis;
+            keyframe = chan==DEMO_KEYFRAME;
+        }
+        int stamp[3] = { recmillis, chan, len };
+        lilswap(stamp, 3);
+        buf.put((const uchar *)stamp, sizeof(stamp));
+        buf.put(data, len);
+    }
+
+    void flush()
+    {
+        if(buf.empty()) return;
+        uLongf len = compressBound(buf.length());
+        uchar *packed = new uchar[len];
+        if(compress2(packed, &len, buf.getbuf(), buf.length(), Z_DEFAULT_COMPRESSION)==Z_OK)
+        {
+            demochunk &c = index.add();
+            c.millis = millis;
+            c.offset = int(out->tell());
+            c.len = int(len);
+            c.rawlen = buf.length();
+            c.keyframe = keyframe ? 1 : 0;
+            demochunk hdr = c;
+            lilswap(&hdr.millis, 5);
+            out->write(&hdr, sizeof(hdr));
+            out->write(packed, len);
+        }
+        delete[] packed;
+        buf.setsize(0);
+    }
+
+    void finish()
+    {
+        flush();
+        demotrailer t;
+        memcpy(t.magic, DEMO_INDEXMAGIC, sizeof(t.magic));
+        t.numchunks = index.length();
+        t.indexoffset = int(out->tell());
+        loopv(index)
+        {
+            demochunk c = index[i];
+            lilswap(&c.millis, 5);
+            out->write(&c, sizeof(c));
+        }
+        lilswap(&t.numchunks, 2);
+        out->write(&t, sizeof(t));
+    }
+};
+
+/// Random access to a chunked demo: only the chunk being played is held decompressed in memory.
+struct demoreader
+{
+    stream *file;
+    vector<demochunk> index;
+    vector<uchar> data;
+    int chunk, pos;
+
+    /// the current record, valid until the next call to next()
+    int millis, chan, len;
+    uchar *buf;
+
+    demoreader(stream *file) : file(file), chunk(-1), pos(0), millis(0), chan(0), len(0), buf(NULL) {}
+    ~demoreader() { DELETEP(file); }
+
+    /// Load the index from the trailer, or rebuild it from the chunk headers if the recording was cut off.
+    bool open()
+    {
+        demotrailer t;
+        if(file->seek(-stream::offset(sizeof(t)), SEEK_END) && file->read(&t, sizeof(t))==sizeof(t) && !memcmp(t.magic, DEMO_INDEXMAGIC, sizeof(t.magic)))
+        {
+            lilswap(&t.numchunks, 2);
+            // the index has to fit between its offset and the trailer, before we allocate room for it
+            stream::offset indexspace = file->size() - stream::offset(sizeof(t)) - t.indexoffset;
+            if(t.numchunks > 0 && t.indexoffset >= 0 && stream::offset(t.numchunks)*stream::offset(sizeof(demochunk)) <= indexspace
+               && file->seek(t.indexoffset, SEEK_SET))
+            {
+                demochunk *entries = index.pad(t.numchunks);
+                if(file->read(entries, t.numchunks*sizeof(demochunk))!=t.numchunks*sizeof(demochunk)) index.setsize(0);
+                else lilswap(&index[0].millis, 5*t.numchunks);
+            }
+        }
+        if(index.empty()) scan();
+        return index.length() > 0;
+    }
+
+    void scan()
+    {
+        demochunk c;
+        if(!file->seek(sizeof(demoheader), SEEK_SET)) return;
+        while(file->read(&c, sizeof(c))==sizeof(c))
+        {
+            lilswap(&c.millis, 5);
+            if(c.len <= 0 || c.rawlen <= 0 || c.offset != int(file->tell()) - int(sizeof(c))) break;
+            index.add(c);
+            if(!file->seek(c.len, SEEK_CUR)) break;
+        }
+    }
+
+    bool loadchunk(int i)
+    {
+        data.setsize(0);
+        chunk = i;
+        pos = 0;
+        if(!index.inrange(i)) return false;
+        demochunk &c = index[i];
+        if(c.len <= 0 || c.rawlen <= 0) return false;
+        uchar *packed = new uchar[c.len];
+        uLongf rawlen = c.rawlen;
+        bool ok = file->seek(c.offset + sizeof(demochunk), SEEK_SET) &&
+                  file->read(packed, c.len)==size_t(c.len) &&
+                  uncompress(data.reserve(c.rawlen).buf, &rawlen, packed, c.len)==Z_OK &&
+                  rawlen==uLongf(c.rawlen);
+        delete[] packed;
+        if(!ok) return false;
+        data.advance(c.rawlen);
+        return true;
+    }
+
+    /// Advance to the next record, continuing with the following chunk where the current one ends.
+    bool next()
+    {
+        while(pos >= data.length()) if(!loadchunk(chunk+1)) return false;
+        int stamp[3];
+        if(pos + int(sizeof(stamp)) > data.length()) return false;
+        memcpy(stamp, &data[pos], sizeof(stamp));
+        lilswap(stamp, 3);
+        pos += sizeof(stamp);
+        if(stamp[2] < 0 || pos + stamp[2] > data.length()) return false;
+        millis = stamp[0];
+        chan = stamp[1];
+        len = stamp[2];
+        buf = &data[pos];
+        pos += len;
+        return true;
+    }
+
+    /// The chunk to restart from to reach the given time: the last keyframe before it, or the beginning.
+    int findkeyframe(int target)
+    {
+        int lo = 0, hi = index.length();
+        while(hi - lo > 1)
+        {
+            int mid = (lo + hi)/2;
+            if(index[mid].millis <= target) lo = mid;
+            else hi = mid;
+        }
+        while(lo > 0 && !index[lo].keyframe) lo--;
+        return lo;
+    }
+};
+
+/// Rewrite a legacy gzipped demo, positioned right after its header, into the chunked container.
+static bool convertdemo(stream *in, stream *out, int protocol)
+{
+    writedemoheader(out, protocol);
+    demochunkwriter chunks(out);
+    vector<uchar> data;
+    int stamp[3];
+    while(in->read(stamp, sizeof(stamp))==sizeof(stamp))
+    {
+        lilswap(stamp, 3);
+        if(stamp[2] < 0) return false;
+        data.setsize(0);
+        if(in->read(data.reserve(stamp[2]).buf, stamp[2])!=size_t(stamp[2])) break;
+        data.advance(stamp[2]);
+        chunks.add(stamp[0], stamp[1], data.getbuf(), stamp[2]);
+    }
+    chunks.finish();
+    return chunks.index.length() > 0;
+}
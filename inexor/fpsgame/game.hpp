@@ -29,6 +29,94 @@ enum
 #define DNF 100.0f  /// for normalized vectors
 #define DVELF 1.0f  /// for playerspeed based velocity vectors
 
+/// Position delta compression.
+/// Every POSKEYFRAME'th position update of a player is sent as full N_POS, it becomes the keyframe of that player.
+/// All updates in between are sent as N_POSDELTA: the 16 bit hash of the keyframe they refer to,
+/// a bitmask of the bytes which differ from the keyframe and those bytes.
+/// Deltas for an unknown keyframe (e.g. because it got lost) are dropped until the next keyframe arrives.
+enum { POSKEYFRAME = 8, MAXPOSBYTES = 24 };
+
+struct poskeyframe
+{
+    uchar data[MAXPOSBYTES];
+    int len;
+    ushort hash;
+
+    poskeyframe() { reset(); }
+
+    void reset() { len = 0; hash = 0; }
+
+    static ushort gethash(const uchar *buf, int n)
+    {
+        uint h = 5381 + n;
+        loopi(n) h = ((h<<5) + h) ^ buf[i];
+        return ushort(h ^ (h>>16));
+    }
+
+    /// Store the payload of a full N_POS (everything after the client number) as keyframe.
+    void set(const uchar *buf, int n)
+    {
+        if(n > MAXPOSBYTES) { reset(); return; }
+        memcpy(data, buf, n);
+        len = n;
+        hash = gethash(buf, n);
+    }
+
+    /// Whether the payload can be written as delta against this keyframe.
+    bool compatible(const uchar *buf, int n) const { return len > 0 && n == len; }
+
+    /// Write the N_POSDELTA body for the given payload.
+    template<class T> void putdelta(T &p, const uchar *buf, int n) const
+    {
+        uint mask = 0;
+        loopi(n) if(buf[i] != data[i]) mask |= 1<<i;
+        p.put(hash&0xFF);
+        p.put(hash>>8);
+        putuint(p, mask);
+        loopi(n) if(mask&(1<<i)) p.put(buf[i]);
+    }
+
+    /// Read a N_POSDELTA body and rebuild the full payload into buf.
+    /// @return false if the delta refers to another keyframe, the payload is unusable then.
+    /// A mask with bits beyond MAXPOSBYTES is malformed: we could not tell where the message ends, so the rest of the packet gets dropped.
+    bool getdelta(ucharbuf &p, uchar *buf, int &n) const
+    {
+        int h = p.get(); h |= p.get()<<8;
+        uint mask = getuint(p);
+        if(mask>>MAXPOSBYTES) { p.forceoverread(); return false; }
+        bool valid = len > 0 && h == hash && !(mask>>len);
+        loopi(MAXPOSBYTES) if(mask&(1<<i))
+        {
+            uchar c = p.get();
+            if(valid) buf[i] = c;
+        }
+        if(!valid) return false;
+        loopi(len) if(!(mask&(1<<i))) buf[i] = data[i];
+        n = len;
+        return true;
+    }
+};
+
+/// Write a position payload as full N_POS keyframe or as N_POSDELTA against key.
+/// deltas counts the deltas written since the last keyframe.
+template<class T> static inline void encodeposition(T &q, int cn, const uchar *buf, int n, poskeyframe &key, int &deltas, bool keyframe = false)
+{
+    if(keyframe || ++deltas >= POSKEYFRAME || !key.compatible(buf, n))
+    {
+        putint(q, N_POS);
+        putuint(q, cn);
+        q.put(buf, n);
+        key.set(buf, n);
+        deltas = 0;
+    }
+    else
+    {
+        putint(q, N_POSDELTA);
+        putuint(q, cn);
+        key.putdelta(q, buf, n);
+    }
+}
+
 /// SVARP radardir defines the directory of radar images (arrows, frame, flags, skulls..)
 extern char *radardir;
 
@@ -721,6 +809,8 @@ struct fpsent : dynent, fpsstate
     editinfo *edit;
     float deltayaw, deltapitch, deltaroll, newyaw, newpitch, newroll;
     int smoothmillis;
+    poskeyframe poskey;                 // last full position sent (own player and bots) or received (everyone else)
+    int posdeltas;                      // deltas sent since the last keyframe
 
     string name, tag, team, info;
     int playermodel;
@@ -732,7 +822,7 @@ struct fpsent : dynent, fpsstate
     vec muzzle;
 
     fpsent() : weight(100), clientnum(-1), privilege(PRIV_NONE), lastupdate(0), plag(0), ping(0), lifesequence(0), respawned(-1), suicided(-1), lastpain(0), attacksound(-1), attackchan(-1), idlesound(-1), idlechan(-1),
-                frags(0), flags(0), deaths(0), teamkills(0), totaldamage(0), totalshots(0), edit(NULL), smoothmillis(-1), playermodel(-1), fov(100), ai(NULL), ownernum(-1), muzzle(-1, -1, -1)
+                frags(0), flags(0), deaths(0), teamkills(0), totaldamage(0), totalshots(0), edit(NULL), smoothmillis(-1), posdeltas(0), playermodel(-1), fov(100), ai(NULL), ownernum(-1), muzzle(-1, -1, -1)
     {
         name[0] = team[0] = tag[0] = info[0] = 0;
         respawn();
@@ -10,8 +10,9 @@
 
 #define MAX_POSSIBLE_PORT 65535 /// The max port possible for UDP
 
-#define PROTOCOL_VERSION 303            // bump when protocol changes last sauerbraten protocol was 259
-#define DEMO_VERSION 1                  // bump when demo format changes
+#define PROTOCOL_VERSION 306            // bump when protocol changes last sauerbraten protocol was 259
+#define DEMO_VERSION 2                  // bump when demo format changes
+#define DEMO_VERSION_LEGACY 1           // gzipped record stream, converted when loaded
 #define DEMO_MAGIC "INEXOR_DEMO"
 
 /// server message list
@@ -155,6 +156,9 @@ enum
     N_SERVCMD,              /// S2C      servers could send advanced messages to clients. standard clients do not interpret this custom message
     N_DEMOPACKET,           /// S2C      send a requested demo packet
     N_SPAWNLOC,             /// S2C      BOMBERMAN spawn location?
+    N_POSDELTA,             /// C2S|S2C  send player position and rotation as delta against the last N_POS of that player
+    N_SEEKDEMO,             /// C2S|S2C  jump to a point in time of the demo which is being played back
+    N_SENDMAPCHUNK,         /// S2C      send a part of the coop edit map: crc, total size, offset, data
     NUMMSG
 };
 
@@ -188,6 +192,9 @@ static const int msgsizes[] =
     N_SERVCMD, 0,
     N_DEMOPACKET, 0,
     N_SPAWNLOC, 0,
+    N_POSDELTA, 0,
+    N_SEEKDEMO, 2,
+    N_SENDMAPCHUNK, 0,
     -1
 };
 
@@ -1,6 +1,12 @@
 #include "inexor/fpsgame/game.hpp"
 #include "inexor/util/random.hpp"
 #include "inexor/util/Logging.hpp"
+#include "inexor/util/SpscByteQueue.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 namespace game
 {
@@ -31,7 +37,7 @@ namespace server
     static const int DEATHMILLIS = 300;
 
     struct clientinfo;
-    int gamemode = 0;
+    SERVERLOCAL int gamemode = 0;
 
     struct gameevent
     {
@@ -226,7 +232,49 @@ namespace server
         }
     };
 
-    extern int gamemillis, nextexceeded;
+    extern SERVERLOCAL int gamemillis, nextexceeded;
+
+    /// Ring of the last known positions of a player, used to rewind targets to the time a shot was fired.
+    struct positionhistory
+    {
+        enum { SIZE = 32 };
+
+        vec o[SIZE];
+        int millis[SIZE];
+        int len, head;
+
+        positionhistory() { reset(); }
+
+        void reset() { len = head = 0; }
+
+        void add(int t, const vec &pos)
+        {
+            head = (head + 1) % SIZE;
+            o[head] = pos;
+            millis[head] = t;
+            if(len < SIZE) len++;
+        }
+
+        /// Position at time t, interpolated between the neighbouring samples and clamped to the recorded time span.
+        bool at(int t, vec &pos) const
+        {
+            if(!len) return false;
+            int next = head;
+            loopi(len)
+            {
+                int cur = (head - i + SIZE) % SIZE;
+                if(millis[cur] <= t)
+                {
+                    if(cur == next || millis[next] <= millis[cur]) pos = o[cur];
+                    else pos = vec(o[cur]).lerp(o[next], float(t - millis[cur])/(millis[next] - millis[cur]));
+                    return true;
+                }
+                next = cur;
+            }
+            pos = o[next];
+            return true;
+        }
+    };
 
     struct clientinfo
     {
@@ -241,6 +289,11 @@ namespace server
         gamestate state;
         vector<gameevent *> events;
         vector<uchar> position, messages;
+        poskeyframe poskey;
+        bool positionkeyframe;
+        positionhistory history;
+        /// Hits which failed the hit validation, see maxunverifiedhits.
+        int unverifiedhits;
         uchar *wsdata;
         int wslen;
         vector<clientinfo *> bots;
@@ -248,8 +301,8 @@ namespace server
         string clientmap;
         int mapcrc;
         bool warned, gameclip;
-        ENetPacket *getdemo, *getmap, *clipboard;
-        int lastclipboard, needclipboard;
+        ENetPacket *getdemo, *clipboard;
+        int getmap, lastclipboard, needclipboard;
         int connectauth;
         uint authreq;
         string authname, authdesc;
@@ -257,7 +310,7 @@ namespace server
         int authkickvictim;
         char *authkickreason;
 
-        clientinfo() : getdemo(NULL), getmap(NULL), clipboard(NULL), authchallenge(NULL), authkickreason(NULL) { reset(); }
+        clientinfo() : getdemo(NULL), clipboard(NULL), authchallenge(NULL), authkickreason(NULL) { reset(); }
         ~clientinfo() { events.deletecontents(); cleanclipboard(); cleanauth(); }
 
         void addevent(gameevent *e)
@@ -273,8 +326,8 @@ namespace server
 
         int calcpushrange()
         {
-            ENetPeer *peer = getclientpeer(ownernum);
-            return PUSHMILLIS + (peer ? peer->roundTripTime + peer->roundTripTimeVariance : ENET_PEER_DEFAULT_ROUND_TRIP_TIME);
+            int roundtrip = getclientroundtrip(ownernum);
+            return PUSHMILLIS + (roundtrip >= 0 ? roundtrip : ENET_PEER_DEFAULT_ROUND_TRIP_TIME);
         }
 
         bool checkpushed(int millis, int range)
@@ -317,6 +370,8 @@ namespace server
             lastevent = 0;
             exceeded = 0;
             pushed = 0;
+            history.reset();
+            unverifiedhits = 0;
             clientmap[0] = '\0';
             mapcrc = 0;
             warned = false;
@@ -360,8 +415,11 @@ namespace server
             connectauth = 0;
             position.setsize(0);
             messages.setsize(0);
+            poskey.reset();
+            positionkeyframe = false;
             ping = 0;
             aireinit = 0;
+            getmap = -1;
             needclipboard = 0;
             cleanclipboard();
             cleanauth();
@@ -406,18 +464,67 @@ namespace server
     #define MM_PUBSERV ((1<<MM_OPEN) | (1<<MM_VETO))
     #define MM_COOPSERV (MM_AUTOAPPROVE | MM_PUBSERV | (1<<MM_LOCKED))
 
-    bool notgotitems = true;        // true when map has changed and waiting for clients to send item
-    int gamemillis = 0, gamelimit = 0, nextexceeded = 0, gamespeed = 100;
-    bool gamepaused = false, teamspersisted = false, shouldstep = true;
+    SERVERLOCAL bool notgotitems = true;        // true when map has changed and waiting for clients to send item
+    SERVERLOCAL int gamemillis = 0, gamelimit = 0, nextexceeded = 0, gamespeed = 100;
+    SERVERLOCAL bool gamepaused = false, teamspersisted = false, shouldstep = true;
+
+    SERVERLOCAL string smapname = "";
+    SERVERLOCAL int interm = 0;
+    SERVERLOCAL enet_uint32 lastsend = 0;
+    SERVERLOCAL int mastermode = MM_OPEN;
+    /// Set by publicserver for all game instances.
+    int mastermask = MM_PRIVSERV;
+
+    VAR(mapsendrate, 16, 256, 65536);
 
-    string smapname = "";
-    int interm = 0;
-    enet_uint32 lastsend = 0;
-    int mastermode = MM_OPEN, mastermask = MM_PRIVSERV;
-    stream *mapdata = NULL;
+    /// The map uploaded in coop edit, split into chunk packets once per content (keyed by its crc).
+    /// The packets are shared by refcount between all clients downloading the map.
+    SERVERLOCAL struct mapcache
+    {
+        enum { CHUNKSIZE = 32*1024 };
+
+        uint crc;
+        int len;
+        vector<ENetPacket *> chunks;
+
+        mapcache() : crc(0), len(0) {}
+        ~mapcache() { clear(); }
+
+        void clear()
+        {
+            loopv(chunks) if(!--chunks[i]->referenceCount) enet_packet_destroy(chunks[i]);
+            chunks.setsize(0);
+            crc = 0;
+            len = 0;
+        }
+
+        /// @return false if this exact map is already cached
+        bool build(const uchar *data, int size)
+        {
+            uint newcrc = crc32(0, data, size);
+            if(chunks.length() && newcrc==crc && size==len) return false;
+            clear();
+            crc = newcrc;
+            len = size;
+            for(int offset = 0; offset < size; offset += CHUNKSIZE)
+            {
+                int n = min(size - offset, int(CHUNKSIZE));
+                packetbuf p(MAXTRANS + n, ENET_PACKET_FLAG_RELIABLE);
+                putint(p, N_SENDMAPCHUNK);
+                putint(p, int(crc));
+                putint(p, size);
+                putint(p, offset);
+                p.put(data + offset, n);
+                ENetPacket *packet = p.finalize();
+                packet->referenceCount++;
+                chunks.add(packet);
+            }
+            return true;
+        }
+    } mapdata;
 
-    vector<uint> allowedips;
-    vector<ban> bannedips;
+    SERVERLOCAL vector<uint> allowedips;
+    SERVERLOCAL vector<ban> bannedips;
 
     void addban(uint ip, int expire)
     {
@@ -430,7 +537,7 @@ namespace server
         bannedips.add(b);
     }
 
-    vector<clientinfo *> connects, clients, bots;
+    SERVERLOCAL vector<clientinfo *> connects, clients, bots;
 
     void kickclients(uint ip, clientinfo *actor = NULL, int priv = PRIV_NONE)
     {
@@ -468,9 +575,10 @@ namespace server
             return rot.modes == modes ? rot.map[0] && !map[0] : (rot.modes & modes) == rot.modes;
         }
     };
+    // the rotation is configured once for all game instances, each of them goes through it on its own
     int maprotation::exclude = 0;
     vector<maprotation> maprotations;
-    int curmaprotation = 0;
+    SERVERLOCAL int curmaprotation = 0;
 
     VAR(lockmaprotation, 0, 0, 2);
 
@@ -612,22 +720,127 @@ namespace server
     COMMAND(maprotationreset, "");
     COMMANDN(maprotation, addmaprotations, "ss2V");
 
+    /// A finished demo, kept in its (compressed) temporary file instead of in memory.
     struct demofile
     {
         string info;
-        uchar *data;
+        stream *file;
         int len;
+        /// The download packet while any client still has it queued, shared by all of them.
+        ENetPacket *packet;
     };
 
-    vector<demofile> demos;
+    SERVERLOCAL vector<demofile> demos;
+
+    #include "inexor/fpsgame/demo.hpp"
+
+    /// Compresses and writes the recorded packets on a background thread.
+    /// The game thread only copies the raw records into a lock-free ring buffer.
+    struct demowriter
+    {
+        enum { QUEUESIZE = 1<<20 };
+
+        inexor::util::SpscByteQueue queue;
+        demochunkwriter chunks;
+        std::atomic<bool> finished;
+        std::atomic<stream::offset> written;
+        /// The writer thread sleeps on this while the queue is empty.
+        std::mutex lock;
+        std::condition_variable wake;
+        std::thread thread;
+
+        demowriter(stream *out) : queue(QUEUESIZE), chunks(out), finished(false), written(0)
+        {
+            thread = std::thread([this] { run(); });
+        }
+
+        /// Flushes everything which is still queued, writes the index and stops the thread.
+        ~demowriter()
+        {
+            {
+                std::lock_guard<std::mutex> l(lock);
+                finished = true;
+            }
+            wake.notify_one();
+            thread.join();
+        }
+
+        void run()
+        {
+            vector<uchar> data;
+            int stamp[3];
+            while(read(stamp, sizeof(stamp)))
+            {
+                data.setsize(0);
+                if(!read(data.reserve(stamp[2]).buf, stamp[2])) break;
+                data.advance(stamp[2]);
+                chunks.add(stamp[0], stamp[1], data.getbuf(), stamp[2]);
+                written = chunks.out->tell();
+            }
+            chunks.finish();
+        }
+
+        /// Blocking read for the writer thread, false once recording finished and everything was read.
+        bool read(void *data, size_t len)
+        {
+            uchar *dst = (uchar *)data;
+            while(len)
+            {
+                size_t n = queue.read(dst, len);
+                if(n)
+                {
+                    dst += n;
+                    len -= n;
+                }
+                else
+                {
+                    std::unique_lock<std::mutex> l(lock);
+                    wake.wait(l, [this] { return !queue.empty() || finished; });
+                    if(finished && queue.empty()) return false;
+                }
+            }
+            return true;
+        }
+
+        /// Only blocks if the writer thread can not keep up with a full queue.
+        void write(const void *data, size_t len)
+        {
+            const uchar *src = (const uchar *)data;
+            while(len)
+            {
+                size_t n = queue.write(src, len);
+                if(!n)
+                {
+                    wake.notify_one();
+                    std::this_thread::yield();
+                    continue;
+                }
+                src += n;
+                len -= n;
+            }
+        }
+
+        void write(int millis, int chan, const void *data, int len)
+        {
+            int stamp[3] = { millis, chan, len };
+            write(stamp, sizeof(stamp));
+            write(data, len);
+            // taking the lock makes sure the writer thread is either waiting or will see the record
+            { std::lock_guard<std::mutex> l(lock); }
+            wake.notify_one();
+        }
+    };
 
-    bool demonextmatch = false;
-    stream *demotmp = NULL, *demorecord = NULL, *demoplayback = NULL;
-    int nextplayback = 0, demomillis = 0;
+    SERVERLOCAL bool demonextmatch = false;
+    SERVERLOCAL stream *demotmp = NULL;
+    SERVERLOCAL demowriter *demorecord = NULL;
+    SERVERLOCAL demoreader *demoplayback = NULL;
+    SERVERLOCAL int nextplayback = 0, demomillis = 0, lastdemokeyframe = 0;
 
     VAR(maxdemos, 0, 5, 25);
     VAR(maxdemosize, 0, 16, 31);
     VAR(restrictdemos, 0, 1, 1);
+    VAR(demokeyframes, 0, 30, 600);
 
     VAR(restrictpausegame, 0, 0, 1);
     VAR(restrictgamespeed, 0, 1, 1);
@@ -687,8 +900,8 @@ namespace server
         uint ip;
         int teamkills;
     };
-    vector<teamkillinfo> teamkills;
-    bool shouldcheckteamkills = false;
+    SERVERLOCAL vector<teamkillinfo> teamkills;
+    SERVERLOCAL bool shouldcheckteamkills = false;
 
     void addteamkill(clientinfo *actor, clientinfo *victim, int n)
     {
@@ -733,14 +946,16 @@ namespace server
         return bots.inrange(n) ? bots[n] : NULL;
     }
 
-    uint mcrc = 0;
-    vector<entity> ments;
-    vector<server_entity> sents;
-    vector<savedscore> scores;
+    SERVERLOCAL uint mcrc = 0;
+    SERVERLOCAL vector<entity> ments;
+    /// The current map as loaded from its file, the geometry is only the shapes: see loaditems().
+    SERVERLOCAL std::shared_ptr<const sharedmap> mapfile;
+    SERVERLOCAL vector<server_entity> sents;
+    SERVERLOCAL vector<savedscore> scores;
 
     int msgsizelookup(int msg)
     {
-        static int sizetable[NUMMSG] = { -1 };
+        static SERVERLOCAL int sizetable[NUMMSG] = { -1 };
         if(sizetable[0] < 0)
         {
             memset(sizetable, -1, sizeof(sizetable));
@@ -782,6 +997,7 @@ namespace server
     {
         mcrc = 0;
         ments.setsize(0);
+        mapfile.reset();
         sents.setsize(0);
         //cps.reset();
     }
@@ -826,8 +1042,8 @@ namespace server
     {
         if(!name) name = ci->name;
         if(name[0] && !duplicatename(ci, name) && ci->state.aitype == AI_NONE) return name;
-        static string cname[3];
-        static int cidx = 0;
+        static SERVERLOCAL string cname[3];
+        static SERVERLOCAL int cidx = 0;
         cidx = (cidx+1)%3;
         formatstring(cname[cidx], ci->state.aitype == AI_NONE ? "%s %s(%d)%s" : "%s %s[%d]%s", name, COL_MAGENTA, ci->clientnum, COL_WHITE);
         return cname[cidx];
@@ -873,13 +1089,13 @@ namespace server
     #include "inexor/fpsgame/bomb.hpp"
     #include "inexor/fpsgame/hideandseek.hpp"
 
-    captureservmode capturemode;
-    ctfservmode ctfmode;
-    collectservmode collectmode;
-    bombservmode bombmode;
-    hideandseekservmode hideandseekmode;
+    SERVERLOCAL captureservmode capturemode;
+    SERVERLOCAL ctfservmode ctfmode;
+    SERVERLOCAL collectservmode collectmode;
+    SERVERLOCAL bombservmode bombmode;
+    SERVERLOCAL hideandseekservmode hideandseekmode;
 
-    servmode *smode = NULL;
+    SERVERLOCAL servmode *smode = NULL;
 
     bool canspawnitem(int type) {
     	if(m_bomb) return (type>=I_BOMBS && type<=I_BOMBDELAY);
@@ -939,7 +1155,7 @@ namespace server
         return true;
     }
 
-    static hashset<teaminfo> teaminfos;
+    static SERVERLOCAL hashset<teaminfo> teaminfos;
 
     void clearteaminfo()
     {
@@ -1066,25 +1282,25 @@ namespace server
     {
         int n = clamp(demos.length() + extra - maxdemos, 0, demos.length());
         if(n <= 0) return;
-        loopi(n) delete[] demos[i].data;
+        loopi(n) delete demos[i].file;
         demos.remove(0, n);
     }
  
     void adddemo()
     {
         if(!demotmp) return;
-        int len = (int)min(demotmp->size(), stream::offset((maxdemosize<<20) + 0x10000));
+        // maxdemosize only decides when the recording stops, the index trailer comes after that: always keep the whole file
+        int len = (int)demotmp->size();
         demofile &d = demos.add();
         time_t t = time(NULL);
         char *timestr = ctime(&t), *trim = timestr + strlen(timestr);
         while(trim>timestr && iscubespace(*--trim)) *trim = '\0';
         formatstring(d.info, "%s: %s, %s, %.2f%s", timestr, modename(gamemode), smapname, len > 1024*1024 ? len/(1024*1024.f) : len/1024.0f, len > 1024*1024 ? "MB" : "kB");
         sendservmsgf("demo \"%s\" recorded", d.info);
-        d.data = new uchar[len];
+        d.file = demotmp;
         d.len = len;
-        demotmp->seek(0, SEEK_SET);
-        demotmp->read(d.data, len);
-        DELETEP(demotmp);
+        d.packet = NULL;
+        demotmp = NULL;
     }
         
     void enddemorecord()
@@ -1100,14 +1316,25 @@ namespace server
         adddemo();
     }
 
+    int welcomepacket(packetbuf &p, clientinfo *ci, bool mapchange = true);
+
+    /// Store the complete game state so playback can seek to this point.
+    /// Spectators already have the map loaded then, so the keyframe leaves out the map change.
+    void writedemokeyframe()
+    {
+        lastdemokeyframe = gamemillis;
+        packetbuf p(MAXTRANS, ENET_PACKET_FLAG_RELIABLE);
+        welcomepacket(p, NULL, false);
+        demorecord->write(gamemillis, DEMO_KEYFRAME, p.buf, p.len);
+    }
+
     void writedemo(int chan, void *data, int len)
     {
         if(!demorecord) return;
-        int stamp[3] = { gamemillis, chan, len };
-        lilswap(stamp, 3);
-        demorecord->write(stamp, sizeof(stamp));
-        demorecord->write(data, len);
-        if(demorecord->rawtell() >= (maxdemosize<<20)) enddemorecord();
+        inexor::util::ScopedPhaseTimer timer(tickprofiler, TICK_DEMO);
+        if(demokeyframes && gamemillis - lastdemokeyframe >= demokeyframes*1000) writedemokeyframe();
+        demorecord->write(gamemillis, chan, data, len);
+        if(demorecord->written >= (maxdemosize<<20)) enddemorecord();
     }
 
     void recordpacket(int chan, void *data, int len)
@@ -1115,29 +1342,20 @@ namespace server
         writedemo(chan, data, len);
     }
 
-    int welcomepacket(packetbuf &p, clientinfo *ci);
     void sendwelcome(clientinfo *ci);
 
     void setupdemorecord()
     {
         if(!m_mp(gamemode) || m_edit) return;
 
-        demotmp = opentempfile("demorecord", "w+b");
+        demotmp = opentempfile(tempformatstring("demorecord%d", getserverinstance()), "w+b");
         if(!demotmp) return;
 
-        stream *f = opengzfile(NULL, "wb", demotmp);
-        if(!f) { DELETEP(demotmp); return; }
-
         sendservmsg("recording demo");
 
-        demorecord = f;
-
-        demoheader hdr;
-        memcpy(hdr.magic, DEMO_MAGIC, sizeof(hdr.magic));
-        hdr.version = DEMO_VERSION;
-        hdr.protocol = PROTOCOL_VERSION;
-        lilswap(&hdr.version, 2);
-        demorecord->write(&hdr, sizeof(demoheader));
+        writedemoheader(demotmp);
+        demorecord = new demowriter(demotmp);
+        lastdemokeyframe = gamemillis;
 
         packetbuf p(MAXTRANS, ENET_PACKET_FLAG_RELIABLE);
         welcomepacket(p, NULL);
@@ -1157,27 +1375,18 @@ namespace server
     {
         if(!n)
         {
-            loopv(demos) delete[] demos[i].data;
+            loopv(demos) delete demos[i].file;
             demos.shrink(0);
             sendservmsg("cleared all demos");
         }
         else if(demos.inrange(n-1))
         {
-            delete[] demos[n-1].data;
+            delete demos[n-1].file;
             demos.remove(n-1);
             sendservmsgf("cleared demo %d", n);
         }
     }
 
-    static void freegetmap(ENetPacket *packet)
-    {
-        loopv(clients)
-        {
-            clientinfo *ci = clients[i];
-            if(ci->getmap == packet) ci->getmap = NULL;
-        }
-    }
-
     static void freegetdemo(ENetPacket *packet)
     {
         loopv(clients)
@@ -1185,6 +1394,7 @@ namespace server
             clientinfo *ci = clients[i];
             if(ci->getdemo == packet) ci->getdemo = NULL;
         }
+        loopv(demos) if(demos[i].packet == packet) demos[i].packet = NULL;
     }
 
     void senddemo(clientinfo *ci, int num)
@@ -1193,8 +1403,22 @@ namespace server
         if(!num) num = demos.length();
         if(!demos.inrange(num-1)) return;
         demofile &d = demos[num-1];
-        if((ci->getdemo = sendf(ci->clientnum, 2, "rim", N_SENDDEMO, d.len, d.data)))
-            ci->getdemo->freeCallback = freegetdemo;
+        // everyone downloading the demo at the same time gets the same packet, ENet counts the references
+        if(!d.packet)
+        {
+            packetbuf p(MAXTRANS + d.len, ENET_PACKET_FLAG_RELIABLE);
+            putint(p, N_SENDDEMO);
+            putint(p, d.len);
+            d.file->seek(0, SEEK_SET);
+            d.file->read(p.subbuf(d.len).buf, d.len);
+            ENetPacket *packet = p.finalize();
+            sendpacket(ci->clientnum, 2, packet);
+            if(!packet->referenceCount) return; // nobody queued it, p frees it
+            packet->freeCallback = freegetdemo;
+            d.packet = packet;
+        }
+        else sendpacket(ci->clientnum, 2, d.packet);
+        ci->getdemo = d.packet;
     }
 
     void enddemoplayback()
@@ -1209,26 +1433,48 @@ namespace server
         loopv(clients) sendwelcome(clients[i]);
     }
 
+    /// Open a chunked demo for reading, converting a legacy one on the fly.
+    /// Demos of other protocol versions are refused unless anyprotocol is set.
+    demoreader *opendemo(const char *file, string &msg, bool anyprotocol = false)
+    {
+        demoheader hdr;
+        stream *f = openrawfile(file, "rb");
+        if(!f) { formatstring(msg, "could not read demo \"%s\"", file); return NULL; }
+        if(!readdemoheader(f, hdr) || hdr.version!=DEMO_VERSION)
+        {
+            DELETEP(f);
+            stream *gz = opengzfile(file, "rb");
+            if(gz && readdemoheader(gz, hdr) && hdr.version==DEMO_VERSION_LEGACY)
+            {
+                f = opentempfile(tempformatstring("demoplayback%d", getserverinstance()), "w+b");
+                if(f && !convertdemo(gz, f, hdr.protocol)) DELETEP(f);
+            }
+            DELETEP(gz);
+            if(!f) { formatstring(msg, "\"%s\" is not a demo file", file); return NULL; }
+        }
+        if(hdr.protocol!=PROTOCOL_VERSION && !anyprotocol)
+        {
+            formatstring(msg, "demo \"%s\" requires an %s version of Inexor", file, hdr.protocol<PROTOCOL_VERSION ? "older" : "newer");
+            DELETEP(f);
+            return NULL;
+        }
+        demoreader *demo = new demoreader(f);
+        if(!demo->open())
+        {
+            formatstring(msg, "demo \"%s\" is empty or damaged", file);
+            DELETEP(demo);
+        }
+        return demo;
+    }
+
     void setupdemoplayback()
     {
         if(demoplayback) return;
-        demoheader hdr;
         string msg;
-        msg[0] = '\0';
         defformatstring(file, "%s.dmo", smapname);
-        demoplayback = opengzfile(file, "rb");
-        if(!demoplayback) formatstring(msg, "could not read demo \"%s\"", file);
-        else if(demoplayback->read(&hdr, sizeof(demoheader))!=sizeof(demoheader) || memcmp(hdr.magic, DEMO_MAGIC, sizeof(hdr.magic)))
-            formatstring(msg, "\"%s\" is not a demo file", file);
-        else
+        demoplayback = opendemo(file, msg);
+        if(!demoplayback)
         {
-            lilswap(&hdr.version, 2);
-            if(hdr.version!=DEMO_VERSION) formatstring(msg, "demo \"%s\" requires an %s version of Inexor", file, hdr.version<DEMO_VERSION ? "older" : "newer");
-            else if(hdr.protocol!=PROTOCOL_VERSION) formatstring(msg, "demo \"%s\" requires an %s version of Inexor", file, hdr.protocol<PROTOCOL_VERSION ? "older" : "newer");
-        }
-        if(msg[0])
-        {
-            DELETEP(demoplayback);
             sendservmsg(msg);
             return;
         }
@@ -1238,48 +1484,88 @@ namespace server
         demomillis = 0;
         sendf(-1, 1, "ri3", N_DEMOPLAYBACK, 1, -1);
 
-        if(demoplayback->read(&nextplayback, sizeof(nextplayback))!=sizeof(nextplayback))
+        if(!demoplayback->next())
         {
             enddemoplayback();
             return;
         }
-        lilswap(&nextplayback, 1);
+        nextplayback = demoplayback->millis;
     }
 
-    void readdemo()
+    /// Send all records up to demomillis, keyframes are only played when seeking.
+    void playdemo(bool keyframes = false)
     {
-        if(!demoplayback) return;
-        demomillis += curtime;
-        while(demomillis>=nextplayback)
+        while(demoplayback && demomillis>=nextplayback)
         {
-            int chan, len;
-            if(demoplayback->read(&chan, sizeof(chan))!=sizeof(chan) ||
-               demoplayback->read(&len, sizeof(len))!=sizeof(len))
+            if(demoplayback->chan!=DEMO_KEYFRAME || keyframes)
             {
-                enddemoplayback();
-                return;
-            }
-            lilswap(&chan, 1);
-            lilswap(&len, 1);
-            ENetPacket *packet = enet_packet_create(NULL, len+1, 0);
-            if(!packet || demoplayback->read(packet->data+1, len)!=size_t(len))
-            {
-                if(packet) enet_packet_destroy(packet);
-                enddemoplayback();
-                return;
+                int chan = demoplayback->chan==DEMO_KEYFRAME ? 1 : demoplayback->chan, len = demoplayback->len;
+                ENetPacket *packet = enet_packet_create(NULL, len+1, 0);
+                if(!packet)
+                {
+                    enddemoplayback();
+                    return;
+                }
+                packet->data[0] = N_DEMOPACKET;
+                memcpy(packet->data+1, demoplayback->buf, len);
+                sendpacket(-1, chan, packet);
+                if(!packet->referenceCount) enet_packet_destroy(packet);
+                keyframes = false;
             }
-            packet->data[0] = N_DEMOPACKET;
-            sendpacket(-1, chan, packet);
-            if(!packet->referenceCount) enet_packet_destroy(packet);
             if(!demoplayback) break;
-            if(demoplayback->read(&nextplayback, sizeof(nextplayback))!=sizeof(nextplayback))
+            if(!demoplayback->next())
             {
                 enddemoplayback();
                 return;
             }
-            lilswap(&nextplayback, 1);
+            nextplayback = demoplayback->millis;
+        }
+    }
+
+    void readdemo()
+    {
+        if(!demoplayback) return;
+        demomillis += curtime;
+        playdemo();
+    }
+
+    /// Jump to the given demo time: restart at the closest keyframe and fast forward from there.
+    void seekdemo(int millis)
+    {
+        if(!demoplayback) return;
+        int chunk = demoplayback->findkeyframe(millis);
+        if(!demoplayback->loadchunk(chunk) || !demoplayback->next())
+        {
+            enddemoplayback();
+            return;
+        }
+        nextplayback = demoplayback->millis;
+        demomillis = max(millis, nextplayback);
+
+        // spectators forget the demo's clients so the keyframe can rebuild them
+        sendf(-1, 1, "ri2", N_SEEKDEMO, demomillis);
+        playdemo(true);
+    }
+
+    /// Convert a legacy gzipped demo into the chunked format.
+    void convertdemofile(const char *src, const char *dst)
+    {
+        demoheader hdr;
+        stream *in = opengzfile(path(src, true), "rb");
+        if(!in || !readdemoheader(in, hdr) || hdr.version!=DEMO_VERSION_LEGACY)
+        {
+            spdlog::get("global")->error("\"{}\" is not a legacy demo file", src);
+            DELETEP(in);
+            return;
         }
+        stream *out = openrawfile(path(dst, true), "wb");
+        if(!out) spdlog::get("global")->error("could not write \"{}\"", dst);
+        else if(!convertdemo(in, out, hdr.protocol)) spdlog::get("global")->error("\"{}\" contains no demo records", src);
+        else spdlog::get("global")->info("converted demo \"{}\" to \"{}\"", src, dst);
+        DELETEP(out);
+        DELETEP(in);
     }
+    COMMANDN(convertdemo, convertdemofile, "ss");
 
     void stopdemo()
     {
@@ -1526,7 +1812,7 @@ namespace server
                 {
                     oi->state.timeplayed += lastmillis - oi->state.lasttimeplayed;
                     oi->state.lasttimeplayed = lastmillis;
-                    static savedscore curscore;
+                    static SERVERLOCAL savedscore curscore;
                     curscore.save(oi->state);
                     return &curscore;
                 }
@@ -1571,10 +1857,10 @@ namespace server
         }
 
         uchar operator[](int msg) const { return msg >= 0 && msg < NUMMSG ? msgmask[msg] : 0; }
-    } msgfilter(-1, N_CONNECT, N_SERVINFO, N_INITCLIENT, N_WELCOME, N_MAPCHANGE, N_SERVMSG, N_DAMAGE, N_HITPUSH, N_SHOTFX, N_EXPLODEFX, N_DIED, N_SPAWNSTATE, N_FORCEDEATH, N_TEAMINFO, N_ITEMACC, N_ITEMSPAWN, N_TIMEUP, N_CDIS, N_CURRENTMASTER, N_PONG, N_RESUME, N_BASESCORE, N_BASEINFO, N_BASEREGEN, N_ANNOUNCE, N_SENDDEMOLIST, N_SENDDEMO, N_DEMOPLAYBACK, N_SENDMAP, N_DROPFLAG, N_SCOREFLAG, N_RETURNFLAG, N_RESETFLAG, N_INVISFLAG, N_CLIENT, N_AUTHCHAL, N_INITAI, N_EXPIRETOKENS, N_DROPTOKENS, N_STEALTOKENS, N_DEMOPACKET,
+    } msgfilter(-1, N_CONNECT, N_SERVINFO, N_INITCLIENT, N_WELCOME, N_MAPCHANGE, N_SERVMSG, N_DAMAGE, N_HITPUSH, N_SHOTFX, N_EXPLODEFX, N_DIED, N_SPAWNSTATE, N_FORCEDEATH, N_TEAMINFO, N_ITEMACC, N_ITEMSPAWN, N_TIMEUP, N_CDIS, N_CURRENTMASTER, N_PONG, N_RESUME, N_BASESCORE, N_BASEINFO, N_BASEREGEN, N_ANNOUNCE, N_SENDDEMOLIST, N_SENDDEMO, N_DEMOPLAYBACK, N_SENDMAP, N_SENDMAPCHUNK, N_DROPFLAG, N_SCOREFLAG, N_RETURNFLAG, N_RESETFLAG, N_INVISFLAG, N_CLIENT, N_AUTHCHAL, N_INITAI, N_EXPIRETOKENS, N_DROPTOKENS, N_STEALTOKENS, N_DEMOPACKET,
                 -2, N_REMIP, N_NEWMAP, N_GETMAP, N_SENDMAP, N_CLIPBOARD,
                 -3, N_EDITENT, N_EDITF, N_EDITT, N_EDITM, N_FLIP, N_COPY, N_PASTE, N_ROTATE, N_REPLACE, N_DELCUBE, N_EDITVAR, N_EDITVSLOT, N_UNDO, N_REDO,
-                -4, N_POS, NUMMSG),
+                -4, N_POS, N_POSDELTA, NUMMSG),
       connectfilter(-1, N_CONNECT, -2, N_AUTHANS, -3, N_PING, NUMMSG);
 
     int checktype(int type, clientinfo *ci)
@@ -1609,34 +1895,74 @@ namespace server
         return type;
     }
 
+    /// Worldstates are allocated from a pool of fixed size pages, which are recycled once all packets referencing them got freed.
+    /// Worldstates bigger than a page are allocated on demand and freed again afterwards.
     struct worldstate
     {
+        enum { PAGESIZE = 64*1024 };
+
         int uses, len;
         uchar *data;
+        worldstate *next;
 
-        worldstate() : uses(0), len(0), data(NULL) {}
+        worldstate(int n) : uses(0), len(n), data(new uchar[n]), next(NULL) {}
+        ~worldstate() { DELETEA(data); }
 
-        void setup(int n) { len = n; data = new uchar[n]; }
-        void cleanup() { DELETEA(data); len = 0; }
-        bool contains(const uchar *p) const { return p >= data && p < &data[len]; }
+        bool pooled() const { return len == PAGESIZE; }
     };
-    vector<worldstate> worldstates;
-    bool reliablemessages = false;
+    SERVERLOCAL worldstate *freeworldstates = NULL;
+    SERVERLOCAL int worldstatehits = 0, worldstatemisses = 0;
+    SERVERLOCAL bool reliablemessages = false;
 
-    void cleanworldstate(ENetPacket *packet)
+    static worldstate *newworldstate(int n)
     {
-        loopv(worldstates)
+        if(n <= worldstate::PAGESIZE)
         {
-            worldstate &ws = worldstates[i];
-            if(!ws.contains(packet->data)) continue;
-            ws.uses--;
-            if(ws.uses <= 0)
+            if(freeworldstates)
             {
-                ws.cleanup();
-                worldstates.removeunordered(i);
+                worldstate *ws = freeworldstates;
+                freeworldstates = ws->next;
+                ws->next = NULL;
+                worldstatehits++;
+                return ws;
             }
-            break;
+            n = worldstate::PAGESIZE;
+        }
+        worldstatemisses++;
+        return new worldstate(n);
+    }
+
+    static void freeworldstate(worldstate *ws)
+    {
+        ws->uses = 0;
+        if(!ws->pooled()) { delete ws; return; }
+        ws->next = freeworldstates;
+        freeworldstates = ws;
+    }
+
+    void getworldstatestats(int &hits, int &misses)
+    {
+        hits = worldstatehits;
+        misses = worldstatemisses;
+        worldstatehits = worldstatemisses = 0;
+    }
+
+    void cleanworldstate(ENetPacket *packet)
+    {
+        worldstate *ws = (worldstate *)packet->userData;
+        if(ws && --ws->uses <= 0) freeworldstate(ws);
+    }
+
+    /// Make the worldstate own the packet, so cleanworldstate() can release it in constant time.
+    static inline void attachworldstate(worldstate &ws, ENetPacket *packet)
+    {
+        if(packet->referenceCount)
+        {
+            ws.uses++;
+            packet->userData = &ws;
+            packet->freeCallback = cleanworldstate;
         }
+        else enet_packet_destroy(packet);
     }
 
     void flushclientposition(clientinfo &ci)
@@ -1664,8 +1990,7 @@ namespace server
             if(size <= 0) continue;
             ENetPacket *packet = enet_packet_create(data, size, ENET_PACKET_FLAG_NO_ALLOCATE);
             sendpacket(ci.clientnum, 0, packet);
-            if(packet->referenceCount) { ws.uses++; packet->freeCallback = cleanworldstate; }
-            else enet_packet_destroy(packet);
+            attachworldstate(ws, packet);
         }
         wsbuf.offset(wsbuf.length());
     }
@@ -1682,6 +2007,124 @@ namespace server
         else ci.wslen += len;
     }
 
+    /// Interest management: instead of relaying every position to every peer, positions of
+    /// players that are far away from a recipient are only forwarded every interestdecimate'th tick.
+    /// Teammates, spectators and edit mode always get the full update rate.
+    VAR(interestmode, 0, 0, 1);
+    VAR(interestradius, 0, 1024, 0x10000);
+    VAR(interestdecimate, 1, 4, 64);
+
+    struct interestgroup
+    {
+        vector<clientinfo *> senders, recipients;
+        int len;
+
+        void reset() { senders.setsize(0); recipients.setsize(0); len = 0; }
+
+        bool matches(const vector<clientinfo *> &s) const
+        {
+            return senders.length() == s.length() && !memcmp(senders.getbuf(), s.getbuf(), s.length()*sizeof(clientinfo *));
+        }
+    };
+    SERVERLOCAL vector<interestgroup> interestgroups;
+    SERVERLOCAL int numinterestgroups = 0, interesttick = 0;
+
+    /// Whether recipient ci should receive the position of bi in the current tick.
+    static bool isinterested(clientinfo &ci, clientinfo &bi)
+    {
+        if(bi.ownernum == ci.clientnum) return false;
+        if(bi.positionkeyframe || m_edit || ci.state.state == CS_SPECTATOR || bi.state.state != CS_ALIVE) return true;
+        if(m_teammode && isteam(ci.team, bi.team)) return true;
+        if(!interestradius || ci.state.o.squaredist(bi.state.o) <= float(interestradius)*interestradius) return true;
+        return (interesttick + bi.clientnum) % interestdecimate == 0;
+    }
+
+    /// Group all recipients which get exactly the same set of positions this tick, so every group needs only one shared packet.
+    /// @return the number of bytes needed to hold the positions of all groups.
+    static int buildinterestgroups()
+    {
+        static SERVERLOCAL vector<clientinfo *> senders;
+        numinterestgroups = 0;
+        interesttick++;
+        int total = 0;
+        loopv(clients)
+        {
+            clientinfo &ci = *clients[i];
+            if(ci.state.aitype != AI_NONE) continue;
+            senders.setsize(0);
+            loopvj(clients)
+            {
+                clientinfo &oi = *clients[j];
+                if(oi.state.aitype != AI_NONE) continue;
+                if(!oi.position.empty() && isinterested(ci, oi)) senders.add(&oi);
+                loopvk(oi.bots) if(!oi.bots[k]->position.empty() && isinterested(ci, *oi.bots[k])) senders.add(oi.bots[k]);
+            }
+            if(senders.empty()) continue;
+            interestgroup *g = NULL;
+            loopj(numinterestgroups) if(interestgroups[j].matches(senders)) { g = &interestgroups[j]; break; }
+            if(!g)
+            {
+                g = numinterestgroups < interestgroups.length() ? &interestgroups[numinterestgroups] : &interestgroups.add();
+                numinterestgroups++;
+                g->reset();
+                g->senders.put(senders.getbuf(), senders.length());
+                loopvj(senders) g->len += senders[j]->position.length();
+                total += g->len;
+            }
+            g->recipients.add(&ci);
+        }
+        return total;
+    }
+
+    static void sendinterestpacket(worldstate &ws, ucharbuf &wsbuf, interestgroup &g)
+    {
+        if(wsbuf.empty()) return;
+        ENetPacket *packet = enet_packet_create(wsbuf.buf, wsbuf.length(), ENET_PACKET_FLAG_NO_ALLOCATE);
+        loopv(g.recipients) sendpacket(g.recipients[i]->clientnum, 0, packet);
+        attachworldstate(ws, packet);
+        wsbuf.offset(wsbuf.length());
+    }
+
+    /// Interest managed replacement for the addposition()/sendpositions() pass.
+    /// Demos still record every position, all members of a group share the same zero-copy packets.
+    static void sendinterestpositions(worldstate &ws, ucharbuf &wsbuf, int mtu)
+    {
+        if(demorecord)
+        {
+            loopv(clients)
+            {
+                clientinfo &ci = *clients[i];
+                if(ci.state.aitype != AI_NONE) continue;
+                loopj(ci.bots.length()+1)
+                {
+                    clientinfo &bi = j ? *ci.bots[j-1] : ci;
+                    if(bi.position.empty()) continue;
+                    if(wsbuf.length() + bi.position.length() > mtu) { recordpacket(0, wsbuf.buf, wsbuf.length()); wsbuf.offset(wsbuf.length()); }
+                    wsbuf.put(bi.position.getbuf(), bi.position.length());
+                }
+            }
+            if(!wsbuf.empty()) { recordpacket(0, wsbuf.buf, wsbuf.length()); wsbuf.offset(wsbuf.length()); }
+        }
+        loopi(numinterestgroups)
+        {
+            interestgroup &g = interestgroups[i];
+            loopvj(g.senders)
+            {
+                clientinfo &bi = *g.senders[j];
+                if(wsbuf.length() + bi.position.length() > mtu) sendinterestpacket(ws, wsbuf, g);
+                wsbuf.put(bi.position.getbuf(), bi.position.length());
+            }
+            sendinterestpacket(ws, wsbuf, g);
+        }
+        loopv(clients)
+        {
+            clientinfo &ci = *clients[i];
+            if(ci.state.aitype != AI_NONE) continue;
+            ci.position.setsize(0);
+            loopvj(ci.bots) ci.bots[j]->position.setsize(0);
+        }
+    }
+
     static void sendmessages(worldstate &ws, ucharbuf &wsbuf)
     {
         if(wsbuf.empty()) return;
@@ -1698,8 +2141,7 @@ namespace server
             if(size <= 0) continue;
             ENetPacket *packet = enet_packet_create(data, size, (reliablemessages ? ENET_PACKET_FLAG_RELIABLE : 0) | ENET_PACKET_FLAG_NO_ALLOCATE);
             sendpacket(ci.clientnum, 1, packet);
-            if(packet->referenceCount) { ws.uses++; packet->freeCallback = cleanworldstate; }
-            else enet_packet_destroy(packet);
+            attachworldstate(ws, packet);
         }
         wsbuf.offset(wsbuf.length());
     }
@@ -1735,19 +2177,23 @@ namespace server
             reliablemessages = false;
             return false;
         }
-        worldstate &ws = worldstates.add();
-        ws.setup(2*wsmax);
+        int interestmax = interestmode ? buildinterestgroups() : 0;
+        worldstate &ws = *newworldstate(2*wsmax + interestmax);
         int mtu = getservermtu() - 100;
         if(mtu <= 0) mtu = ws.len;
         ucharbuf wsbuf(ws.data, ws.len);
-        loopv(clients)
+        if(interestmode) sendinterestpositions(ws, wsbuf, mtu);
+        else
         {
-            clientinfo &ci = *clients[i];
-            if(ci.state.aitype != AI_NONE) continue;
-            addposition(ws, wsbuf, mtu, ci, ci);
-            loopvj(ci.bots) addposition(ws, wsbuf, mtu, *ci.bots[j], ci);
+            loopv(clients)
+            {
+                clientinfo &ci = *clients[i];
+                if(ci.state.aitype != AI_NONE) continue;
+                addposition(ws, wsbuf, mtu, ci, ci);
+                loopvj(ci.bots) addposition(ws, wsbuf, mtu, *ci.bots[j], ci);
+            }
+            sendpositions(ws, wsbuf);
         }
-        sendpositions(ws, wsbuf);
         loopv(clients)
         {
             clientinfo &ci = *clients[i];
@@ -1758,8 +2204,7 @@ namespace server
         sendmessages(ws, wsbuf);
         reliablemessages = false;
         if(ws.uses) return true;
-        ws.cleanup();
-        worldstates.drop();
+        freeworldstate(&ws);
         return false;
     }
 
@@ -1768,7 +2213,11 @@ namespace server
         if(clients.empty() || (!hasnonlocalclients() && !demorecord)) return false;
         enet_uint32 curtime = enet_time_get()-lastsend;
         if(curtime<33 && !force) return false;
-        bool flush = buildworldstate();
+        bool flush;
+        {
+            inexor::util::ScopedPhaseTimer timer(tickprofiler, TICK_WORLDSTATE);
+            flush = buildworldstate();
+        }
         lastsend += curtime - (curtime%33);
         return flush;
     }
@@ -1791,6 +2240,7 @@ namespace server
         gamestate &gs = ci->state;
         gs.spawnstate(gamemode);
         gs.lifesequence = (gs.lifesequence + 1)&0x7F;
+        ci->history.reset();
     }
 
     void sendspawn(clientinfo *ci)
@@ -1854,13 +2304,16 @@ namespace server
                (smapname[0] && (!m_timed || gamemillis < gamelimit || (ci->state.state==CS_SPECTATOR && !ci->privilege && !ci->local) || numclients(ci->clientnum, true, true, true)));
     }
 
-    int welcomepacket(packetbuf &p, clientinfo *ci)
+    int welcomepacket(packetbuf &p, clientinfo *ci, bool mapchange)
     {
-        putint(p, N_WELCOME);
-        putint(p, N_MAPCHANGE);
-        sendstring(smapname, p);
-        putint(p, gamemode);
-        putint(p, notgotitems ? 1 : 0);
+        if(mapchange)
+        {
+            putint(p, N_WELCOME);
+            putint(p, N_MAPCHANGE);
+            sendstring(smapname, p);
+            putint(p, gamemode);
+            putint(p, notgotitems ? 1 : 0);
+        }
         if(!ci || (m_timed && smapname[0]))
         {
             putint(p, N_TIMEUP);
@@ -2004,12 +2457,18 @@ namespace server
         sendpacket(-1, 1, p.finalize(), ci->clientnum);
     }
 
+    /// Load the geometry of maps along with their entities, hitvalidation uses it to detect shots through walls.
+    VAR(mapgeometry, 0, 1, 1);
+
     void loaditems()
     {
         resetitems();
         notgotitems = true;
-        if(m_edit || !loadents(smapname, ments, &mcrc))
-            return;
+        if(m_edit) return;
+        mapfile = loadsharedmap(smapname, mapgeometry != 0);
+        if(!mapfile) return;
+        ments = mapfile->ents;
+        mcrc = mapfile->crc;
         loopv(ments) if(canspawnitem(ments[i].type))
         {
             server_entity se = { NOTUSED, 0, false };
@@ -2403,6 +2862,106 @@ namespace server
         }
     }
 
+    /// Lag compensated hit validation: the reported hits of hitscan weapons are checked against the hitboxes
+    /// of the targets at the time the shooter saw them.
+    /// 0 = off, 1 = count hits which do not match, 2 = additionally discard them.
+    VAR(hitvalidation, 0, 0, 2);
+    /// Slack in cube units added to every hitbox, covering interpolation and quantization errors.
+    VAR(hittolerance, 0, 8, 64);
+    /// Log a warning about a player each time this many of their hits failed the validation, 0 = never.
+    VAR(maxunverifiedhits, 0, 10, 10000);
+
+    /// Hitboxes of all targets of one shot, kept as structure of arrays so testhitboxes() can be vectorized.
+    struct hitboxbatch
+    {
+        vector<float> minx, miny, minz, maxx, maxy, maxz;
+        vector<uchar> hit;
+
+        void reset()
+        {
+            minx.setsize(0); miny.setsize(0); minz.setsize(0);
+            maxx.setsize(0); maxy.setsize(0); maxz.setsize(0);
+            hit.setsize(0);
+        }
+
+        int length() const { return minx.length(); }
+
+        void add(const vec &feet)
+        {
+            // same box as the client uses for players: radius 4.1, eyeheight 14, aboveeye 1
+            minx.add(feet.x - 4.1f); miny.add(feet.y - 4.1f); minz.add(feet.z);
+            maxx.add(feet.x + 4.1f); maxy.add(feet.y + 4.1f); maxz.add(feet.z + 15);
+            hit.add(0);
+        }
+    };
+
+    /// Test the spread cone of a shot against all boxes of the batch in one pass.
+    /// The point on the shot ray closest to the box center has to lie within the box, grown by the tolerance
+    /// and by the maximal ray offset at that distance.
+    static void testhitboxes(hitboxbatch &b, const vec &from, const vec &to, int spread, float tolerance)
+    {
+        vec dir = vec(to).sub(from);
+        float range = dir.magnitude();
+        if(range > 0) dir.div(range);
+        const float spreadscale = 0.5f*spread/1024.0f;
+        const float *minx = b.minx.getbuf(), *miny = b.miny.getbuf(), *minz = b.minz.getbuf(),
+                    *maxx = b.maxx.getbuf(), *maxy = b.maxy.getbuf(), *maxz = b.maxz.getbuf();
+        uchar *hit = b.hit.getbuf();
+        const int n = b.length();
+        for(int i = 0; i < n; i++)
+        {
+            float cx = 0.5f*(minx[i] + maxx[i]) - from.x,
+                  cy = 0.5f*(miny[i] + maxy[i]) - from.y,
+                  cz = 0.5f*(minz[i] + maxz[i]) - from.z;
+            float t = cx*dir.x + cy*dir.y + cz*dir.z;
+            t = t < 0 ? 0 : (t > range ? range : t);
+            float slack = tolerance + t*spreadscale;
+            float px = from.x + dir.x*t, py = from.y + dir.y*t, pz = from.z + dir.z*t;
+            hit[i] = px >= minx[i] - slack && px <= maxx[i] + slack &&
+                     py >= miny[i] - slack && py <= maxy[i] + slack &&
+                     pz >= minz[i] - slack && pz <= maxz[i] + slack;
+        }
+    }
+
+    /// Whether solid geometry lies on the shot ray in front of box i of the batch.
+    /// Only entirely solid cubes count and the tolerance is kept free in front of the box, so this never rejects a shot the client could see.
+    static bool shotblocked(const hitboxbatch &b, int i, const vec &from, const vec &to, int spread, float tolerance)
+    {
+        if(!mapfile || mapfile->geom.empty()) return false;
+        vec dir = vec(to).sub(from);
+        float range = dir.magnitude();
+        if(range <= 0) return false;
+        dir.div(range);
+        vec center(0.5f*(b.minx[i] + b.maxx[i]), 0.5f*(b.miny[i] + b.maxy[i]), 0.5f*(b.minz[i] + b.maxz[i]));
+        float t = clamp(vec(center).sub(from).dot(dir), 0.0f, range);
+        float clear = t - tolerance - t*0.5f*spread/1024.0f - 2*4.1f;
+        return clear > 0 && mapfile->geom.raycube(from, dir, clear) < clear;
+    }
+
+    /// Rewind all targets of the hits to the given time and test them against the shot.
+    /// @return whether hit i could be verified in verified[i].
+    static void verifyhits(clientinfo *ci, int gun, const vec &from, const vec &to, const vector<hitinfo> &hits, int millis, vector<uchar> &verified)
+    {
+        static SERVERLOCAL hitboxbatch batch;
+        static SERVERLOCAL vector<int> slots;
+        batch.reset();
+        slots.setsize(0);
+        verified.setsize(0);
+        loopv(hits)
+        {
+            clientinfo *target = getinfo(hits[i].target);
+            vec pos;
+            if(target && target->history.at(millis, pos))
+            {
+                slots.add(batch.length());
+                batch.add(pos);
+            }
+            else slots.add(-1);
+        }
+        testhitboxes(batch, from, to, guns[gun].spread, hittolerance);
+        loopv(hits) verified.add(slots[i] < 0 || (batch.hit[slots[i]] && !shotblocked(batch, slots[i], from, to, guns[gun].spread, hittolerance)));
+    }
+
     void shotevent::process(clientinfo *ci)
     {
         gamestate &gs = ci->state;
@@ -2429,11 +2988,23 @@ namespace server
             default:
             {
                 int totalrays = 0, maxrays = guns[gun].rays;
+                static SERVERLOCAL vector<uchar> verified;
+                // only approximately the time the shooter saw: the targets' positions are stamped when they arrive here
+                // and the ping is a smoothed round trip, hittolerance has to cover the difference
+                if(hitvalidation && hits.length()) verifyhits(ci, gun, from, to, hits, millis - ci->ping, verified);
                 loopv(hits)
                 {
                     hitinfo &h = hits[i];
                     clientinfo *target = getinfo(h.target);
                     if(!target || target->state.state!=CS_ALIVE || h.lifesequence!=target->state.lifesequence || h.rays<1 || h.dist > guns[gun].range + 1) continue;
+                    if(hitvalidation && !verified[i])
+                    {
+                        ci->unverifiedhits++;
+                        spdlog::get("gameplay")->debug("unverified hit by {0} ({1}) on {2}", ci->name, ci->clientnum, target->clientnum);
+                        if(maxunverifiedhits && ci->unverifiedhits % maxunverifiedhits == 0)
+                            spdlog::get("global")->warn("{0} ({1}) had {2} unverified hits", ci->name, ci->clientnum, ci->unverifiedhits);
+                        if(hitvalidation >= 2) continue;
+                    }
 
                     totalrays += h.rays;
                     if(totalrays>maxrays) continue;
@@ -2516,6 +3087,38 @@ namespace server
         ci->timesync = false;
     }
 
+    SERVERLOCAL int mapsendbudget = 0, lastmapsend = 0, nextmapsend = 0;
+
+    /// Stream the cached map chunks round robin to all downloading clients, limited to mapsendrate kB/s in total.
+    void sendmapchunks()
+    {
+        int elapsed = totalmillis - lastmapsend;
+        lastmapsend = totalmillis;
+        if(mapdata.chunks.empty()) return;
+        mapsendbudget = min(mapsendbudget + mapsendrate*elapsed, max(mapsendrate*100, int(mapcache::CHUNKSIZE)));
+        bool sending = true;
+        while(sending && mapsendbudget > 0)
+        {
+            sending = false;
+            loopv(clients)
+            {
+                clientinfo *ci = clients[(nextmapsend + i) % clients.length()];
+                if(ci->getmap < 0) continue;
+                if(!mapdata.chunks.inrange(ci->getmap)) { ci->getmap = -1; continue; }
+                ENetPacket *packet = mapdata.chunks[ci->getmap++];
+                if(ci->getmap >= mapdata.chunks.length()) ci->getmap = -1;
+                sendpacket(ci->clientnum, 2, packet);
+                sending = true;
+                mapsendbudget -= int(packet->dataLength);
+                if(mapsendbudget <= 0)
+                {
+                    nextmapsend = (nextmapsend + i + 1) % clients.length();
+                    break;
+                }
+            }
+        }
+    }
+
     void serverupdate()
     {
         if(shouldstep && !gamepaused)
@@ -2525,7 +3128,10 @@ namespace server
             if(m_demo) readdemo();
             else if(!m_timed || gamemillis < gamelimit)
             {
-                processevents();
+                {
+                    inexor::util::ScopedPhaseTimer timer(tickprofiler, TICK_EVENTS);
+                    processevents();
+                }
                 if(curtime)
                 {
                     loopv(sents) if(sents[i].spawntime) // spawn entities when timer reached
@@ -2544,8 +3150,15 @@ namespace server
                         }
                     }
                 }
-                aiman::checkai();
-                if(smode) smode->update();
+                {
+                    inexor::util::ScopedPhaseTimer timer(tickprofiler, TICK_AI);
+                    aiman::checkai();
+                }
+                if(smode)
+                {
+                    inexor::util::ScopedPhaseTimer timer(tickprofiler, TICK_GAMEMODE);
+                    smode->update();
+                }
             }
         }
         else if(smode) smode->updatelimbo();
@@ -2578,6 +3191,8 @@ namespace server
             }
         }
 
+        sendmapchunks();
+
         shouldstep = clients.length() > 0;
     }
 
@@ -2749,17 +3364,16 @@ namespace server
 
     int reserveclients() { return 3; }
 
-    vector<ipmask> gbans;
+    SERVERLOCAL ipmasklist gbans;
 
     void cleargbans()
     {
-        gbans.shrink(0);
+        gbans.clear();
     }
 
     bool checkgban(uint ip)
     {
-        loopv(gbans) if(gbans[i].check(ip)) return true;
-        return false;
+        return gbans.check(ip);
     }
 
     void addgban(const char *name)
@@ -2772,7 +3386,7 @@ namespace server
         {
             clientinfo *ci = clients[i];
             if(ci->state.aitype != AI_NONE || ci->local || ci->privilege >= PRIV_ADMIN) continue;
-            if(checkgban(getclientip(ci->clientnum))) disconnect_client(ci->clientnum, DISC_IPBAN);
+            if(ban.check(getclientip(ci->clientnum))) disconnect_client(ci->clientnum, DISC_IPBAN);
         }
     }
        
@@ -2841,13 +3455,14 @@ namespace server
         sendf(ci->clientnum, 1, "risis", N_AUTHCHAL, desc, id, val);
     }
 
-    uint nextauthreq = 0;
+    /// Unique over all game instances: they share the master server connection and every one of them gets its replies.
+    std::atomic<uint> nextauthreq(1);
 
     bool tryauth(clientinfo *ci, const char *user, const char *desc)
     {
         ci->cleanauth();
-        if(!nextauthreq) nextauthreq = 1;
-        ci->authreq = nextauthreq++;
+        do ci->authreq = nextauthreq++;
+        while(!ci->authreq);
         filtertext(ci->authname, user, false, false, 100);
         copystring(ci->authdesc, desc);
         if(ci->authdesc[0])
@@ -2922,6 +3537,12 @@ namespace server
         }
     }
 
+    /// Called after every batch of lines from the master server: apply a gban list push as a whole.
+    void masterinputprocessed()
+    {
+        gbans.update();
+    }
+
     void processmasterinput(const char *cmd, int cmdlen, const char *args)
     {
         uint id;
@@ -2943,10 +3564,8 @@ namespace server
         if(!m_edit || len <= 0 || len > 4*1024*1024) return;
         clientinfo *ci = getinfo(sender);
         if(ci->state.state==CS_SPECTATOR && !ci->privilege && !ci->local) return;
-        if(mapdata) DELETEP(mapdata);
-        mapdata = opentempfile("mapdata", "w+b");
-        if(!mapdata) { sendf(sender, 1, "ris", N_SERVMSG, "failed to open temporary file for map"); return; }
-        mapdata->write(data, len);
+        // restart running downloads if the map changed
+        if(mapdata.build(data, len)) loopv(clients) if(clients[i]->getmap >= 0) clients[i]->getmap = 0;
         sendservmsgf("[%s sent a map to server, \"/getmap\" to receive it]", colorname(ci));
     }
 
@@ -2996,6 +3615,130 @@ namespace server
         if(servermotd[0]) sendf(ci->clientnum, 1, "ris", N_SERVMSG, *servermotd);
     }
 
+    /// Read the payload of a N_POS (everything after the client number) sent by ci for cp and update the server side state of cp.
+    /// @return whether the position should be relayed to the other clients.
+    static bool parseposition(clientinfo *ci, clientinfo *cp, ucharbuf &p)
+    {
+        p.get();
+        uint flags = getuint(p);
+        vec pos;
+        loopk(3)
+        {
+            int n = p.get(); n |= p.get()<<8; if(flags&(1<<k)) { n |= p.get()<<16; if(n&0x800000) n |= -1<<24; }
+            pos[k] = n/DMF;
+        }
+        loopk(3) p.get();
+        int mag = p.get(); if(flags&(1<<3)) mag |= p.get()<<8;
+        int dir = p.get(); dir |= p.get()<<8;
+        vec vel = vec((dir%360)*RAD, (clamp(dir/360, 0, 180)-90)*RAD).mul(mag/DVELF);
+        if(flags&(1<<4))
+        {
+            p.get(); if(flags&(1<<5)) p.get();
+            if(flags&(1<<6)) loopk(2) p.get();
+        }
+        if(!cp) return false;
+        bool relay = (!ci->local || demorecord || hasnonlocalclients()) && (cp->state.state==CS_ALIVE || cp->state.state==CS_EDITING);
+        if(relay && !ci->local && !m_edit && max(vel.magnitude2(), (float)fabs(vel.z)) >= 180)
+            cp->setexceeded();
+        if(smode && cp->state.state==CS_ALIVE) smode->moved(cp, cp->state.o, cp->gameclip, pos, (flags&0x80)!=0);
+        cp->state.o = pos;
+        if(cp->state.state==CS_ALIVE) cp->history.add(gamemillis, pos);
+        cp->gameclip = (flags&0x80)!=0;
+        return relay;
+    }
+
+    /// Queue the position message of cp for the next worldstate.
+    /// A keyframe which was not sent yet must not be replaced by a delta, otherwise the following deltas would be unusable for everyone.
+    static void storeposition(clientinfo &cp, const uchar *msg, int len, bool keyframe)
+    {
+        if(keyframe || !cp.positionkeyframe || cp.position.empty())
+        {
+            cp.position.setsize(0);
+            cp.positionkeyframe = keyframe;
+        }
+        cp.position.put(msg, len);
+    }
+
+    /// Replay the positions of a recorded demo and print the channel 0 bytes per tick it takes:
+    /// as recorded, with every update sent as full N_POS (as before N_POSDELTA) and delta encoded.
+    /// N_POS has the same layout in older protocols, so their demos work as well.
+    void benchmarkpositions(const char *file)
+    {
+        string msg;
+        demoreader *demo = opendemo(file, msg, true);
+        if(!demo)
+        {
+            spdlog::get("global")->error(msg);
+            return;
+        }
+
+        struct posreplay
+        {
+            poskeyframe recorded, encoded;
+            int deltas = 0;
+        };
+        hashtable<int, posreplay> senders;
+        vector<uchar> out;
+        long recorded = 0, full = 0, delta = 0;
+        int ticks = 0, lastrecord = -1, updates = 0, lost = 0;
+        while(demo->next())
+        {
+            if(demo->chan != 0) continue;
+            if(demo->millis != lastrecord) { ticks++; lastrecord = demo->millis; }
+            recorded += demo->len;
+            ucharbuf p(demo->buf, demo->len);
+            while(p.remaining() > 0)
+            {
+                int start = p.length(), type = getint(p);
+                if(type != N_POS && type != N_POSDELTA)
+                {
+                    // anything else in the packet is the same either way
+                    full += p.maxlen - start;
+                    delta += p.maxlen - start;
+                    break;
+                }
+                int cn = getuint(p), payload = p.length(), n = 0;
+                posreplay &s = senders[cn];
+                uchar buf[MAXPOSBYTES];
+                if(type == N_POS)
+                {
+                    parseposition(NULL, NULL, p);
+                    n = p.length() - payload;
+                    s.recorded.set(&p.buf[payload], n);
+                    if(n > MAXPOSBYTES)
+                    {
+                        full += p.length() - start;
+                        delta += p.length() - start;
+                        continue;
+                    }
+                    memcpy(buf, &p.buf[payload], n);
+                }
+                else if(!s.recorded.getdelta(p, buf, n)) { lost++; continue; }
+                if(p.overread()) break;
+                updates++;
+                out.setsize(0);
+                putint(out, N_POS);
+                putuint(out, cn);
+                out.put(buf, n);
+                full += out.length();
+                out.setsize(0);
+                encodeposition(out, cn, buf, n, s.encoded, s.deltas);
+                delta += out.length();
+            }
+        }
+        delete demo;
+
+        if(!ticks)
+        {
+            spdlog::get("global")->error("demo \"{}\" contains no positions", file);
+            return;
+        }
+        spdlog::get("global")->info("[ BENCHMARK] {}: {} ticks, {} position updates ({} undecodable deltas skipped)", file, ticks, updates, lost);
+        spdlog::get("global")->info("[ BENCHMARK] channel 0 bytes/tick: {:.1f} recorded, {:.1f} full N_POS, {:.1f} with N_POSDELTA ({:.1f}% saved)",
+                                    double(recorded)/ticks, double(full)/ticks, double(delta)/ticks, full ? 100.0*(full - delta)/full : 0.0);
+    }
+    COMMAND(benchmarkpositions, "s");
+
     void parsepacket(int sender, int chan, packetbuf &p)     // has to parse exactly each byte of the packet
     {
         if(sender<0 || p.packet->flags&ENET_PACKET_FLAG_UNSEQUENCED || chan > 2) return;
@@ -3083,42 +3826,31 @@ namespace server
         {
             case N_POS:
             {
-                int pcn = getuint(p); 
-                p.get(); 
-                uint flags = getuint(p);
+                int pcn = getuint(p), start = p.length();
                 clientinfo *cp = getinfo(pcn);
                 if(cp && pcn != sender && cp->ownernum != sender) cp = NULL;
-                vec pos;
-                loopk(3)
-                {
-                    int n = p.get(); n |= p.get()<<8; if(flags&(1<<k)) { n |= p.get()<<16; if(n&0x800000) n |= -1<<24; }
-                    pos[k] = n/DMF;
-                }
-                loopk(3) p.get();
-                int mag = p.get(); if(flags&(1<<3)) mag |= p.get()<<8;
-                int dir = p.get(); dir |= p.get()<<8;
-                vec vel = vec((dir%360)*RAD, (clamp(dir/360, 0, 180)-90)*RAD).mul(mag/DVELF);
-                if(flags&(1<<4))
-                {
-                    p.get(); if(flags&(1<<5)) p.get();
-                    if(flags&(1<<6)) loopk(2) p.get();
-                }
-                if(cp)
+                // the receivers only learn about keyframes we relay, so only those may become ours
+                if(parseposition(ci, cp, p))
                 {
-                    if((!ci->local || demorecord || hasnonlocalclients()) && (cp->state.state==CS_ALIVE || cp->state.state==CS_EDITING))
-                    {
-                        if(!ci->local && !m_edit && max(vel.magnitude2(), (float)fabs(vel.z)) >= 180)
-                            cp->setexceeded();
-                        cp->position.setsize(0);
-                        while(curmsg<p.length()) cp->position.add(p.buf[curmsg++]);
-                    }
-                    if(smode && cp->state.state==CS_ALIVE) smode->moved(cp, cp->state.o, cp->gameclip, pos, (flags&0x80)!=0);
-                    cp->state.o = pos;
-                    cp->gameclip = (flags&0x80)!=0;
+                    storeposition(*cp, &p.buf[curmsg], p.length()-curmsg, true);
+                    cp->poskey.set(&p.buf[start], p.length()-start);
                 }
                 break;
             }
 
+            case N_POSDELTA:
+            {
+                int pcn = getuint(p), len = 0;
+                clientinfo *cp = getinfo(pcn);
+                if(cp && pcn != sender && cp->ownernum != sender) cp = NULL;
+                static const poskeyframe unknown;
+                uchar buf[MAXPOSBYTES];
+                if(!(cp ? cp->poskey : unknown).getdelta(p, buf, len)) break;
+                ucharbuf q(buf, len);
+                if(parseposition(ci, cp, q)) storeposition(*cp, &p.buf[curmsg], p.length()-curmsg, false);
+                break;
+            }
+
             case N_TELEPORT:
             {
                 int pcn = getint(p), teleport = getint(p), teledest = getint(p);
@@ -3588,6 +4320,14 @@ namespace server
                 break;
             }
 
+            case N_SEEKDEMO:
+            {
+                int millis = getint(p);
+                if(ci->privilege < (restrictdemos ? PRIV_ADMIN : PRIV_MASTER) && !ci->local) break;
+                if(m_demo) seekdemo(millis);
+                break;
+            }
+
             case N_CLEARDEMOS:
             {
                 int demo = getint(p);
@@ -3610,13 +4350,12 @@ namespace server
             }
 
             case N_GETMAP:
-                if(!mapdata) sendf(sender, 1, "ris", N_SERVMSG, "no map to send");
-                else if(ci->getmap) sendf(sender, 1, "ris", N_SERVMSG, "already sending map");
+                if(mapdata.chunks.empty()) sendf(sender, 1, "ris", N_SERVMSG, "no map to send");
+                else if(ci->getmap >= 0) sendf(sender, 1, "ris", N_SERVMSG, "already sending map");
                 else
                 {
                     sendservmsgf("[%s is getting the map]", colorname(ci));
-                    if((ci->getmap = sendfile(sender, 2, mapdata, "ri", N_SENDMAP)))
-                        ci->getmap->freeCallback = freegetmap;
+                    ci->getmap = 0;
                     ci->needclipboard = totalmillis ? totalmillis : 1;
                 }
                 break;
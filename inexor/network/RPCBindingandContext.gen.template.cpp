@@ -15,6 +15,9 @@
 #include "inexor/network/SharedTree.hpp"
 #include "inexor/network/RpcSubsystem.hpp"
 #include "inexor/network/RpcTestClient.hpp"
+#ifdef RPC_BENCHMARK
+#include "inexor/network/RpcBenchmarkClient.hpp"
+#endif
 
 {{#shared_class_definitions}}{{^is_shared_list}}#include "{{definition_header_file}}"
 {{/is_shared_list}}{{/shared_class_definitions}}
@@ -67,60 +70,110 @@ void testrpcclient(std::string port)
     t.detach();
 }
 
+#ifdef RPC_BENCHMARK
+/// Flood the server at the given port with changes from numclients clients for some seconds, see RpcBenchmarkClient.
+void benchmarkrpc(std::string port, int numclients, int seconds)
+{
+    std::thread t([port, numclients, seconds]
+    {
+        RpcBenchmarkClient<TreeEvent, TreeService> benchmark;
+        benchmark.Start(port, numclients, seconds);
+    });
+    t.detach();
+}
+#endif
+
 // We currently use a static function to signal the subsystem changes (since we cant yet SUBSYSTEM_GET it) .. so this is a temporary workaround.
 template <>
-std::vector<RpcServer<TreeEvent, TreeService::AsyncService>::clienthandler> RpcServer<TreeEvent, TreeService::AsyncService>::clients = {};
+RpcServer<TreeEvent, TreeService::AsyncService>::client_table RpcServer<TreeEvent, TreeService::AsyncService>::clients = {};
 
 /// This function sets the functions which get executed when specific stuff has been done on our SharedDeclarations.
 void set_on_change_functions()
 {
-    // Set all Global sharedvars onchange functions
-{{#shared_vars}}        {{name_cpp_full}}.onChange.connect([](const {{type_cpp_primitive}} oldvalue, const {{type_cpp_primitive}} newvalue)
+    // Set all Global sharedvars onchange functions: deferred, so we only look at them once per frame.
+{{#shared_vars}}        {{name_cpp_full}}.onChange.connect_deferred([](const {{type_cpp_primitive}} newvalue)
         {
             {{namespace}}::TreeEvent val;
             val.set_{{name_unique}}(newvalue);
-            inexor::rpc::RpcServer<{{namespace}}::TreeEvent, {{namespace}}::TreeService::AsyncService>::send_msg(std::move(val));
+            inexor::rpc::RpcServer<{{namespace}}::TreeEvent, {{namespace}}::TreeService::AsyncService>::send_change(val);
         }
     );
 {{/shared_vars}}
 
-    // Set all onchange functions for remove/push_back/member_modifed for sharedlists
+    // Set the functions sending the per frame diffs of the SharedLists as added/modified/removed events
 {{#shared_class_definitions}}{{#is_shared_list}}{{#instances}}{{#first_template_type}}
 
-    {{name_parent_cpp_full}}.element_removed_func = [](int id) {
-        {{namespace}}::TreeEvent tevent;
-        {{namespace}}::list_{{definition_name_unique}}_removed *rem_msg(tevent.mutable_list_{{instance_name_unique}}_removed());
-        rem_msg->set_intern_shared_list_id_number(id);
-
-        inexor::rpc::RpcServer<{{namespace}}::TreeEvent, {{namespace}}::TreeService::AsyncService>::send_msg(std::move(tevent));
-    };
-
-    {{name_parent_cpp_full}}.element_pushed_back_func = [](int id, {{definition_name_cpp}} &element) {
-        {{namespace}}::TreeEvent tevent;
-        {{namespace}}::list_{{definition_name_unique}}_added *added_msg(tevent.mutable_list_{{instance_name_unique}}_added());
-        added_msg->set_intern_shared_list_id_number(id);
-{{#members}}        added_msg->set_sharedclass_member_{{name_unique}}(element.{{name_cpp_short}});
+    {{name_parent_cpp_full}}.connect_element_func = []({{definition_name_cpp}} &element, std::function<void()> touch) {
+{{#members}}        element.{{name_cpp_short}}.onChange.connect([touch](const {{type_cpp_primitive}} oldvalue, const {{type_cpp_primitive}} newvalue) { touch(); });
 {{/members}}
+    };
 
-
-        inexor::rpc::RpcServer<{{namespace}}::TreeEvent, {{namespace}}::TreeService::AsyncService>::send_msg(std::move(tevent));
-{{#members}}        element.{{name_cpp_short}}.onChange.connect([id](const {{type_cpp_primitive}} oldvalue, const {{type_cpp_primitive}} newvalue)
+    {{name_parent_cpp_full}}.changed_func = [](size_t oldsize, size_t size, const std::vector<size_t> &changed) {
+        typedef inexor::rpc::RpcServer<{{namespace}}::TreeEvent, {{namespace}}::TreeService::AsyncService> server_type;
+        // the list shrank: remove from the end
+        for(size_t i = oldsize; i > size; i--)
         {
             {{namespace}}::TreeEvent tevent;
-            {{namespace}}::list_{{definition_name_unique}}_modified *modified_msg(tevent.mutable_list_{{instance_name_unique}}_modified());
-            modified_msg->set_intern_shared_list_id_number(id);
-            modified_msg->set_sharedclass_member_{{name_unique}}(newvalue);
-
-            inexor::rpc::RpcServer<{{namespace}}::TreeEvent, {{namespace}}::TreeService::AsyncService>::send_msg(std::move(tevent));
-        });
+            tevent.mutable_list_{{instance_name_unique}}_removed()->set_intern_shared_list_id_number(i - 1);
+            server_type::send_msg(std::move(tevent));
+        }
+        for(size_t i : changed)
+        {
+            {{definition_name_cpp}} &element = {{name_parent_cpp_full}}[i];
+            if(i >= oldsize) // the list grew: append
+            {
+                {{namespace}}::TreeEvent tevent;
+                {{namespace}}::list_{{definition_name_unique}}_added *added_msg(tevent.mutable_list_{{instance_name_unique}}_added());
+                added_msg->set_intern_shared_list_id_number(i + 1);
+{{#members}}                added_msg->set_sharedclass_member_{{name_unique}}(element.{{name_cpp_short}});
 {{/members}}
+                server_type::send_msg(std::move(tevent));
+                continue;
+            }
+{{#members}}            {
+                {{namespace}}::TreeEvent tevent;
+                {{namespace}}::list_{{definition_name_unique}}_modified *modified_msg(tevent.mutable_list_{{instance_name_unique}}_modified());
+                modified_msg->set_intern_shared_list_id_number(i);
+                modified_msg->set_sharedclass_member_{{name_unique}}(element.{{name_cpp_short}});
+                server_type::send_msg(std::move(tevent));
+            }
+{{/members}}
+        }
     };
 {{/first_template_type}}{{/instances}}{{/is_shared_list}}{{/shared_class_definitions}}
 }
 
-void send_all_vars()
+template<typename MSG_TYPE>
+void collect_tree_events(std::vector<MSG_TYPE> &events)
+{
+  // All basic global shared vars singeltons.
+{{#shared_vars}}    events.emplace_back();
+    events.back().set_{{name_unique}}(*{{name_cpp_full}});
+{{/shared_vars}}
+
+  // All elements of the SharedLists, as if they had just been added.
+{{#shared_class_definitions}}{{#is_shared_list}}{{#instances}}{{#first_template_type}}    for(size_t i = 0; i < {{name_parent_cpp_full}}.size(); i++)
+    {
+        {{definition_name_cpp}} &element = {{name_parent_cpp_full}}[i];
+        events.emplace_back();
+        {{namespace}}::list_{{definition_name_unique}}_added *added_msg(events.back().mutable_list_{{instance_name_unique}}_added());
+        added_msg->set_intern_shared_list_id_number(i + 1);
+{{#members}}        added_msg->set_sharedclass_member_{{name_unique}}(element.{{name_cpp_short}});
+{{/members}}
+    }
+{{/first_template_type}}{{/instances}}{{/is_shared_list}}{{/shared_class_definitions}}
+
+  // All members of global SharedClasses
+{{#shared_class_definitions}}{{^is_shared_list}}{{#instances}}{{#members}}    events.emplace_back();
+    events.back().set_class_{{instance_name_unique}}_var_{{name_unique}}(*{{name_parent_cpp_full}}.{{name_cpp_short}});
+{{/members}}{{/instances}}{{/is_shared_list}}{{/shared_class_definitions}}
+}
+
+template<typename MSG_TYPE>
+void clear_tree_lists()
 {
-   // TODO reimplement to allow multiple clients again..
+{{#shared_class_definitions}}{{#is_shared_list}}{{#instances}}{{#first_template_type}}    {{name_parent_cpp_full}}.clear_nosync();
+{{/first_template_type}}{{/instances}}{{/is_shared_list}}{{/shared_class_definitions}}
 }
 
 template<typename MSG_TYPE>
@@ -136,20 +189,21 @@ bool handle_index(int index, const MSG_TYPE &tree_event)
 {{/shared_vars}}
 
   // All event message for the SharedLists
-{{#shared_class_definitions}}{{#is_shared_list}}{{#instances}}{{#first_template_type}}    case {{>index}}: // list  {{instance_name_unique}} add event
+{{#shared_class_definitions}}{{#is_shared_list}}{{#instances}}{{#first_template_type}}    case {{>index}}: // list {{instance_name_unique}} add event
     {
-        {{definition_name_cpp}} new_entry;
+        if({{name_parent_cpp_full}}.size() >= MAX_SHARED_LIST_SIZE) break;
         auto &add_sub_msg = tree_event.list_{{instance_name_unique}}_added();
-{{#members}}        new_entry.{{name_cpp_short}}.setnosync(add_sub_msg.sharedclass_member_{{name_unique}}());
-        {{name_parent_cpp_full}}.push_back(std::move(new_entry));
+        {{name_parent_cpp_full}}.resize_nosync({{name_parent_cpp_full}}.size() + 1);
+        {{definition_name_cpp}} &ref = {{name_parent_cpp_full}}[{{name_parent_cpp_full}}.size() - 1];
+{{#members}}        ref.{{name_cpp_short}}.setnosync(add_sub_msg.sharedclass_member_{{name_unique}}());
 {{/members}}
         break;
     }
     case {{>index}}: // list {{instance_name_unique}} modify event
     {
         auto &modify_sub_msg = tree_event.list_{{instance_name_unique}}_modified();
-        int id = modify_sub_msg.intern_shared_list_id_number();
-        if(id < 0 || id >= {{name_parent_cpp_full}}.size()) break;
+        int64 id = modify_sub_msg.intern_shared_list_id_number();
+        if(id < 0 || id >= int64({{name_parent_cpp_full}}.size())) break;
         {{definition_name_cpp}} &ref = {{name_parent_cpp_full}}[id];
         switch(modify_sub_msg.key_case()) {
 {{#members}}        case {{local_index}}:
@@ -160,9 +214,9 @@ bool handle_index(int index, const MSG_TYPE &tree_event)
     }
     case {{>index}}: // list {{instance_name_unique}} remove event
     {
-        int id = tree_event.list_{{instance_name_unique}}_modified().intern_shared_list_id_number();
-        if(id < 0 || id >= {{name_parent_cpp_full}}.size()) break;
-        {{name_parent_cpp_full}}.erase(id);
+        int64 id = tree_event.list_{{instance_name_unique}}_removed().intern_shared_list_id_number();
+        if(id < 0 || id >= int64({{name_parent_cpp_full}}.size())) break;
+        {{name_parent_cpp_full}}.erase_nosync(id);
         break;
     }
 {{/first_template_type}}{{/instances}}{{/is_shared_list}}{{/shared_class_definitions}}
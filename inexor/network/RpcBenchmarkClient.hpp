@@ -0,0 +1,145 @@
+/// Load generator for the RPC server, started with --benchmark-rpc (only in builds with the RPC_BENCHMARK CMake option).
+///
+/// Connects a number of clients which all keep writing changes of one SharedVar as fast as the server takes them.
+/// The server broadcasts every change to all other clients, so with n clients each write turns into n-1 messages.
+/// The value written is the time it was sent at, which the receivers use to measure the latency.
+/// The SharedVar (rpcbenchmarkstamp) exists for this benchmark only, so no real setting gets overwritten.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <grpc/grpc.h>
+#include <grpc++/grpc++.h>
+
+#include "inexor/util/Logging.hpp"
+
+namespace inexor { namespace rpc {
+
+template<typename DATA_TYPE, typename SERVICE_TYPE>
+class RpcBenchmarkClient
+{
+    enum { CONNECT_TAG = 1, READ_TAG, WRITE_TAG };
+
+    std::atomic<bool> running{true};
+    std::atomic<int64_t> received{0};
+    std::atomic<int> connected{0};
+    const int64_t start_us = now_us();
+
+    std::mutex latencies_mutex;
+    /// Microseconds from writing a change until another client received it.
+    std::vector<int64_t> latencies;
+
+    static int64_t now_us()
+    {
+        using namespace std::chrono;
+        return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    /// Microseconds since the benchmark started, which fits the int SharedVar for half an hour.
+    int stamp() const { return int(now_us() - start_us); }
+
+    static DATA_TYPE make_msg(int value)
+    {
+        DATA_TYPE t;
+        t.set__rpcbenchmarkstamp(value);
+        return t;
+    }
+
+    /// The server waits for the tree intro of its first client before it serves anyone.
+    static DATA_TYPE make_intro_finished_msg()
+    {
+        DATA_TYPE t;
+        t.set_general_event(decltype(t.general_event())(1)); // FINISHED_TREE_INTRO_SEND
+        return t;
+    }
+
+    /// Only the first client announces the end of its tree intro, the server just needs it once.
+    void run_client(std::string address, bool intro)
+    {
+        std::shared_ptr<grpc::Channel> channel(grpc::CreateChannel(address, grpc::InsecureChannelCredentials()));
+        std::unique_ptr<typename SERVICE_TYPE::Stub> stub(SERVICE_TYPE::NewStub(channel));
+        grpc::ClientContext context;
+        grpc::CompletionQueue cq;
+        std::unique_ptr<grpc::ClientAsyncReaderWriter<DATA_TYPE, DATA_TYPE>> stream(stub->AsyncSynchronize(&context, &cq, (void *)CONNECT_TAG));
+
+        void *tag;
+        bool ok = false;
+        if(!cq.Next(&tag, &ok) || !ok) return;
+        connected++;
+
+        const auto key = make_msg(0).key_case();
+        DATA_TYPE in, out = intro ? make_intro_finished_msg() : make_msg(stamp());
+        std::vector<int64_t> local;
+        stream->Write(out, (void *)WRITE_TAG);
+        stream->Read(&in, (void *)READ_TAG);
+
+        while(running)
+        {
+            gpr_timespec deadline = gpr_time_add(gpr_now(GPR_CLOCK_REALTIME), gpr_time_from_millis(100, GPR_TIMESPAN));
+            grpc::CompletionQueue::NextStatus stat = cq.AsyncNext(&tag, &ok, deadline);
+            if(stat == grpc::CompletionQueue::NextStatus::TIMEOUT) continue;
+            if(stat != grpc::CompletionQueue::NextStatus::GOT_EVENT || !ok) break;
+            if(tag == (void *)WRITE_TAG)
+            {
+                out = make_msg(stamp());
+                stream->Write(out, (void *)WRITE_TAG);
+            }
+            else if(tag == (void *)READ_TAG)
+            {
+                if(in.key_case() == key)
+                {
+                    local.push_back(stamp() - in._rpcbenchmarkstamp());
+                    received++;
+                }
+                stream->Read(&in, (void *)READ_TAG);
+            }
+        }
+
+        context.TryCancel();
+        cq.Shutdown();
+        while(cq.Next(&tag, &ok)) {}
+
+        std::lock_guard<std::mutex> lock(latencies_mutex);
+        latencies.insert(latencies.end(), local.begin(), local.end());
+    }
+
+    int64_t percentile(double p)
+    {
+        if(latencies.empty()) return 0;
+        return latencies[std::min(latencies.size() - 1, size_t(p * latencies.size()))];
+    }
+
+public:
+
+    /// Flood the server for the given time, printing the throughput every second and the latency distribution at the end.
+    void Start(std::string port, int numclients, int seconds)
+    {
+        std::string address = "localhost:" + port;
+        std::vector<std::thread> threads;
+        for(int i = 0; i < numclients; i++) threads.emplace_back([this, address, i] { run_client(address, i == 0); });
+
+        int64_t total = 0;
+        for(int t = 1; t <= seconds; t++)
+        {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            int64_t n = received.exchange(0);
+            total += n;
+            spdlog::get("global")->info("[RPC benchmark] {}s: {} clients connected, {} messages/s", t, connected.load(), n);
+        }
+        running = false;
+        for(auto &t : threads) t.join();
+
+        std::sort(latencies.begin(), latencies.end());
+        spdlog::get("global")->info("[RPC benchmark] {} messages in {}s, latency p50 {}us, p99 {}us, p99.9 {}us, max {}us",
+                                    total, seconds, percentile(0.5), percentile(0.99), percentile(0.999), percentile(1));
+    }
+};
+
+} } // ns inexor::rpc
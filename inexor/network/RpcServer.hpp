@@ -3,18 +3,28 @@
 /// Note: This is a header only template library ("header-only" as a consequence of "template").
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <exception>
 #include <queue>
+#include <deque>
+#include <map>
+#include <tuple>
+#include <vector>
 #include <functional>
 #include <chrono>
 #include <thread>
 
 #include <grpc/grpc.h>
 #include <grpc++/grpc++.h>
+#include <grpc++/alarm.h>
 
+#include "inexor/network/SharedVar.hpp"
 #include "inexor/util/Logging.hpp"
+#include "inexor/util/SpscQueue.hpp"
 
 // size is important for us, proto explicitly specifies int64
 typedef int64_t int64;
@@ -32,13 +42,21 @@ enum cpp_type_t
 
 // These functions need to be implemented by the Context Provider (acquiring this submodule):
 extern void set_on_change_functions();
-extern void send_all_vars();
 
 template<typename MSG_TYPE>
 bool handle_index(int index, const MSG_TYPE &tree_event);
 
-#define MAX_RPC_EVENT_CHECKS_PER_TICK 100
+/// Append one message per shared var, global SharedClass member and SharedList element, describing the whole tree.
+template<typename MSG_TYPE>
+void collect_tree_events(std::vector<MSG_TYPE> &events);
+
+/// Empty all SharedLists (without notifying anyone), before a snapshot refills them.
+template<typename MSG_TYPE>
+void clear_tree_lists();
+
 #define MAX_RPC_CLIENTS 128 // possible highest value is 255, see encode_signal()
+#define RPC_HANDOFF_SIZE 4096 // messages waiting between the game and the completion queue thread (each way)
+#define RPC_SNAPSHOT_VERSION 1
 
 /// The events we request GRPC to do.
 enum EVENT_TYPE
@@ -47,17 +65,33 @@ enum EVENT_TYPE
     E_READ,
     E_CONNECT,
     E_DISCONNECT,
+    E_WAKEUP, // the game thread published new messages
     E_NUM
 };
+
+/// What a tag we got back from the completion queue refers to.
 struct callback_event
 {
-    const int type;
-    const int client_id;
-    callback_event(const int type_, int client_id_) : type(type_), client_id(client_id_) {}
+    int type;
+    /// The client slot, -1 for events not related to a client (E_CONNECT).
+    int client_id;
+    /// Which connection of that slot the event belongs to, see clienthandler::generation.
+    unsigned generation;
 };
-const inline void *encode_signal(const int event_type, int clientid)
+
+/// The GRPC queue signals finished events with void* tags.
+/// So we compress the needed info (EVENT_TYPE, the clients slot and its generation) into the pointer value itself.
+/// This way no allocation is needed for the tags and stale ones of a reused slot can be recognized.
+inline void *encode_signal(const int event_type, int clientid, unsigned generation = 0)
 {
-    return reinterpret_cast<void*>(new callback_event(event_type, clientid));
+    return reinterpret_cast<void *>((uintptr_t(generation & 0xFFFF) << 16) | (uintptr_t(clientid & 0xFF) << 8) | uintptr_t(event_type));
+}
+
+inline callback_event decode_signal(void *tag)
+{
+    uintptr_t bits = reinterpret_cast<uintptr_t>(tag);
+    int clientid = int((bits >> 8) & 0xFF);
+    return callback_event{int(bits & 0xFF), clientid == 0xFF ? -1 : clientid, unsigned(bits >> 16)};
 }
 
 template<typename MSG_TYPE, typename ASYNC_SERVICE_TYPE>
@@ -81,6 +115,7 @@ public:
     /// As soon as the tree arrived from the first client, this will be set to true.
     bool initialized = false;
 
+    /// A slot of the client table.
     class clienthandler
     {
         /// The stream we write into / receive data from (asynchronously).
@@ -92,17 +127,36 @@ public:
         /// There's always only one write allowed at a time.
         bool writer_busy = false;
 
+        /// Changes other clients sent while this one awaits its snapshot, with their number in received_changes.
+        std::deque<std::pair<uint64_t, std::shared_ptr<const MSG_TYPE>>> held_changes;
+
         /// Keep a list of outstanding writes, since GRPC limits us to only one outstanding write per stream/client!
-        std::queue<MSG_TYPE> outstanding_writes;
+        /// The messages are shared between all clients instead of being copied for each.
+        std::deque<std::shared_ptr<const MSG_TYPE>> outstanding_writes;
 
         /// Did disconnecting work? If it didn't, why?
         grpc::Status disconnect_status;
     public:
 
-        /// The clients identifier number.
-        int id;
+        /// The clients identifier number: its slot in the client table.
+        int id = -1;
 
-        clienthandler(int id_, std::unique_ptr<stream_type> &&stream_) : id(id_), stream(std::move(stream_)) {}
+        /// Counts the connections this slot served, so events of a previous one are not mistaken for the current.
+        unsigned generation = 0;
+
+        /// Whether a client is connected to this slot.
+        bool active = false;
+
+        /// A newly connected client gets nothing before its tree snapshot.
+        bool awaiting_snapshot = false;
+
+        /// The game thread had no room for the message in the read buffer: we don't read on until it has.
+        bool read_stalled = false;
+
+        /// Hand the slot to a newly connected client.
+        void connect(int id_, std::unique_ptr<stream_type> &&stream_);
+        /// Free the slot again.
+        void release();
 
         /// Start an asynchronous read.
         void request_read();
@@ -110,10 +164,14 @@ public:
         const MSG_TYPE &get_read_result()      { return read_buffer; }
 
         /// Add message to the queue of to-be-sent messages.
-        void write(const MSG_TYPE &msg)        { outstanding_writes.push(msg); }
+        void write(const std::shared_ptr<const MSG_TYPE> &msg) { outstanding_writes.push_back(msg); }
+        /// Keep a change another client sent until the snapshot tells whether it contains it.
+        void hold(uint64_t sequence, const std::shared_ptr<const MSG_TYPE> &msg) { held_changes.emplace_back(sequence, msg); }
+        /// Send the snapshot, followed by the held changes the game thread applied only after taking it.
+        void send_snapshot(const std::shared_ptr<const MSG_TYPE> &snapshot, uint64_t applied);
 
         /// Whether or not writes are outstanding.
-        bool has_writes()                { return !outstanding_writes.size(); }
+        bool has_writes()                { return !outstanding_writes.empty(); }
         bool currently_writing()         { return writer_busy; }
 
         /// Send the next item from the queue, needs to be called only if the queue was empty in the last finished_send_one() and in case of a kick-off
@@ -126,57 +184,162 @@ public:
         /// Prints out any error info.
         void finished_disconnect();
     };
-    static std::vector<clienthandler> clients;
+    /// Fixed table of client slots, a client's id is its index.
+    typedef std::array<clienthandler, MAX_RPC_CLIENTS> client_table;
+    static client_table clients;
 
 private:
     /// Client which isn't connected yet, a buffer caused by the async API.
     std::unique_ptr<stream_type> connect_slot;
+
+    /// The unused slots of the client table.
+    std::vector<int> free_ids;
 public:
     std::string server_address;
 
     RpcServer(const char *address);
     ~RpcServer();
 
-    /// This is essentially doing the sending/receiving.
-    /// Quits if there are no more values to send and we don't receive anything anymore or if MAX_RPC_EVENT_CHECKS_PER_TICK is reached.
-    /// In case of errors it throws a std::exception (TODO).
+    /// The once-per-frame handoff with the completion queue thread (which gets started on the first call):
+    /// Applies all tree changes received since the last call and publishes the changes made in the game since then.
+    /// Never blocks: the sending and receiving itself happens on the completion queue thread.
     void process_queue();
 
     /// This is used during the startup, we process_queue() until we receive a special event.
     /// After 10 seconds of not receiving this event it throws a runtime error.
     void block_until_initialized();
 
-    /// Send any variable changes in the core to all clients.
+    /// Identifies what a change message overwrites: the tree index, the SharedList element and the member of it.
+    typedef std::tuple<int64, int64, int64> change_key;
+
+    /// Send any message (e.g. a SharedList insertion or a function call) to all clients, in order.
     /// For broadcasting purpose param excluded_id is given: you don't want to send back a change you just received from a client.
     static void send_msg(const MSG_TYPE &msg, int excluded_id = -1)
     {
-        for(clienthandler &ci: clients)
+        // shared var changes from before this message must not arrive after it
+        flush_shared_vars();
+        pending_changes.push_back(pending_change{std::make_shared<const MSG_TYPE>(msg), excluded_id});
+        // later changes must not be merged into a slot in front of this message
+        pending_index.clear();
+    }
+
+    /// Send a new value of a tree node to all clients at the end of the tick.
+    /// Only the last value per key within one tick gets sent, so game code hammering on shared vars
+    /// (scores, positions..) produces one message per tick instead of one per assignment.
+    static void send_change(const MSG_TYPE &msg, const change_key &key)
+    {
+        auto slot = pending_index.find(key);
+        if(slot == pending_index.end())
         {
-            if(ci.id != excluded_id) ci.write(msg);
+            pending_index[key] = pending_changes.size();
+            pending_changes.push_back(pending_change{std::make_shared<const MSG_TYPE>(msg), -1});
         }
+        else pending_changes[slot->second].msg = std::make_shared<const MSG_TYPE>(msg);
     }
 
+    static void send_change(const MSG_TYPE &msg) { send_change(msg, change_key(msg.key_case(), 0, 0)); }
+
+    /// The whole tree in one message: a versioned container of the serialized messages collect_tree_events() gives.
+    ///
+    /// Layout of the tree_snapshot bytes (varints are protobuf style base 128):
+    ///   "ITSN" | uint32 version (little endian) | varint count | { varint length, serialized MSG_TYPE }[count]
+    static MSG_TYPE make_snapshot();
+
+    /// Apply a snapshot made by make_snapshot() (on either side), false if it is not one we understand.
+    bool apply_snapshot(const std::string &data);
+
 
 private:
 
+    struct pending_change
+    {
+        std::shared_ptr<const MSG_TYPE> msg;
+        int excluded_id;
+        /// Changes received from a client are held for clients still waiting for their snapshot
+        /// (it may have been taken before the change was applied), the game's own ones are part of the snapshot.
+        bool broadcast = false;
+        /// A snapshot is for one client only.
+        int target_id = -1;
+        unsigned target_generation = 0;
+        /// A change received from a client: its number in received_changes.
+        /// A snapshot: how many of the received changes the game thread had applied when taking it.
+        uint64_t sequence = 0;
+    };
+
+    /// The messages of this tick, in order.
+    static std::vector<pending_change> pending_changes;
+
+    /// Where in pending_changes the last value for a key can still be replaced.
+    static std::map<change_key, size_t> pending_index;
+
+    /// Services the completion queue, see run_queue().
+    std::thread queue_thread;
+
+    /// Tree changes the queue thread received, for the game thread to apply.
+    util::SpscQueue<MSG_TYPE> received_changes{RPC_HANDOFF_SIZE};
+    /// How many changes the queue thread pushed into received_changes.
+    uint64_t received_count = 0;
+    /// How many changes the game thread applied from received_changes, so they are numbered the same on both ends.
+    uint64_t applied_count = 0;
+
+    /// Messages the game thread published, for the queue thread to send.
+    util::SpscQueue<pending_change> published_changes{RPC_HANDOFF_SIZE};
+
+    /// Newly connected clients (id and generation), for the game thread to make a snapshot for.
+    util::SpscQueue<std::pair<int, unsigned>> snapshot_requests{MAX_RPC_CLIENTS};
+
+    /// Game thread: queue snapshots for the clients which asked for one.
+    void publish_snapshots();
+
+    /// Whether a wakeup alarm is in the completion queue already.
+    std::atomic<bool> wakeup_pending{false};
+    /// The last wakeup alarm, only touched by the game thread.
+    std::unique_ptr<grpc::Alarm> wakeup_alarm;
+
+    std::atomic<bool> stopping{false};
+
+    /// Whether a client's read stalled, the game thread wakes us once it took changes out of received_changes.
+    std::atomic<bool> reads_stalled{false};
+
+    /// Queue thread: hand the stalled reads to the game thread, as far as it has room for them now.
+    void resume_stalled_reads();
+
+    /// Queue thread: pass a message read from a client on to the other clients and read the next one.
+    void finish_read(clienthandler &ci, bool broadcast);
+
+    /// The completion queue thread: handles all GRPC events and owns the client table.
+    void run_queue();
+
+    /// Make the queue thread return from waiting on the completion queue.
+    void wake_queue_thread();
+
+    /// Game thread: hand the messages of this tick over to the queue thread.
+    void publish_changes();
+
+    /// Queue thread: hand published messages over to the clients' write queues.
+    void take_published_changes();
+
+    /// Queue thread: add a message to the write queue of all clients but the excluded one.
+    void write_to_clients(const pending_change &change);
+
     void open_connect_slot();
     void handle_new_connection();
 
     void request_disconnect_client(int id);
-    void finish_disconnect_client(int id);
+    void finish_disconnect_client(const callback_event &event);
 
-    clienthandler *get_client(int id)
+    /// The client an event was meant for, nullptr if it meanwhile disconnected.
+    clienthandler *get_client(const callback_event &event)
     {
-        for(clienthandler &ci : clients)
-            if(ci.id == id) return &ci;
-        return nullptr;
+        if(event.client_id < 0 || event.client_id >= MAX_RPC_CLIENTS) return nullptr;
+        clienthandler &ci = clients[event.client_id];
+        return ci.active && (ci.generation & 0xFFFF) == event.generation ? &ci : nullptr;
     }
 
-    bool any_writes_outstanding();
-
     void kickoff_writes();
 
-    void handle_queue_event(callback_event *encoded_callback, bool broadcast, std::function<void(const MSG_TYPE &)> receive_handler);
+    /// @param receive_handler takes a message read from a client, false if there's no room for it yet.
+    void handle_queue_event(const callback_event &event, bool broadcast, std::function<bool(const MSG_TYPE &)> receive_handler);
 
     int pick_unused_id();
     bool change_variable(const MSG_TYPE &receivedval);
@@ -186,26 +349,61 @@ private:
 
 
 
-/// The GRPC queue signals finished events with void* callbacks.
-/// So we compress the needed info (EVENT_TYPE and the clients id) into one integer and cast it to void*.
+template<typename MSG_TYPE, typename U>
+std::vector<typename RpcServer<MSG_TYPE, U>::pending_change> RpcServer<MSG_TYPE, U>::pending_changes;
 
+template<typename MSG_TYPE, typename U>
+std::map<typename RpcServer<MSG_TYPE, U>::change_key, size_t> RpcServer<MSG_TYPE, U>::pending_index;
 
 
+template<typename MSG_TYPE, typename U> inline
+void RpcServer<MSG_TYPE, U>::clienthandler::connect(int id_, std::unique_ptr<stream_type> &&stream_)
+{
+    id = id_;
+    stream = std::move(stream_);
+    generation++;
+    active = true;
+}
+
+template<typename MSG_TYPE, typename U> inline
+void RpcServer<MSG_TYPE, U>::clienthandler::release()
+{
+    active = false;
+    writer_busy = false;
+    awaiting_snapshot = false;
+    read_stalled = false;
+    outstanding_writes.clear();
+    held_changes.clear();
+    stream = nullptr;
+}
+
 template<typename MSG_TYPE, typename U> inline
 void RpcServer<MSG_TYPE, U>::clienthandler::request_read()
 {
-    const void *cq_id = encode_signal(EVENT_TYPE::E_READ, id);
+    const void *cq_id = encode_signal(EVENT_TYPE::E_READ, id, generation);
     stream->Read(&read_buffer, (void *)cq_id);
 }
 
+template<typename MSG_TYPE, typename U> inline
+void RpcServer<MSG_TYPE, U>::clienthandler::send_snapshot(const std::shared_ptr<const MSG_TYPE> &snapshot, uint64_t applied)
+{
+    write(snapshot);
+    for(auto &held : held_changes) if(held.first >= applied) write(held.second);
+    held_changes.clear();
+    awaiting_snapshot = false;
+}
+
 template<typename MSG_TYPE, typename U> inline
 void RpcServer<MSG_TYPE, U>::clienthandler::request_send_one()
 {
-    if(writer_busy || has_writes()) return;
+    if(writer_busy || awaiting_snapshot || !has_writes()) return;
     writer_busy = true;
-    const void* cq_id = encode_signal(EVENT_TYPE::E_WRITE, id);
-    stream->Write(outstanding_writes.front(), (void *)cq_id);
-    outstanding_writes.pop();
+    const void* cq_id = encode_signal(EVENT_TYPE::E_WRITE, id, generation);
+    // let GRPC pack the messages of one tick into as few network writes as possible: only the last one flushes.
+    grpc::WriteOptions options;
+    if(outstanding_writes.size() > 1) options.set_buffer_hint();
+    stream->Write(*outstanding_writes.front(), options, (void *)cq_id);
+    outstanding_writes.pop_front();
 }
 
 template<typename MSG_TYPE, typename U> inline
@@ -218,7 +416,7 @@ void RpcServer<MSG_TYPE, U>::clienthandler::finished_send_one()
 template<typename MSG_TYPE, typename U> inline
 void RpcServer<MSG_TYPE, U>::clienthandler::request_disconnect()
 {
-    const void* cq_id = encode_signal(E_DISCONNECT, id);
+    const void* cq_id = encode_signal(E_DISCONNECT, id, generation);
     stream->Finish(disconnect_status, (void *)cq_id);
 }
 
@@ -233,6 +431,8 @@ void RpcServer<MSG_TYPE, U>::clienthandler::finished_disconnect()
 template<typename MSG_TYPE, typename U> inline
 RpcServer<MSG_TYPE, U>::RpcServer(const char *address) : server_address(address)
 {
+    for(int id = MAX_RPC_CLIENTS - 1; id >= 0; id--) free_ids.push_back(id);
+
     grpc::ServerBuilder builder;
     builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
     builder.RegisterService(&service);
@@ -246,10 +446,17 @@ template<typename MSG_TYPE, typename U> inline
 RpcServer<MSG_TYPE, U>::~RpcServer()
 {
 	// TODO we should also receive whether disconnect was successfully
-    for(auto &client : clients) client.request_disconnect();
-    grpc_server->Shutdown();
+    if(queue_thread.joinable())
+    {
+        stopping = true;
+        wake_queue_thread(); // the clients are owned by the queue thread, it disconnects them.
+    }
+    else for(auto &client : clients) if(client.active) client.request_disconnect();
+    // give the disconnects a moment to go out, then cancel whatever is left.
+    grpc_server->Shutdown(std::chrono::system_clock::now() + std::chrono::seconds(1));
     // Always shutdown the completion queue after the server.
     cq->Shutdown();
+    if(queue_thread.joinable()) queue_thread.join();
 }
 
 template<typename MSG_TYPE, typename U> inline
@@ -265,83 +472,255 @@ void RpcServer<MSG_TYPE, U>::handle_new_connection()
     int n_id = pick_unused_id();
     spdlog::get("global")->info("RPC Server: New client connected id {}", n_id);
 
-    clients.push_back(clienthandler(n_id, std::move(connect_slot)));
-    clients.back().request_read();
+    clienthandler &client = clients[n_id];
+    client.connect(n_id, std::move(connect_slot));
+    client.request_read();
+    // the game thread sends it the whole tree, followed by the changes as usual
+    client.awaiting_snapshot = snapshot_requests.push(std::make_pair(n_id, client.generation));
+    if(!client.awaiting_snapshot)
+    {
+        // without the snapshot it would only ever see parts of the tree
+        spdlog::get("global")->error("RPC Server: no room to request a tree snapshot for client {}, disconnecting it", n_id);
+        request_disconnect_client(n_id);
+    }
 
     connect_slot = nullptr;
-    if(clients.size() < MAX_RPC_CLIENTS) open_connect_slot();
-
-    // TODO: we should send those only to the newly connected client.
-    //send_all_vars();
+    if(!free_ids.empty()) open_connect_slot();
 }
 
 template<typename MSG_TYPE, typename U> inline
 void RpcServer<MSG_TYPE, U>::request_disconnect_client(int id)
 {
-    clienthandler *client = get_client(id);
-    if(client) client->request_disconnect();
+    if(id >= 0 && id < MAX_RPC_CLIENTS && clients[id].active) clients[id].request_disconnect();
 }
 
 template<typename MSG_TYPE, typename U> inline
-void RpcServer<MSG_TYPE, U>::finish_disconnect_client(int id)
+void RpcServer<MSG_TYPE, U>::finish_disconnect_client(const callback_event &event)
 {
-    for(auto ci = clients.begin(); ci != clients.end(); ++ci)
-        if(ci->id == id)
-        {
-            ci->finished_disconnect();
-            clients.erase(ci);
-        }
+    clienthandler *ci = get_client(event);
+    if(!ci) return;
+    ci->finished_disconnect();
+    ci->release();
+    free_ids.push_back(ci->id);
     if(!connect_slot) open_connect_slot(); // a slot just became free.
 }
 
 template<typename MSG_TYPE, typename U> inline
-bool RpcServer<MSG_TYPE, U>::any_writes_outstanding()
+void RpcServer<MSG_TYPE, U>::write_to_clients(const pending_change &change)
 {
-    for(clienthandler &client : clients)
-        if(client.has_writes() || client.currently_writing())
-            return true;
-    return false;
+    if(change.target_id >= 0)
+    {
+        clienthandler *ci = get_client(callback_event{E_WRITE, change.target_id, change.target_generation & 0xFFFF});
+        if(!ci || !ci->awaiting_snapshot) return;
+        ci->send_snapshot(change.msg, change.sequence);
+        return;
+    }
+    for(clienthandler &ci : clients)
+    {
+        if(!ci.active || ci.id == change.excluded_id) continue;
+        if(!ci.awaiting_snapshot) ci.write(change.msg);
+        else if(change.broadcast) ci.hold(change.sequence, change.msg);
+    }
 }
 
 template<typename MSG_TYPE, typename U> inline
-void RpcServer<MSG_TYPE, U>::kickoff_writes()
+void RpcServer<MSG_TYPE, U>::publish_snapshots()
 {
-    for(clienthandler &client : clients)
-        client.request_send_one();
+    std::shared_ptr<const MSG_TYPE> snapshot;
+    std::pair<int, unsigned> request;
+    while(snapshot_requests.pop(request))
+    {
+        if(!snapshot) snapshot = std::make_shared<const MSG_TYPE>(make_snapshot());
+        pending_change change{snapshot, -1};
+        change.target_id = request.first;
+        change.target_generation = request.second;
+        change.sequence = applied_count;
+        pending_changes.push_back(change);
+    }
+}
+
+namespace snapshot_detail {
+
+inline void put_varint(std::string &out, uint64_t v)
+{
+    for(; v >= 0x80; v >>= 7) out.push_back(char((v & 0x7F) | 0x80));
+    out.push_back(char(v));
+}
+
+inline bool get_varint(const std::string &in, size_t &pos, uint64_t &v)
+{
+    v = 0;
+    for(int shift = 0; pos < in.size() && shift < 64; shift += 7)
+    {
+        unsigned char c = in[pos++];
+        v |= uint64_t(c & 0x7F) << shift;
+        if(!(c & 0x80)) return true;
+    }
+    return false;
 }
 
+} // namespace snapshot_detail
+
 template<typename MSG_TYPE, typename U> inline
-void RpcServer<MSG_TYPE, U>::process_queue()
+MSG_TYPE RpcServer<MSG_TYPE, U>::make_snapshot()
 {
-    kickoff_writes();
+    std::vector<MSG_TYPE> events;
+    collect_tree_events<MSG_TYPE>(events);
+
+    std::string data("ITSN");
+    for(int i = 0; i < 4; i++) data.push_back(char((RPC_SNAPSHOT_VERSION >> (8*i)) & 0xFF));
+    snapshot_detail::put_varint(data, events.size());
+    std::string serialized;
+    for(const MSG_TYPE &event : events)
+    {
+        event.SerializeToString(&serialized);
+        snapshot_detail::put_varint(data, serialized.size());
+        data += serialized;
+    }
 
-    using grpc::CompletionQueue;
+    MSG_TYPE snapshot;
+    snapshot.set_tree_snapshot(std::move(data));
+    return snapshot;
+}
 
-    for(int i = 0; i < MAX_RPC_EVENT_CHECKS_PER_TICK; i++)
+template<typename MSG_TYPE, typename U> inline
+bool RpcServer<MSG_TYPE, U>::apply_snapshot(const std::string &data)
+{
+    if(data.size() < 8 || data.compare(0, 4, "ITSN")) return false;
+    unsigned version = 0;
+    for(int i = 0; i < 4; i++) version |= unsigned((unsigned char)data[4+i]) << (8*i);
+    if(version != RPC_SNAPSHOT_VERSION)
     {
-        callback_event *callback_value;
-        bool no_internal_grpc_error = false;
+        spdlog::get("global")->error("RPC: tree snapshot has version {}, we only know {}", version, RPC_SNAPSHOT_VERSION);
+        return false;
+    }
+    size_t pos = 8;
+    uint64_t count, len;
+    if(!snapshot_detail::get_varint(data, pos, count)) return false;
 
-        // read the next event from the completion queue (in nonblocking fashion)
-        // TODO: adapt blocking time to the time budget and whether or not writes are outstanding
-        CompletionQueue::NextStatus stat = cq->AsyncNext((void **)(&callback_value), &no_internal_grpc_error, gpr_inf_past(GPR_CLOCK_REALTIME));
+    // parse everything first, a broken snapshot must leave the tree as it is
+    std::vector<MSG_TYPE> events;
+    for(uint64_t i = 0; i < count; i++)
+    {
+        MSG_TYPE event;
+        if(!snapshot_detail::get_varint(data, pos, len) || len > data.size() - pos || !event.ParseFromArray(data.data() + pos, int(len))) return false;
+        pos += len;
+        events.push_back(std::move(event));
+    }
 
-        //if(!) break;// throw std::runtime_error("GRPC had an internal error: Shutting down.");
+    clear_tree_lists<MSG_TYPE>();
+    for(const MSG_TYPE &event : events) change_variable(event);
+    return true;
+}
 
-        if(no_internal_grpc_error && stat == CompletionQueue::NextStatus::GOT_EVENT)
-            handle_queue_event(callback_value, true, [=](const MSG_TYPE &msg) {
-                    this->change_variable(msg);
-                });
-        else if(stat == CompletionQueue::NextStatus::TIMEOUT)
-        {
-            if(!any_writes_outstanding()) break;
-        }
-        else if(stat == CompletionQueue::NextStatus::SHUTDOWN)
+template<typename MSG_TYPE, typename U> inline
+void RpcServer<MSG_TYPE, U>::publish_changes()
+{
+    size_t published = 0;
+    while(published < pending_changes.size() && published_changes.push(pending_changes[published])) published++;
+    if(!published) return;
+    // if the queue thread is that far behind, the rest waits for the next tick
+    pending_changes.erase(pending_changes.begin(), pending_changes.begin() + published);
+    pending_index.clear();
+    wake_queue_thread();
+}
+
+template<typename MSG_TYPE, typename U> inline
+void RpcServer<MSG_TYPE, U>::take_published_changes()
+{
+    pending_change change;
+    while(published_changes.pop(change)) write_to_clients(change);
+}
+
+template<typename MSG_TYPE, typename U> inline
+void RpcServer<MSG_TYPE, U>::wake_queue_thread()
+{
+    if(wakeup_pending.exchange(true)) return; // the pending one will do
+    // an alarm which is already due fires right away; the previous one has fired already, since wakeup_pending was reset.
+    wakeup_alarm.reset(new grpc::Alarm(cq.get(), gpr_inf_past(GPR_CLOCK_REALTIME), encode_signal(E_WAKEUP, -1)));
+}
+
+template<typename MSG_TYPE, typename U> inline
+void RpcServer<MSG_TYPE, U>::run_queue()
+{
+    void *tag;
+    bool no_internal_grpc_error = false;
+    // returns false once the queue is shut down and drained.
+    while(cq->Next(&tag, &no_internal_grpc_error))
+    {
+        callback_event event = decode_signal(tag);
+        if(event.type == E_WAKEUP)
         {
-            std::string error_message("[GRPC Server] Completion Queue Shutdown status received..");
-            throw std::runtime_error(error_message);
+            wakeup_pending = false; // before taking the changes, so none published meanwhile can be missed
+            if(stopping) for(auto &client : clients) if(client.active) client.request_disconnect();
         }
+        else if(no_internal_grpc_error) handle_queue_event(event, true, [this](const MSG_TYPE &msg) {
+                // if the game thread is that far behind, the client waits for it rather than dropping changes
+                if(!received_changes.push(msg)) return false;
+                received_count++;
+                return true;
+            });
+        resume_stalled_reads();
+        take_published_changes();
+        kickoff_writes();
+    }
+}
+
+template<typename MSG_TYPE, typename U> inline
+void RpcServer<MSG_TYPE, U>::resume_stalled_reads()
+{
+    if(!reads_stalled) return;
+    for(clienthandler &client : clients)
+    {
+        if(!client.active || !client.read_stalled) continue;
+        // still full: the flag stays set, so the game thread wakes us once it made room
+        if(!received_changes.push(client.get_read_result())) return;
+        received_count++;
+        client.read_stalled = false;
+        finish_read(client, true);
+    }
+    reads_stalled = false;
+}
+
+template<typename MSG_TYPE, typename U> inline
+void RpcServer<MSG_TYPE, U>::finish_read(clienthandler &ci, bool broadcast)
+{
+    // the message has to be copied out of the read buffer before the next read overwrites it
+    if(broadcast)
+    {
+        //broadcast changes from one client to other clients.
+        pending_change change{std::make_shared<const MSG_TYPE>(ci.get_read_result()), ci.id, true};
+        change.sequence = received_count - 1;
+        write_to_clients(change);
+    }
+    ci.request_read();
+}
+
+template<typename MSG_TYPE, typename U> inline
+void RpcServer<MSG_TYPE, U>::kickoff_writes()
+{
+    for(clienthandler &client : clients)
+        if(client.active) client.request_send_one();
+}
+
+template<typename MSG_TYPE, typename U> inline
+void RpcServer<MSG_TYPE, U>::process_queue()
+{
+    if(!queue_thread.joinable()) queue_thread = std::thread([this] { run_queue(); });
+
+    // only what arrived before this frame's handoff, so a flood can't keep us here
+    MSG_TYPE msg;
+    for(size_t n = received_changes.size(); n > 0 && received_changes.pop(msg); n--)
+    {
+        change_variable(msg);
+        applied_count++;
     }
+    // there's room again for the clients we stopped reading from
+    if(reads_stalled) wake_queue_thread();
+
+    flush_shared_vars();
+    publish_snapshots();
+    publish_changes();
 }
 
 template<typename MSG_TYPE, typename ASYNC_SERVICE_TYPE>
@@ -357,20 +736,23 @@ inline void RpcServer<MSG_TYPE, ASYNC_SERVICE_TYPE>::block_until_initialized()
     auto time_start = steady_clock::now();
     while(initialized != true)
     {
-        callback_event *callback_value;
+        void *tag;
         bool no_internal_grpc_error = false;
-        bool regularEvent = cq->Next((void **)(&callback_value), &no_internal_grpc_error);
+        bool regularEvent = cq->Next(&tag, &no_internal_grpc_error);
         if(no_internal_grpc_error && regularEvent)
         {
-            handle_queue_event(callback_value, false, [&](const MSG_TYPE &msg) {
+            handle_queue_event(decode_signal(tag), false, [&](const MSG_TYPE &msg) {
                 int64 index = msg.key_case();
                 // FINISHED_TREE_INTRO_SEND
                 if(msg.general_event() == 1)
                 {
                     initialized = true;
-                    return;
+                    return true;
                 }
                 this->change_variable(msg);
+                // a snapshot is the whole tree in one go
+                if(index == MSG_TYPE::kTreeSnapshot) initialized = true;
+                return true;
             });
         }
         else if(!regularEvent)
@@ -382,24 +764,28 @@ inline void RpcServer<MSG_TYPE, ASYNC_SERVICE_TYPE>::block_until_initialized()
 }
 
 template<typename MSG_TYPE, typename U> inline
-void RpcServer<MSG_TYPE, U>::handle_queue_event(callback_event *encoded_callback, bool broadcast, std::function<void(const MSG_TYPE &)> receive_handler)
+void RpcServer<MSG_TYPE, U>::handle_queue_event(const callback_event &event, bool broadcast, std::function<bool(const MSG_TYPE &)> receive_handler)
 {
-    switch(encoded_callback->type)
+    switch(event.type)
     {
     case E_READ:
     {
-        clienthandler *ci = get_client(encoded_callback->client_id);
+        clienthandler *ci = get_client(event);
         if(!ci) break; // TODO we should better process its last messages, but we dont have the clients read_buffer anymore.
 
-        const MSG_TYPE msg = ci->get_read_result();
-        ci->request_read();
-        receive_handler(msg);
-        if(broadcast) send_msg(msg, ci->id); //broadcast changes from one client to other clients.
+        if(!receive_handler(ci->get_read_result()))
+        {
+            // no new read for now: GRPC's flow control holds the client back, see resume_stalled_reads()
+            ci->read_stalled = true;
+            reads_stalled = true;
+            break;
+        }
+        finish_read(*ci, broadcast);
         break;
     }
     case E_WRITE:
     {
-        clienthandler *ci = get_client(encoded_callback->client_id);
+        clienthandler *ci = get_client(event);
         if(!ci) break;
         ci->finished_send_one();
         break;
@@ -408,28 +794,22 @@ void RpcServer<MSG_TYPE, U>::handle_queue_event(callback_event *encoded_callback
         handle_new_connection();
         break;
     case E_DISCONNECT:
-        finish_disconnect_client(encoded_callback->client_id);
+        finish_disconnect_client(event);
         break;
     }
-    delete encoded_callback;
 }
 
 template<typename T, typename U>
-int RpcServer<T, U>::pick_unused_id() // TODO get some uuid thing here.
+int RpcServer<T, U>::pick_unused_id()
 {
-    for(int id_try = 0; id_try < INT_MAX; id_try++)
+    if(free_ids.empty())
     {
-        bool hasid = false;
-        for(auto &ci: clients)
-            if(ci.id == id_try)
-            {
-                hasid = true; break;
-            }
-        if(!hasid) return id_try;
+        std::string error_message("grpc system: no client id could be generated.");
+        throw std::runtime_error(error_message);
     }
-    std::string error_message("grpc system: no client id could be generated.");
-    throw std::runtime_error(error_message);
-    return -1;
+    int id = free_ids.back();
+    free_ids.pop_back();
+    return id;
 }
 
 template<typename MSG_TYPE, typename U> inline
@@ -443,6 +823,13 @@ bool RpcServer<MSG_TYPE, U>::change_variable(const MSG_TYPE &receivedval)
         return false;
     }
 
+    if(index == MSG_TYPE::kTreeSnapshot)
+    {
+        if(apply_snapshot(receivedval.tree_snapshot())) return true;
+        spdlog::get("global")->error("network: received a broken tree snapshot");
+        return false;
+    }
+
     if(!handle_index<MSG_TYPE>(index, receivedval))
     {
         spdlog::get("global")->info("network: received non-supported index: {0}", index); // -> to debug
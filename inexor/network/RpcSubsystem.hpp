@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstring>
 #include <memory>
 #include <queue>
 
@@ -15,7 +16,9 @@ namespace rpc {
 
 // These functions need to be implemented by the Context Provider (acquiring this submodule):
 extern void set_on_change_functions();
-extern void send_all_vars();
+#ifdef RPC_BENCHMARK
+extern void benchmarkrpc(std::string port, int numclients, int seconds);
+#endif
 extern const std::unordered_map<int64, void *> cppvar_pointer_map;
 extern const std::unordered_map<int64, int> index_to_type_map;
 
@@ -40,6 +43,9 @@ public:
         serv = new RpcServer<MSG_TYPE, ASYNC_SERVICE_TYPE>(full_address.c_str());
         spdlog::get("global")->info("RPC server listening on {0}", serv->server_address);
         set_on_change_functions();
+#ifdef RPC_BENCHMARK
+        for(int i = 2; i < argc; i++) if(!strcmp(argv[i], "--benchmark-rpc")) benchmarkrpc(port, MAX_RPC_CLIENTS, 10);
+#endif
         serv->block_until_initialized();
     }
 
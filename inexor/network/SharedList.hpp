@@ -1,6 +1,13 @@
 
 #pragma once
 
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
 #include "inexor/network/SharedOptions.hpp"
 #include "inexor/network/SharedVar.hpp"
 #include "inexor/network/SharedClass.hpp"
@@ -29,46 +36,248 @@ struct InternalSharedListMarker : SharedOption
     const char *is_shared_list = "true";
 };
 
+/// Bound for the size of lists we accept from the other side.
+#define MAX_SHARED_LIST_SIZE 65536
+
+/// A list of SharedClass instances which is kept in sync with the scripting side.
+///
+/// We don't send anything per operation: the list collects what changed during the frame and
+/// reports it at most once per frame (in flush_shared_vars()) as a diff: the old and the new size and
+/// the positions of all elements which are new, have moved or have a modified member.
+/// The bindings send that as the usual added, modified and removed events.
+/// So the sync cost depends on what changed, not on how it got changed:
+/// refilling a scoreboard with assign() yields one message just like modifying a single score does.
+///
+/// Elements are heap allocated and never move in memory, their members report modifications
+/// through the hooks connect_element_func sets up.
 template<typename T>
 struct SharedList : SharedClass
 {
-    int len = 0;
-    std::function<void(int, T &)> element_pushed_back_func;
-    std::function<void(int)> element_removed_func;
-    std::vector<T> container;
+    /// Called once per frame with the size the other side knows, the new size and the (ascending) positions of all changed elements.
+    std::function<void(size_t, size_t, const std::vector<size_t> &)> changed_func;
+
+    /// Called for every new element: connect touch to all its members.
+    std::function<void(T &, std::function<void()>)> connect_element_func;
 
     SharedList() : SharedClass(InternalSharedListMarker()) {}
+    SharedList(const SharedList &) = delete;
+
+    ~SharedList()
+    {
+        if(dirty_slot >= 0) inexor::rpc::detail::dirty_vars()[dirty_slot].var = nullptr;
+    }
+
+    void push_back(T &&s) { emplace(entries.size(), std::move(s)); }
+    void push_back(const T &s) { emplace(entries.size(), s); }
+
+    template<typename... Args>
+    void emplace_back(Args&&... args) { emplace(entries.size(), std::forward<Args>(args)...); }
 
-    void push_back(T &&s)
+    void insert(size_t pos, const T &s)
     {
-        int id = ++len;
-        container.push_back(std::move(s));
-        element_pushed_back_func(id, container.back());
+        if(pos > entries.size()) return;
+        emplace(pos, s);
     }
 
-    void push_back(const T &s)
+    template<typename It>
+    void insert_range(size_t pos, It first, It last)
     {
-        int id = ++len;
-        container.push_back(s);
-        element_pushed_back_func(id, container.back());
+        if(pos > entries.size()) return;
+        std::vector<std::unique_ptr<entry>> added;
+        for(; first != last; ++first) added.push_back(make_entry(pos + added.size(), *first));
+        if(added.empty()) return;
+        entries.insert(entries.begin() + pos, std::make_move_iterator(added.begin()), std::make_move_iterator(added.end()));
+        structure_changed(pos);
+    }
+
+    /// Replace all elements.
+    template<typename It>
+    void assign(It first, It last)
+    {
+        erase_range(0, entries.size());
+        insert_range(0, first, last);
     }
-    // fehlt: emplace emplace back assign, insert, swap
 
     void erase(int i)
     {
-        if(i >= container.size() || i < 0) return;
-        container.erase(container.begin() + i);
-        element_removed_func(i);
+        if(i < 0) return;
+        erase_range(i, i + 1);
+    }
+
+    /// Remove the elements [first, last).
+    void erase_range(size_t first, size_t last)
+    {
+        last = std::min(last, entries.size());
+        if(first >= last) return;
+        for(size_t i = first; i < last; i++) forget(*entries[i]);
+        entries.erase(entries.begin() + first, entries.begin() + last);
+        structure_changed(first);
+    }
+
+    void clear() { erase_range(0, entries.size()); }
+
+    /// Exchange two elements, only those two get sent.
+    void swap(size_t a, size_t b)
+    {
+        if(a == b || a >= entries.size() || b >= entries.size()) return;
+        std::swap(entries[a], entries[b]);
+        entries[a]->index = a;
+        entries[b]->index = b;
+        touch(*entries[a]);
+        touch(*entries[b]);
     }
 
     T& operator[](size_t n)
     {
-        return container[n];
+        return entries[n]->value;
     }
 
     size_t size()
     {
-        return container.size();
+        return entries.size();
     }
-};
 
+    bool empty() { return entries.empty(); }
+
+    // Changes received from the other side: apply them without reporting them back.
+
+    void resize_nosync(size_t n)
+    {
+        for(size_t i = n; i < entries.size(); i++) forget(*entries[i]);
+        if(n < entries.size()) entries.resize(n);
+        while(entries.size() < n) entries.push_back(make_entry(entries.size()));
+        synced_size = entries.size();
+    }
+
+    void erase_nosync(size_t i)
+    {
+        if(i >= entries.size()) return;
+        forget(*entries[i]);
+        entries.erase(entries.begin() + i);
+        for(size_t j = i; j < entries.size(); j++) entries[j]->index = j;
+        if(structure_from != npos && structure_from > i) structure_from--;
+        synced_size = entries.size();
+    }
+
+    void clear_nosync() { resize_nosync(0); }
+
+private:
+    struct entry
+    {
+        T value;
+        /// Identifies the element for its member hooks: those get copied along with the members.
+        unsigned key;
+        /// The position at the last flush (or when inserted), only up to date below structure_from.
+        size_t index;
+        bool touched = false;
+        /// Where it is in touched, while it is.
+        size_t touched_slot = 0;
+
+        template<typename... Args>
+        entry(unsigned key, size_t index, Args&&... args) : value(std::forward<Args>(args)...), key(key), index(index) {}
+    };
+
+    static const size_t npos = size_t(-1);
+
+    std::vector<std::unique_ptr<entry>> entries;
+    std::unordered_map<unsigned, entry *> by_key;
+    unsigned next_key = 0;
+
+    /// Elements with a modified member.
+    std::vector<entry *> touched;
+    /// Everything from here on got inserted, removed or moved.
+    size_t structure_from = npos;
+    /// The size the other side knows.
+    size_t synced_size = 0;
+    /// Our entry in detail::dirty_vars(), -1 if we are not in there.
+    int dirty_slot = -1;
+    std::vector<size_t> changed;
+
+    template<typename... Args>
+    std::unique_ptr<entry> make_entry(size_t index, Args&&... args)
+    {
+        unsigned key = next_key++;
+        std::unique_ptr<entry> e(new entry(key, index, std::forward<Args>(args)...));
+        by_key[key] = e.get();
+        if(connect_element_func) connect_element_func(e->value, [this, key]
+        {
+            auto it = by_key.find(key);
+            if(it != by_key.end()) touch(*it->second);
+        });
+        return e;
+    }
+
+    template<typename... Args>
+    void emplace(size_t pos, Args&&... args)
+    {
+        entries.insert(entries.begin() + pos, make_entry(pos, std::forward<Args>(args)...));
+        structure_changed(pos);
+    }
+
+    /// Drop an element which is about to be destroyed from the bookkeeping.
+    void forget(entry &e)
+    {
+        by_key.erase(e.key);
+        if(!e.touched) return;
+        // the last one takes its slot, flush() sorts them anyway
+        entry *last = touched.back();
+        touched[e.touched_slot] = last;
+        last->touched_slot = e.touched_slot;
+        touched.pop_back();
+    }
+
+    void structure_changed(size_t pos)
+    {
+        structure_from = std::min(structure_from, pos);
+        schedule();
+    }
+
+    void touch(entry &e)
+    {
+        if(!e.touched)
+        {
+            e.touched = true;
+            e.touched_slot = touched.size();
+            touched.push_back(&e);
+        }
+        schedule();
+    }
+
+    void schedule()
+    {
+        if(dirty_slot >= 0) return;
+        std::vector<inexor::rpc::detail::dirty_var> &vars = inexor::rpc::detail::dirty_vars();
+        dirty_slot = int(vars.size());
+        vars.push_back(inexor::rpc::detail::dirty_var{this, &SharedList::flush_dirty});
+    }
+
+    static void flush_dirty(void *list)
+    {
+        static_cast<SharedList *>(list)->flush();
+    }
+
+    void flush()
+    {
+        dirty_slot = -1;
+        changed.clear();
+        for(entry *e : touched)
+        {
+            // the ones behind structure_from get sent anyway
+            if(e->index < structure_from) changed.push_back(e->index);
+            e->touched = false;
+        }
+        touched.clear();
+        std::sort(changed.begin(), changed.end());
+        for(size_t i = structure_from; i < entries.size(); i++)
+        {
+            entries[i]->index = i;
+            changed.push_back(i);
+        }
+        structure_from = npos;
+
+        if(changed.empty() && synced_size == entries.size()) return;
+        size_t oldsize = synced_size;
+        synced_size = entries.size();
+        if(changed_func) changed_func(oldsize, entries.size(), changed);
+    }
+};
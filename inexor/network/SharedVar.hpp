@@ -1,13 +1,84 @@
 #pragma once
 
 #include <algorithm>
-
-#include <boost/signals2.hpp>
+#include <functional>
+#include <vector>
 
 #include "inexor/network/SharedOptions.hpp"
 namespace inexor {
 namespace rpc {
 
+namespace detail {
+
+/// A SharedVar with deferred listeners (or a SharedList) which has been changed this frame.
+struct dirty_var
+{
+    void *var;
+    void (*flush)(void *var);
+};
+
+inline std::vector<dirty_var> &dirty_vars()
+{
+    static std::vector<dirty_var> vars;
+    return vars;
+}
+
+} // ns detail
+
+/// Call the deferred listeners of all SharedVars changed since the last call, once per var.
+/// Done by the RPC server at the start of its frame.
+inline void flush_shared_vars()
+{
+    std::vector<detail::dirty_var> &vars = detail::dirty_vars();
+    // listeners may dirty further vars: those are appended and flushed in this same pass
+    for(size_t i = 0; i < vars.size(); i++)
+    {
+        detail::dirty_var d = vars[i];
+        vars[i].var = nullptr; // a listener sending a message flushes as well
+        if(d.var) d.flush(d.var);
+    }
+    vars.clear();
+}
+
+/// The default observer of a SharedVar: a list of listeners, called on the game thread.
+///
+/// Immediate listeners get called on every assignment with the old and the new value.
+/// Deferred listeners only get the current value, once per frame in flush_shared_vars(),
+/// no matter how often the var has been assigned to in between.
+///
+/// There is no locking, connection handling or result combining going on (as in boost::signals2),
+/// an assignment to a var without immediate listeners costs a branch (and marking it dirty once per frame).
+///
+/// A var may use its own observer type instead (SharedVar<T, OBSERVER>) with the same interface;
+/// if has_immediate() and has_deferred() are constexpr the compiler drops the unused paths entirely.
+template<typename T>
+class change_signal {
+public:
+    typedef std::function<void(const T&, const T&)> listener;
+    typedef std::function<void(const T&)> deferred_listener;
+
+    void connect(listener l) { immediate.push_back(std::move(l)); }
+
+    void connect_deferred(deferred_listener l) { deferred.push_back(std::move(l)); }
+
+    bool has_immediate() const { return !immediate.empty(); }
+    bool has_deferred() const { return !deferred.empty(); }
+
+    void operator()(const T &oldvalue, const T &newvalue) const
+    {
+        for(const listener &l : immediate) l(oldvalue, newvalue);
+    }
+
+    void flush(const T &value) const
+    {
+        for(const deferred_listener &l : deferred) l(value);
+    }
+
+private:
+    std::vector<listener> immediate;
+    std::vector<deferred_listener> deferred;
+};
+
 /// SharedVar wrapper for primitive/immutable objects
 ///
 /// This first and foremost is a wrapper around stuff.
@@ -23,13 +94,11 @@ namespace rpc {
 /// In these cases, try using the value itself
 /// (`*observ_instance`) or using an explicit cast.
 ///
-/// SharedVar provides a special assignment operator: If
-/// that is called, it first calls the onChange event with
-/// the old and the new value.
-/// Only afterwards the new value is assigned.
-///
-/// The value of the variable inside SharedVar is undefined
-/// while the listeners are called;
+/// SharedVar provides special assignment operators: After
+/// the new value is assigned, they call the immediate
+/// onChange listeners with the old and the new value and
+/// mark the variable dirty for the deferred ones (see
+/// change_signal).
 ///
 /// During the event, do not change the value of the
 /// variable (that would create an recursive event),
@@ -46,20 +115,47 @@ namespace rpc {
 ///     }
 /// );
 ///
+/// // at most once per frame
+/// oi.onChange.connect_deferred([] (const int &v)
+///     {
+///         Log.default->info("the value now is {}", v);
+///     }
+/// );
+///
 /// void main() {
 ///     oi = 33;
 ///     oi += 22;
 /// }
 /// ```
-template<typename T>
+template<typename T, typename OBSERVER = change_signal<T>>
 class SharedVar {
 private:
-    typedef SharedVar<T> TMe;
+    T value;
 
-    template<typename... A>
-    using signal = boost::signals2::signal<A...>;
+    /// Our entry in detail::dirty_vars(), -1 if we are not in there.
+    int dirty_slot = -1;
+
+    static void flush_dirty(void *var)
+    {
+        SharedVar *v = static_cast<SharedVar *>(var);
+        v->dirty_slot = -1;
+        v->onChange.flush(v->value);
+    }
+
+    void mark_dirty()
+    {
+        if(dirty_slot >= 0 || !onChange.has_deferred()) return;
+        std::vector<detail::dirty_var> &vars = detail::dirty_vars();
+        dirty_slot = int(vars.size());
+        vars.push_back(detail::dirty_var{this, &SharedVar::flush_dirty});
+    }
+
+    void changed(const T &old)
+    {
+        onChange(old, value);
+        mark_dirty();
+    }
 
-    T value;
 public:
 
     /// Event that is fired when a new value is assigned;
@@ -68,7 +164,7 @@ public:
     /// modified
     ///
     /// params: old value, new value
-    signal<void(const T&, const T&)> onChange;
+    OBSERVER onChange;
 
     // Access
 
@@ -87,7 +183,11 @@ public:
     explicit SharedVar(Args&&... args, SharedOption)
         : value(std::forward<Args>(args)...) {}
 
-    explicit SharedVar(const SharedVar<T> &otr) : value(otr.value) { onChange.connect(otr.onChange); }
+    /// Copies take the listeners along (SharedList elements get copied around by their vector).
+    explicit SharedVar(const SharedVar &otr) : value(otr.value), onChange(otr.onChange)
+    {
+        if(otr.dirty_slot >= 0) mark_dirty();
+    }
     //explicit SharedVar(T otr) : value(otr) {}
     explicit SharedVar(T &otr) : value(otr) {}
     explicit SharedVar(T &&otr) : value(otr) {}
@@ -95,37 +195,59 @@ public:
     explicit SharedVar(T &otr, SharedOption) : value(otr) {}
     explicit SharedVar(T &&otr, SharedOption) : value(otr) {}
 
+    ~SharedVar()
+    {
+        if(dirty_slot >= 0) detail::dirty_vars()[dirty_slot].var = nullptr;
+    }
+
+    /// Assigns the value only, we keep our own listeners.
+    T operator =(const SharedVar &otr) {
+        return *this = otr.value;
+    }
+
     // Avoid ambiguity when observing a string
     T operator= (const char *c) {
-        T nu(c);
-        onChange(value, nu);
-        return value = nu;
+        return *this = T(c);
     }
 
     T operator =(const T &otr) {
-        onChange(value, otr);
+        if(!onChange.has_immediate())
+        {
+            value = otr;
+            mark_dirty();
+            return value;
+        }
+        T old = value;
         value = otr;
+        changed(old);
         return value;
     }
 
     T operator =(T &&otr) {
-        onChange(value, otr);
+        if(!onChange.has_immediate())
+        {
+            value = std::move(otr);
+            mark_dirty();
+            return value;
+        }
+        T old = std::move(value);
         value = std::move(otr);
+        changed(old);
         return value;
     }
 
     // TODO: Put all the operator macro invocations into
     // own file so we reuse them in the test.
 
-    // TODO: Component assignment operators (+= -= ..)
     // TODO: Performance: return by reference for operators
 
-#define UNR(op)                  \
-    T operator op (int) {        \
-        T old = value;           \
-        T ret = value op;        \
-        onChange(old, value);    \
-        return ret;              \
+    // Without immediate listeners there is no old value to keep around.
+#define UNR(op)                                                     \
+    T operator op (int) {                                           \
+        T old = value;                                              \
+        value op;                                                   \
+        if(onChange.has_immediate()) changed(old); else mark_dirty(); \
+        return old;                                                 \
     }
 
     UNR(++);
@@ -133,12 +255,18 @@ public:
 
 #undef UNR
 
-#define UNL(op)                  \
-    T operator op () {           \
-        T old = value;           \
-        T ret = op value;        \
-        onChange(old, value);    \
-        return ret;              \
+#define UNL(op)                                      \
+    T operator op () {                               \
+        if(!onChange.has_immediate())                \
+        {                                            \
+            op value;                                \
+            mark_dirty();                            \
+            return value;                            \
+        }                                            \
+        T old = value;                               \
+        op value;                                    \
+        changed(old);                                \
+        return value;                                \
     }
 
     UNL(++);
@@ -147,13 +275,19 @@ public:
 #undef UNL
 
 
-#define ASGN(op)                       \
-    template<typename O>               \
-    T operator op ## =(const O &otr) { \
-        T old = value;                 \
-        T ret = value op ## = otr;     \
-        onChange(old, value);          \
-        return ret;                    \
+#define ASGN(op)                                     \
+    template<typename O>                             \
+    T operator op ## =(const O &otr) {               \
+        if(!onChange.has_immediate())                \
+        {                                            \
+            value op ## = otr;                       \
+            mark_dirty();                            \
+            return value;                            \
+        }                                            \
+        T old = value;                               \
+        value op ## = otr;                           \
+        changed(old);                                \
+        return value;                                \
     }
 
     ASGN(+);
@@ -189,14 +323,14 @@ public:
 
     void sync()
     {
-        onChange(value, value);
+        changed(value);
     }
 };
 
 // Output Operator
 
-template<typename T>
-std::ostream& operator<<(std::ostream& os, const SharedVar<T> &x) {
+template<typename T, typename O>
+std::ostream& operator<<(std::ostream& os, const SharedVar<T, O> &x) {
     os << *x;
     return os;
 }
@@ -206,30 +340,30 @@ std::ostream& operator<<(std::ostream& os, const SharedVar<T> &x) {
 // frequent problems)
 // TODO: Get rid of ::min, ::max; define these for std::*
 
-template<typename T>
-const T& min(const inexor::rpc::SharedVar<T> &a, const T &b) {
+template<typename T, typename O>
+const T& min(const inexor::rpc::SharedVar<T, O> &a, const T &b) {
     return std::min(*a, b);
 }
-template<typename T>
-const T& min(const T &a, const inexor::rpc::SharedVar<T> &b) {
+template<typename T, typename O>
+const T& min(const T &a, const inexor::rpc::SharedVar<T, O> &b) {
     return std::min(a, *b);
 }
-template<typename T>
-const T& min(const inexor::rpc::SharedVar<T> &a, const inexor::rpc::SharedVar<T> &b)
+template<typename T, typename O>
+const T& min(const inexor::rpc::SharedVar<T, O> &a, const inexor::rpc::SharedVar<T, O> &b)
 {
     return std::min(*a, *b);
 }
 
-template<typename T>
-const T& max(const inexor::rpc::SharedVar<T> &a, const T &b) {
+template<typename T, typename O>
+const T& max(const inexor::rpc::SharedVar<T, O> &a, const T &b) {
     return std::max(*a, b);
 }
-template<typename T>
-const T& max(const T &a, const inexor::rpc::SharedVar<T> &b) {
+template<typename T, typename O>
+const T& max(const T &a, const inexor::rpc::SharedVar<T, O> &b) {
     return std::max(a, *b);
 }
-template<typename T>
-const T& max(const inexor::rpc::SharedVar<T> &a, const inexor::rpc::SharedVar<T> &b)
+template<typename T, typename O>
+const T& max(const inexor::rpc::SharedVar<T, O> &a, const inexor::rpc::SharedVar<T, O> &b)
 {
     return std::max(*a, *b);
 }
@@ -30,7 +30,6 @@ enum
     CODE_BOOL,
     CODE_BLOCK,
     CODE_COMPILE,
-    CODE_FORCE,
     CODE_RESULT,
     CODE_IDENT, CODE_IDENTU, CODE_IDENTARG,
     CODE_COM, CODE_COMD, CODE_COMC, CODE_COMV,
@@ -74,7 +73,8 @@ enum
 	IDF_READONLY = 1<<3,
 	IDF_OVERRIDDEN = 1<<4,
 	IDF_UNKNOWN = 1<<5,
-	IDF_ARG = 1<<6
+	IDF_ARG = 1<<6,
+	IDF_PURE = 1<<7 // command without side effects, calls with constant arguments get evaluated when compiling
 };
 
 struct ident;
@@ -1,12 +1,16 @@
 // the interface the game uses to access the engine
 
+#include <memory>
+#include <mutex>
+
 #include "inexor/network/SharedTree.hpp"
+#include "inexor/util/TickProfiler.hpp"
 
-extern int curtime;                     // current frame time
-extern int lastmillis;                  // last time
-extern int elapsedtime;                 // elapsed frame time
-extern int totalmillis;                 // total elapsed time
-extern uint totalsecs;
+extern SERVERLOCAL int curtime;         // current frame time
+extern SERVERLOCAL int lastmillis;      // last time
+extern SERVERLOCAL int elapsedtime;     // elapsed frame time
+extern SERVERLOCAL int totalmillis;     // total elapsed time
+extern SERVERLOCAL uint totalsecs;
 extern int gamespeed, paused;
 
 enum
@@ -343,7 +347,51 @@ extern bool save_world(const char *mname, bool nolms = false);
 extern void getmapfilename(const char *fname, const char *cname, char *mapname);
 extern uint getmapcrc();
 extern void clearmapcrc();
-extern bool loadents(const char *fname, vector<entity> &ents, uint *crc = NULL);
+
+/// Read-only map geometry for the dedicated server: only the shapes and materials of the octree,
+/// without textures, surfaces, lightmaps or anything else the renderer builds from them.
+struct collisionmap
+{
+    struct node
+    {
+        uint children;   ///< index of the first of the 8 children, 0 for leaves
+        ushort material;
+        uchar edges[12]; ///< the shape of a leaf, like cube::edges
+    };
+
+    int worldsize = 0;
+    /// nodes[0] is the root, children are stored as 8 consecutive nodes
+    vector<node> nodes;
+
+    void clear() { worldsize = 0; nodes.setsize(0); }
+    bool empty() const { return nodes.empty(); }
+
+    /// Find the leaf containing o, which has to be inside the world.
+    /// @param co set to the leaf's origin
+    /// @param size set to the leaf's size
+    const node &lookup(const ivec &o, ivec &co, int &size) const;
+
+    /// Walk along the (normalized) ray from o until it enters an entirely solid cube.
+    /// @return the distance to that cube, or maxdist if there is none before
+    float raycube(const vec &o, const vec &ray, float maxdist) const;
+};
+
+extern bool loadents(const char *fname, vector<entity> &ents, uint *crc = NULL, collisionmap *geom = NULL);
+
+/// A map as loadents() reads it, shared by all game instances of a dedicated server which play it.
+struct sharedmap
+{
+    bool loaded = false, geometry = false;
+    uint crc = 0;
+    vector<entity> ents;
+    collisionmap geom;
+    std::once_flag loading;
+};
+
+/// Only the first instance asking for a map loads it, the others wait for and share its copy while any of them plays it.
+/// @param geometry whether the geometry is needed as well
+/// @return NULL if the map could not be loaded
+extern std::shared_ptr<const sharedmap> loadsharedmap(const char *fname, bool geometry);
 
 // physics
 extern vec collidewall;
@@ -437,6 +485,7 @@ enum { DISC_NONE = 0, DISC_EOP, DISC_LOCAL, DISC_KICK, DISC_MSGERR, DISC_IPBAN,
 
 extern void *getclientinfo(int i);
 extern ENetPeer *getclientpeer(int i);
+extern int getclientroundtrip(int i);
 extern ENetPacket *sendf(int cn, int chan, const char *format, ...);
 extern ENetPacket *sendfile(int cn, int chan, stream *file, const char *format = "", ...);
 extern void sendpacket(int cn, int chan, ENetPacket *packet, int exclude = -1);
@@ -454,6 +503,12 @@ extern void sendserverinforeply(ucharbuf &p);
 extern bool requestmaster(const char *req);
 extern bool requestmasterf(const char *fmt, ...) PRINTFARGS(1, 2);
 extern bool isdedicatedserver();
+/// The number of the game instance running on this thread, see serverinstances.
+extern int getserverinstance();
+
+/// phases of the server tick measured by the tick profiler
+enum { TICK_NETWORK = 0, TICK_UPDATE, TICK_EVENTS, TICK_AI, TICK_GAMEMODE, TICK_WORLDSTATE, TICK_DEMO, NUMTICKPHASES };
+extern SERVERLOCAL inexor::util::TickProfiler tickprofiler;
 
 // client
 extern void sendclientpacket(ENetPacket *packet, int chan);
@@ -114,6 +114,7 @@ namespace server
     extern void parsepacket(int sender, int chan, packetbuf &p);
     extern void sendservmsg(const char *s);
     extern bool sendpackets(bool force = false);
+    extern void getworldstatestats(int &hits, int &misses);
     extern void serverinforeply(ucharbuf &req, ucharbuf &p);
     extern void serverupdate();
     extern bool servercompatible(char *name, char *sdec, char *map, int ping, const vector<int> &attr, int np);
@@ -123,6 +124,8 @@ namespace server
     extern const char *defaultmaster();
     extern int masterport();
     extern void processmasterinput(const char *cmd, int cmdlen, const char *args);
+    extern void masterinputprocessed();
+    extern void benchmarkpositions(const char *demo);
     extern void masterconnected();
     extern void masterdisconnected();
     extern bool ispaused();
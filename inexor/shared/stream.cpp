@@ -1,3 +1,8 @@
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
 #include "inexor/shared/cube.hpp"
 #include "inexor/util/Logging.hpp"
 
@@ -231,6 +236,8 @@ done:
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #endif
 
 string homedir = "";
@@ -244,7 +251,7 @@ vector<packagedir> packagedirs;
 /// Append a string together but add the prefix in the field.
 char *makerelpath(const char *dir, const char *file, const char *prefix, const char *cmd)
 {
-    static string tmp;
+    static SERVERLOCAL string tmp;
     if(prefix) copystring(tmp, prefix);
     else tmp[0] = '\0';
     if(file[0]=='<')
@@ -316,10 +323,10 @@ char *path(char *s)
 }
 
 /// Returns a static string with adapted slashes according to the platforms prefered pathseperator.
-/// @warning not threadsafe!
+/// @warning not threadsafe, only the game instances of a dedicated server get a buffer of their own!
 char *path(const char *s, bool copy)
 {
-    static string tmp;
+    static SERVERLOCAL string tmp;
     copystring(tmp, s);
     path(tmp);
     return tmp;
@@ -331,7 +338,7 @@ const char *parentdir(const char *filename)
 {
     const char *p = filename + strlen(filename);
     while(p > filename && *p != '/' && *p != '\\') p--;
-    static string parent;
+    static SERVERLOCAL string parent;
     size_t len = p-filename+1;
     copystring(parent, filename, len);
     return parent;
@@ -362,7 +369,7 @@ bool createdir(const char *path)
     size_t len = strlen(path);
     if(path[len-1]==PATHDIV)
     {
-        static string strip;
+        static SERVERLOCAL string strip;
         path = copystring(strip, path, len);
     }
 #ifdef WIN32
@@ -405,7 +412,7 @@ const char *addpackagedir(const char *dir)
 ///         Otherwise it returns the inital filename.
 const char *findfile(const char *filename, const char *mode)
 {
-    static string s;
+    static SERVERLOCAL string s;
     if(homedir[0])
     {
         formatstring(s, "%s%s", homedir, filename);
@@ -977,6 +984,221 @@ struct gzstream : stream
     }
 };
 
+/// Reads its source ahead on a background thread, so the decompression (or disk io) of
+/// the source overlaps with whatever the reader does with the data.
+/// Reading only: seeking forward skips (and checksums) the data like gzstream does, backwards fails.
+/// Everything read from the source is also written to copy (on the background thread), if given.
+struct prefetchstream : stream
+{
+    enum
+    {
+        CHUNKSIZE = 256*1024,
+        MAXCHUNKS = 8
+    };
+
+    struct chunk
+    {
+        uchar *data;
+        size_t len;
+    };
+
+    stream *file, *copy;
+    std::thread reader;
+    std::mutex lock;
+    std::condition_variable produced, consumed;
+    std::deque<chunk> chunks;
+    bool done, stop;
+
+    /// the chunk we are reading from, owned by the consumer
+    chunk cur;
+    size_t curpos;
+    offset pos;
+    uint crc;
+
+    prefetchstream(stream *file, stream *copy) : file(file), copy(copy), done(false), stop(false), curpos(0), pos(0), crc(crc32(0, NULL, 0))
+    {
+        cur.data = NULL;
+        cur.len = 0;
+        reader = std::thread([this] { readahead(); });
+    }
+
+    ~prefetchstream() { close(); }
+
+    /// background thread: fill chunks until the source ends or we are closed
+    void readahead()
+    {
+        for(;;)
+        {
+            chunk c;
+            c.data = new uchar[CHUNKSIZE];
+            c.len = file->read(c.data, CHUNKSIZE);
+            if(copy && c.len) copy->write(c.data, c.len);
+            std::unique_lock<std::mutex> l(lock);
+            while(chunks.size() >= MAXCHUNKS && !stop) consumed.wait(l);
+            if(stop || !c.len) delete[] c.data;
+            else chunks.push_back(c);
+            if(stop || c.len < CHUNKSIZE)
+            {
+                done = true;
+                produced.notify_one();
+                return;
+            }
+            produced.notify_one();
+        }
+    }
+
+    /// take the next chunk, false at the end of the source
+    bool nextchunk()
+    {
+        DELETEA(cur.data);
+        cur.len = curpos = 0;
+        std::unique_lock<std::mutex> l(lock);
+        while(chunks.empty() && !done) produced.wait(l);
+        if(chunks.empty()) return false;
+        cur = chunks.front();
+        chunks.pop_front();
+        consumed.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        if(!file) return;
+        {
+            std::lock_guard<std::mutex> l(lock);
+            stop = true;
+        }
+        consumed.notify_one();
+        reader.join();
+        for(chunk &c : chunks) delete[] c.data;
+        chunks.clear();
+        DELETEA(cur.data);
+        DELETEP(file);
+        DELETEP(copy);
+    }
+
+    bool end() { return curpos >= cur.len && !nextchunk(); }
+    offset tell() { return pos; }
+    uint getcrc() { return crc; }
+
+    size_t read(void *buf, size_t len)
+    {
+        size_t total = 0;
+        while(total < len)
+        {
+            if(curpos >= cur.len && !nextchunk()) break;
+            size_t n = min(len - total, cur.len - curpos);
+            memcpy((uchar *)buf + total, cur.data + curpos, n);
+            curpos += n;
+            total += n;
+        }
+        crc = crc32(crc, (Bytef *)buf, total);
+        pos += total;
+        return total;
+    }
+
+    bool seek(offset off, int whence)
+    {
+        if(whence == SEEK_SET) off -= pos;
+        else if(whence == SEEK_END)
+        {
+            uchar skip[512];
+            while(read(skip, sizeof(skip)) == sizeof(skip));
+            return !off;
+        }
+        if(off < 0) return false;
+        uchar skip[512];
+        while(off > 0)
+        {
+            size_t skipped = (size_t)min(off, (offset)sizeof(skip));
+            if(read(skip, skipped) != skipped) return false;
+            off -= skipped;
+        }
+        return true;
+    }
+};
+
+/// Read only access to a whole file in memory: mapped where we can, read in otherwise.
+struct mappedstream : stream
+{
+    uchar *data;
+    size_t len, pos;
+    bool mapped;
+
+    mappedstream() : data(NULL), len(0), pos(0), mapped(false) {}
+    ~mappedstream() { close(); }
+
+    bool open(const char *name)
+    {
+#ifndef WIN32
+        int fd = ::open(name, O_RDONLY);
+        if(fd < 0) return false;
+        struct stat st;
+        if(fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(p != MAP_FAILED)
+            {
+                data = (uchar *)p;
+                len = st.st_size;
+                mapped = true;
+            }
+        }
+        ::close(fd);
+        return mapped;
+#else
+        FILE *f = fopen(name, "rb");
+        if(!f) return false;
+        fseek(f, 0, SEEK_END);
+        long size = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        if(size > 0)
+        {
+            data = new uchar[size];
+            if(fread(data, 1, size, f) == size_t(size)) len = size;
+            else DELETEA(data);
+        }
+        fclose(f);
+        return data != NULL;
+#endif
+    }
+
+    void close()
+    {
+        if(!data) return;
+#ifndef WIN32
+        if(mapped) munmap(data, len);
+        else
+#endif
+        delete[] data;
+        data = NULL;
+        len = pos = 0;
+    }
+
+    bool end() { return pos >= len; }
+    offset tell() { return pos; }
+    offset size() { return len; }
+
+    bool seek(offset off, int whence)
+    {
+        if(whence == SEEK_CUR) off += pos;
+        else if(whence == SEEK_END) off += len;
+        if(off < 0 || off > offset(len)) return false;
+        pos = size_t(off);
+        return true;
+    }
+
+    size_t read(void *buf, size_t n)
+    {
+        n = min(n, len - pos);
+        memcpy(buf, data + pos, n);
+        pos += n;
+        return n;
+    }
+
+    int getchar() { return pos < len ? data[pos++] : -1; }
+};
+
 struct utf8stream : stream
 {
     enum
@@ -1184,6 +1406,19 @@ stream *opengzfile(const char *filename, const char *mode, stream *file, int lev
     return gz;
 }
 
+stream *openprefetchstream(stream *file, stream *copy)
+{
+    if(!file) { DELETEP(copy); return NULL; }
+    return new prefetchstream(file, copy);
+}
+
+stream *openmappedfile(const char *filename)
+{
+    mappedstream *file = new mappedstream;
+    if(!file->open(filename)) { delete file; return NULL; }
+    return file;
+}
+
 stream *openutf8file(const char *filename, const char *mode, stream *file)
 {
     stream *source = file ? file : openfile(filename, mode);
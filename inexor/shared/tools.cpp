@@ -5,8 +5,8 @@
 #include <unistd.h>
 #endif
 
-static string tmpstr[4];
-static int tmpidx = 0;
+static SERVERLOCAL string tmpstr[4];
+static SERVERLOCAL int tmpidx = 0;
 
 char *tempformatstring(const char *fmt, ...)
 {
@@ -193,3 +193,11 @@ int ipmask::print(char *buf) const
     return int(buf-start);
 }
 
+void ipmasklist::update()
+{
+    if(!changed) return;
+    inexor::util::IpBanTable::Builder builder;
+    loopv(masks) builder.add(ENET_NET_TO_HOST_32(masks[i].ip), ENET_NET_TO_HOST_32(masks[i].mask));
+    table.publish(builder.build());
+    changed = false;
+}
@@ -10,6 +10,7 @@
 #include <boost/algorithm/clamp.hpp>
 
 #include "inexor/util/random.hpp"
+#include "inexor/util/IpBanTable.hpp"
 #include "inexor/network/SharedTree.hpp"
 #include "inexor/util.hpp"
 
@@ -39,6 +40,14 @@ typedef unsigned long long int ullong;
   #define UNUSED
 #endif
 
+/// State every game instance of a dedicated server keeps for itself: each of them runs on its own thread
+/// (see serverinstances in engine/server.cpp). Clients only ever run one game.
+#ifdef STANDALONE
+  #define SERVERLOCAL thread_local
+#else
+  #define SERVERLOCAL
+#endif
+
 using std::swap;
 using std::min;
 using std::max;
@@ -1488,6 +1497,8 @@ extern stream *openfile(const char *filename, const char *mode);
 extern stream *opentempfile(const char *filename, const char *mode);
 extern stream *opengzfile(const char *filename, const char *mode, stream *file = NULL, int level = Z_BEST_COMPRESSION);
 extern stream *openutf8file(const char *filename, const char *mode, stream *file = NULL);
+extern stream *openprefetchstream(stream *file, stream *copy = NULL);
+extern stream *openmappedfile(const char *filename);
 extern char *loadfile(const char *fn, size_t *size, bool utf8 = true);
 extern bool listdir(const char *dir, bool rel, const char *ext, vector<char *> &files);
 extern int listfiles(const char *dir, const char *ext, vector<char *> &files);
@@ -1523,3 +1534,24 @@ struct ipmask
     bool check(enet_uint32 host) const { return (host & mask) == ip; }
 };
 
+/// A list of ipmasks which is searched through a sorted range table instead of checking every mask.
+/// add() and clear() only collect the masks, update() builds the new table and swaps it in afterwards:
+/// bulk updates stay cheap and lookups never have to wait for a rebuild.
+struct ipmasklist
+{
+    vector<ipmask> masks;
+    inexor::util::IpBanList table;
+    bool changed;
+
+    ipmasklist() : changed(false) {}
+
+    void add(const ipmask &m) { masks.add(m); changed = true; }
+    void clear() { masks.shrink(0); changed = true; }
+    int length() const { return masks.length(); }
+    const ipmask &operator[](int i) const { return masks[i]; }
+
+    /// Publish the masks added or cleared since the last update.
+    void update();
+    bool check(enet_uint32 host) const { return table.contains(ENET_NET_TO_HOST_32(host)); }
+};
+
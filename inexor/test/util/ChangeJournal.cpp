@@ -0,0 +1,20 @@
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "inexor/util/ChangeJournal.hpp"
+#include "inexor/test/helpers.hpp"
+
+using namespace inexor::util;
+
+test(ChangeJournal, KeepsDistinctKeysInOrder) {
+    std::vector<int> keys = { 3, 1, 2 };
+    std::vector<size_t> expected = { 0, 1, 2 };
+    expectEq(expected, last_change_per_key(keys));
+}
+
+test(ChangeJournal, AddedAndRemovedServerIsSentAsRemoval) {
+    std::vector<int> keys = { 5, 5, 5 };
+    std::vector<size_t> expected = { 2 };
+    expectEq(expected, last_change_per_key(keys));
+}
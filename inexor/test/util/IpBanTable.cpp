@@ -0,0 +1,106 @@
+#include <chrono>
+#include <cstdio>
+
+#include "gtest/gtest.h"
+
+#include "inexor/util/IpBanTable.hpp"
+#include "inexor/util/random.hpp"
+#include "inexor/test/helpers.hpp"
+
+using namespace inexor::util;
+
+namespace {
+
+uint32_t ip(uint32_t a, uint32_t b, uint32_t c, uint32_t d) { return a << 24 | b << 16 | c << 8 | d; }
+uint32_t prefix(int bits) { return bits ? 0xFFFFFFFFu << (32 - bits) : 0; }
+
+} // anonymous namespace
+
+test(IpBanTable, EmptyContainsNothing) {
+    auto table = IpBanTable::Builder().build();
+    expect(!table->contains(ip(1, 2, 3, 4)));
+    expect(!table->contains(0));
+    expect(!table->contains(0xFFFFFFFFu));
+}
+
+test(IpBanTable, MatchesPrefixes) {
+    IpBanTable::Builder b;
+    b.add(ip(10, 0, 0, 0), prefix(8));
+    b.add(ip(192, 168, 1, 77), prefix(32));
+    auto table = b.build();
+    expect(table->contains(ip(10, 255, 3, 4)));
+    expect(!table->contains(ip(11, 0, 0, 0)));
+    expect(!table->contains(ip(9, 255, 255, 255)));
+    expect(table->contains(ip(192, 168, 1, 77)));
+    expect(!table->contains(ip(192, 168, 1, 78)));
+}
+
+test(IpBanTable, MergesOverlappingRanges) {
+    IpBanTable::Builder b;
+    b.add(ip(10, 0, 0, 0), prefix(8));
+    b.add(ip(10, 1, 0, 0), prefix(16));
+    b.add(ip(11, 0, 0, 0), prefix(8));
+    b.add(ip(255, 255, 255, 255), prefix(32));
+    b.add(ip(255, 255, 255, 0), prefix(24));
+    auto table = b.build();
+    expectEq(2u, table->size());
+    expect(table->contains(ip(11, 9, 9, 9)));
+    expect(table->contains(ip(255, 255, 255, 255)));
+}
+
+test(IpBanTable, IrregularMasks) {
+    IpBanTable::Builder b;
+    b.add(ip(1, 0, 3, 0), ip(255, 0, 255, 0));
+    auto table = b.build();
+    expect(table->contains(ip(1, 77, 3, 9)));
+    expect(!table->contains(ip(1, 77, 4, 9)));
+}
+
+test(IpBanList, PublishKeepsSnapshots) {
+    IpBanList list;
+    auto old = list.snapshot();
+    IpBanTable::Builder b;
+    b.add(ip(1, 2, 3, 4), prefix(32));
+    list.publish(b.build());
+    expect(list.contains(ip(1, 2, 3, 4)));
+    expect(!old->contains(ip(1, 2, 3, 4))) << "old snapshots must stay unchanged";
+}
+
+/// Compares 100k synthetic bans against a linear scan and prints the lookup times.
+/// Disabled by default, run it with --gtest_also_run_disabled_tests --gtest_filter=*Benchmark*
+test(IpBanTable, DISABLED_Benchmark100kBans) {
+    const int numbans = 100000, numlookups = 200000;
+    std::vector<std::pair<uint32_t, uint32_t>> bans;
+    IpBanTable::Builder b;
+    for(int i = 0; i < numbans; i++)
+    {
+        uint32_t mask = prefix(rnd(16, 33)), addr = rnd_raw<uint32_t>() & mask;
+        bans.emplace_back(addr, mask);
+        b.add(addr, mask);
+    }
+    auto start = std::chrono::steady_clock::now();
+    auto table = b.build();
+    auto built = std::chrono::steady_clock::now();
+
+    std::vector<uint32_t> hosts(numlookups);
+    for(auto &h : hosts) h = rnd_raw<uint32_t>();
+    size_t hits = 0;
+    for(uint32_t h : hosts) hits += table->contains(h);
+    auto looked = std::chrono::steady_clock::now();
+
+    const int numlinear = 200;
+    for(int i = 0; i < numlinear; i++)
+    {
+        bool linear = false;
+        for(auto &ban : bans) if((hosts[i] & ban.second) == ban.first) { linear = true; break; }
+        assertEq(linear, table->contains(hosts[i])) << "host " << hosts[i];
+    }
+    auto scanned = std::chrono::steady_clock::now();
+
+    using ns = std::chrono::nanoseconds;
+    printf("[ BENCHMARK] 100k bans: build %.2f ms, table lookup %.0f ns, linear scan %.0f ns (%zu hits)\n",
+           std::chrono::duration_cast<ns>(built - start).count() / 1e6,
+           double(std::chrono::duration_cast<ns>(looked - built).count()) / numlookups,
+           double(std::chrono::duration_cast<ns>(scanned - looked).count()) / numlinear,
+           hits);
+}
@@ -0,0 +1,67 @@
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "inexor/util/ServerList.hpp"
+#include "inexor/test/helpers.hpp"
+
+using namespace inexor::util;
+
+namespace {
+
+/// A client's list, changed the way the server browser does it: adding a listed or removing an unlisted server does nothing.
+std::vector<uint16_t> apply(const server_list_reply &master, std::vector<listed_server> listed)
+{
+    server_list_reply reply;
+    std::string data = master.write_binary();
+    expect(reply.read_binary((const unsigned char *)data.data(), data.size()));
+    reply.apply([&] { listed.clear(); },
+        [&](const listed_server &s) { if(std::find(listed.begin(), listed.end(), s) == listed.end()) listed.push_back(s); },
+        [&](const listed_server &s) { listed.erase(std::remove(listed.begin(), listed.end(), s), listed.end()); });
+
+    std::vector<uint16_t> ports;
+    for(auto &s : listed) ports.push_back(s.port);
+    std::sort(ports.begin(), ports.end());
+    return ports;
+}
+
+listed_server server(uint16_t port) { return listed_server{0x0100007F, port}; }
+
+} // anonymous namespace
+
+test(ServerList, RemovedAndReaddedServerStaysListed) {
+    // removed and added again within one delta window
+    std::vector<server_change> journal = { { server(7), false }, { server(9), true }, { server(7), true } };
+    server_list_reply reply;
+    reply.add_changes(journal);
+    std::vector<uint16_t> expected = { 7, 9 };
+    expectEq(expected, apply(reply, { server(7) }));
+}
+
+test(ServerList, AddedAndRemovedServerIsNotListed) {
+    std::vector<server_change> journal = { { server(5), true }, { server(5), false } };
+    server_list_reply reply;
+    reply.add_changes(journal);
+    expectEq(std::vector<uint16_t>(), apply(reply, {}));
+}
+
+test(ServerList, FullListReplacesTheOldOne) {
+    server_list_reply reply;
+    reply.full = true;
+    reply.added = { server(1), server(2) };
+    std::vector<uint16_t> expected = { 1, 2 };
+    expectEq(expected, apply(reply, { server(3) }));
+}
+
+test(ServerList, RejectsShortReplies) {
+    server_list_reply reply;
+    reply.added = { server(1), server(2) };
+    std::string data = reply.write_binary();
+    server_list_reply read;
+    expect(read.read_binary((const unsigned char *)data.data(), data.size()));
+    expect(!read.read_binary((const unsigned char *)data.data(), data.size() - 1));
+    expect(!read.read_binary((const unsigned char *)"SLB0", 4));
+}
@@ -0,0 +1,171 @@
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "inexor/network/SharedList.hpp"
+#include "inexor/test/helpers.hpp"
+
+using namespace inexor::rpc;
+using inexor::rendering::player;
+
+namespace {
+
+/// A list wired up like the RPC bindings do it, recording the diffs.
+struct recorded_list
+{
+    SharedList<player> list;
+    int diffs = 0;
+    size_t oldsize = 0, size = 0;
+    std::vector<size_t> changed;
+
+    recorded_list()
+    {
+        list.connect_element_func = [](player &p, std::function<void()> touch) {
+            p.kills.onChange.connect([touch](const int &, const int &) { touch(); });
+            p.deaths.onChange.connect([touch](const int &, const int &) { touch(); });
+        };
+        list.changed_func = [this](size_t o, size_t s, const std::vector<size_t> &c) {
+            diffs++;
+            oldsize = o;
+            size = s;
+            changed = c;
+        };
+    }
+
+    void fill(int n)
+    {
+        std::vector<player> players(n);
+        for(int i = 0; i < n; i++) players[i].kills = i;
+        list.assign(players.begin(), players.end());
+        flush_shared_vars();
+        diffs = 0;
+    }
+};
+
+} // anonymous namespace
+
+test(SharedList, OneDiffPerFrame) {
+    recorded_list r;
+    std::vector<player> players(100);
+    r.list.assign(players.begin(), players.end());
+    r.list.push_back(player());
+    r.list[3].kills = 7;
+    expectEq(0, r.diffs) << "nothing should be sent before the frame ends";
+
+    flush_shared_vars();
+    expectEq(1, r.diffs) << "filling the list should result in a single diff";
+    expectEq(101u, r.size);
+    expectEq(101u, r.changed.size());
+
+    flush_shared_vars();
+    expectEq(1, r.diffs) << "an unchanged list should not be sent again";
+}
+
+test(SharedList, MemberChangesSendTheirElement) {
+    recorded_list r;
+    r.fill(50);
+    r.list[40].deaths = 3;
+    r.list[10].kills++;
+    r.list[10].kills++;
+    flush_shared_vars();
+    expectEq(1, r.diffs);
+    assertEq(2u, r.changed.size());
+    expectEq(10u, r.changed[0]);
+    expectEq(40u, r.changed[1]);
+}
+
+test(SharedList, StructuralChangesSendTheTail) {
+    recorded_list r;
+    r.fill(10);
+    r.list[2].kills = 100;
+    r.list.erase_range(5, 7);
+    r.list.insert(8, player());
+    flush_shared_vars();
+    expectEq(10u, r.oldsize);
+    expectEq(9u, r.size);
+    assertEq(5u, r.changed.size()) << "the touched element and everything from the first removal on";
+    expectEq(2u, r.changed[0]);
+    expectEq(5u, r.changed[1]);
+    expectEq(8u, r.changed[4]);
+    expectEq(7, *r.list[5].kills) << "the elements behind the removed ones should have moved up";
+
+    r.list.clear();
+    flush_shared_vars();
+    expectEq(0u, r.size);
+    expect(r.changed.empty());
+}
+
+test(SharedList, ModifiedThenMovedElementIsSentOnce) {
+    recorded_list r;
+    r.fill(10);
+    r.list[6].kills = 1;
+    r.list.erase(0);
+    r.list[5].kills = 2; // the same element
+    flush_shared_vars();
+    expectEq(9u, r.changed.size());
+    for(size_t i = 0; i < r.changed.size(); i++) expectEq(i, r.changed[i]);
+}
+
+test(SharedList, SwapSendsBothElements) {
+    recorded_list r;
+    r.fill(20);
+    r.list.swap(3, 15);
+    flush_shared_vars();
+    assertEq(2u, r.changed.size());
+    expectEq(3u, r.changed[0]);
+    expectEq(15u, r.changed[1]);
+    expectEq(15, *r.list[3].kills);
+
+    r.list[15].deaths = 1; // the element from position 3
+    flush_shared_vars();
+    assertEq(1u, r.changed.size());
+    expectEq(15u, r.changed[0]);
+}
+
+test(SharedList, ErasedElementIsForgotten) {
+    recorded_list r;
+    r.fill(5);
+    player copy(r.list[4]);
+    r.list[4].kills = 1;
+    r.list.erase(4);
+    copy.kills = 2; // still carries the hooks of the erased element
+    flush_shared_vars();
+    expectEq(4u, r.size);
+    expect(r.changed.empty());
+}
+
+test(SharedList, ErasingTouchedElementsKeepsTheOthers) {
+    recorded_list r;
+    r.fill(10);
+    r.list[1].kills = 11;
+    r.list[7].kills = 17;
+    r.list[4].kills = 14;
+    r.list.swap(8, 9);
+    r.list.erase_nosync(7);
+    r.list.erase_nosync(1);
+    flush_shared_vars();
+    assertEq(3u, r.changed.size()) << "the erased elements should be dropped, the other touched ones kept";
+    expectEq(3u, r.changed[0]);
+    expectEq(6u, r.changed[1]);
+    expectEq(7u, r.changed[2]);
+    expectEq(14, *r.list[3].kills);
+}
+
+test(SharedList, ReceivedChangesAreNotSentBack) {
+    recorded_list r;
+    r.list.resize_nosync(8);
+    r.list[2].kills.setnosync(5);
+    flush_shared_vars();
+    expectEq(0, r.diffs);
+
+    r.list[2].kills = 6;
+    flush_shared_vars();
+    expectEq(1, r.diffs) << "received elements should be hooked up as well";
+    expectEq(8u, r.oldsize);
+    expectEq(8u, r.size);
+
+    r.list.erase_nosync(0);
+    flush_shared_vars();
+    expectEq(1, r.diffs) << "a received removal should not be sent back";
+    expectEq(6, *r.list[1].kills);
+}
@@ -0,0 +1,78 @@
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "inexor/util/SpscByteQueue.hpp"
+#include "inexor/test/helpers.hpp"
+
+using namespace inexor::util;
+
+test(SpscByteQueue, RoundsCapacityUp) {
+    SpscByteQueue q(100);
+    expectEq(128u, q.capacity());
+    expect(q.empty());
+}
+
+test(SpscByteQueue, WrapsAround) {
+    SpscByteQueue q(8);
+    unsigned char in[6] = { 1, 2, 3, 4, 5, 6 }, out[8];
+    expectEq(6u, q.write(in, 6));
+    expectEq(4u, q.read(out, 4));
+    expectEq(6u, q.write(in, 6)) << "should wrap around the end of the ring";
+    expectEq(0u, q.write(in, 1)) << "queue should be full";
+    expectEq(8u, q.read(out, 8));
+    const unsigned char expected[8] = { 5, 6, 1, 2, 3, 4, 5, 6 };
+    for(int i = 0; i < 8; i++) expectEq(expected[i], out[i]);
+    expect(q.empty());
+}
+
+test(SpscByteQueue, TracksSizeAndSpace) {
+    SpscByteQueue q(16);
+    unsigned char buf[10] = { 0 };
+    expectEq(0u, q.size());
+    expectEq(16u, q.space());
+    q.write(buf, 10);
+    expectEq(10u, q.size());
+    expectEq(6u, q.space());
+    q.read(buf, 4);
+    expectEq(6u, q.size());
+    expectEq(10u, q.space());
+}
+
+test(SpscByteQueue, TransfersBetweenThreads) {
+    SpscByteQueue q(64);
+    const size_t total = 1 << 20;
+    std::vector<unsigned char> received;
+    received.reserve(total);
+
+    std::thread consumer([&q, &received, total] {
+        unsigned char buf[37];
+        while(received.size() < total)
+        {
+            size_t n = q.read(buf, sizeof(buf));
+            received.insert(received.end(), buf, buf + n);
+            if(!n) std::this_thread::yield();
+        }
+    });
+
+    unsigned char buf[29];
+    size_t sent = 0;
+    while(sent < total)
+    {
+        size_t n = std::min(sizeof(buf), total - sent);
+        for(size_t i = 0; i < n; i++) buf[i] = (unsigned char)(sent + i);
+        size_t done = 0;
+        while(done < n)
+        {
+            size_t w = q.write(buf + done, n - done);
+            if(!w) std::this_thread::yield();
+            done += w;
+        }
+        sent += n;
+    }
+    consumer.join();
+
+    assertEq(total, received.size());
+    for(size_t i = 0; i < total; i++) assertEq((unsigned char)i, received[i]) << "at byte " << i;
+}
@@ -0,0 +1,53 @@
+#include <memory>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+#include "inexor/util/SpscQueue.hpp"
+#include "inexor/test/helpers.hpp"
+
+using namespace inexor::util;
+
+test(SpscQueue, PushesUntilFull) {
+    SpscQueue<int> q(3);
+    expectEq(4u, q.capacity());
+    for(int i = 0; i < 4; i++) expect(q.push(i));
+    expect(!q.push(4)) << "queue should be full";
+    int out;
+    for(int i = 0; i < 4; i++)
+    {
+        expect(q.pop(out));
+        expectEq(i, out);
+    }
+    expect(!q.pop(out));
+    expect(q.empty());
+}
+
+test(SpscQueue, MovesObjects) {
+    SpscQueue<std::unique_ptr<int>> q(2);
+    std::unique_ptr<int> in(new int(42)), out;
+    expect(q.push(std::move(in)));
+    expect(!in);
+    expect(q.pop(out));
+    assertEq(42, *out);
+}
+
+test(SpscQueue, TransfersBetweenThreads) {
+    SpscQueue<size_t> q(16);
+    const size_t total = 1 << 18;
+
+    std::thread producer([&q, total] {
+        for(size_t i = 0; i < total; i++)
+            while(!q.push(i)) std::this_thread::yield();
+    });
+
+    size_t next = 0, item;
+    while(next < total)
+    {
+        if(!q.pop(item)) { std::this_thread::yield(); continue; }
+        assertEq(next, item);
+        next++;
+    }
+    producer.join();
+    expect(q.empty());
+}
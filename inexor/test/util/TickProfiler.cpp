@@ -0,0 +1,67 @@
+#include "gtest/gtest.h"
+
+#include "inexor/util/TickProfiler.hpp"
+#include "inexor/test/helpers.hpp"
+
+using namespace inexor::util;
+
+test(LatencyHistogram, EmptyIsZero) {
+    LatencyHistogram h;
+    expectEq(0u, h.count());
+    expectEq(0u, h.percentile(0.5));
+    expectEq(0u, h.max());
+}
+
+test(LatencyHistogram, SmallValuesAreExact) {
+    LatencyHistogram h;
+    for(uint64_t i = 0; i < 10; i++) h.record(i);
+    expectEq(10u, h.count());
+    expectEq(9u, h.max());
+    expectEq(5u, h.percentile(0.5));
+    expectEq(9u, h.percentile(1.0));
+}
+
+test(LatencyHistogram, PercentilesWithinBucketPrecision) {
+    LatencyHistogram h;
+    for(uint64_t i = 1; i <= 100000; i++) h.record(i);
+    uint64_t p50 = h.percentile(0.5), p99 = h.percentile(0.99);
+    expect(p50 >= 50000 && p50 <= 50000 + 50000/LatencyHistogram::SUB_BUCKETS) << "p50 was " << p50;
+    expect(p99 >= 99000 && p99 <= 99000 + 99000/LatencyHistogram::SUB_BUCKETS) << "p99 was " << p99;
+    expectEq(100000u, h.max());
+}
+
+test(LatencyHistogram, HugeValues) {
+    LatencyHistogram h;
+    h.record(std::numeric_limits<uint64_t>::max());
+    expectEq(1u, h.count());
+    expectEq(std::numeric_limits<uint64_t>::max(), h.percentile(0.5));
+}
+
+test(TickProfiler, RecordsPerPhase) {
+    static const char * const names[] = { "alpha", "beta" };
+    TickProfiler p(names, 2);
+    p.record(0, 10);
+    p.record(1, 20);
+    p.record(1, 30);
+    std::string s = p.summary();
+    expectNeq(std::string::npos, s.find("alpha: n=1")) << s;
+    expectNeq(std::string::npos, s.find("beta: n=2")) << s;
+
+    p.enabled = false;
+    p.record(0, 10);
+    p.reset();
+    expectNeq(std::string::npos, p.summary().find("alpha: n=0"));
+}
+
+test(TickProfiler, OneSamplePerPhaseAndTick) {
+    static const char * const names[] = { "alpha", "beta" };
+    TickProfiler p(names, 2);
+    for(int i = 0; i < 100; i++) p.add(0, 10);
+    p.endtick();
+    std::string s = p.summary();
+    expectNeq(std::string::npos, s.find("alpha: n=1 p50=1000us")) << s;
+    expectNeq(std::string::npos, s.find("beta: n=0")) << "a phase which did not run should get no sample";
+
+    p.endtick();
+    expectNeq(std::string::npos, p.summary().find("alpha: n=1 ")) << "an empty tick should not add a sample";
+}
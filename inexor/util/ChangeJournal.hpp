@@ -0,0 +1,30 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <unordered_set>
+#include <vector>
+
+namespace inexor {
+namespace util {
+
+/// Net out a journal of changes to keyed entries (e.g. servers which got added to or removed from a list):
+/// only the last change of every key matters to someone who missed all of them.
+///
+/// Sending every entry once also means the receiver may apply them in any order,
+/// a server which got removed and added again can't end up removed.
+/// @param keys the key of every journal entry, oldest first.
+/// @return the positions of the entries to send, oldest first.
+template<typename Key, typename Hash = std::hash<Key>>
+std::vector<size_t> last_change_per_key(const std::vector<Key> &keys)
+{
+    std::unordered_set<Key, Hash> seen;
+    std::vector<size_t> keep;
+    for(size_t i = keys.size(); i-- > 0;) if(seen.insert(keys[i]).second) keep.push_back(i);
+    std::reverse(keep.begin(), keep.end());
+    return keep;
+}
+
+} // ns inexor::util
+} // ns inexor
@@ -0,0 +1,45 @@
+#include "inexor/util/IpBanTable.hpp"
+
+#include <algorithm>
+
+namespace inexor {
+namespace util {
+
+void IpBanTable::Builder::add(uint32_t ip, uint32_t mask)
+{
+    ip &= mask;
+    // a prefix mask is all ones followed by all zeros
+    if((~mask & (~mask + 1)) == 0) ranges.emplace_back(ip, ip | ~mask);
+    else irregular.emplace_back(ip, mask);
+}
+
+std::shared_ptr<const IpBanTable> IpBanTable::Builder::build() const
+{
+    std::shared_ptr<IpBanTable> table = std::make_shared<IpBanTable>();
+    std::vector<std::pair<uint32_t, uint32_t>> sorted(ranges);
+    std::sort(sorted.begin(), sorted.end());
+    for(const auto &r : sorted)
+    {
+        // merge ranges which overlap or touch the previous one
+        if(!table->last.empty() && (table->last.back() == UINT32_MAX || r.first <= table->last.back() + 1))
+            table->last.back() = std::max(table->last.back(), r.second);
+        else
+        {
+            table->first.push_back(r.first);
+            table->last.push_back(r.second);
+        }
+    }
+    table->irregular = irregular;
+    return table;
+}
+
+bool IpBanTable::contains(uint32_t host) const
+{
+    auto it = std::upper_bound(first.begin(), first.end(), host);
+    if(it != first.begin() && host <= last[it - first.begin() - 1]) return true;
+    for(const auto &m : irregular) if((host & m.second) == m.first) return true;
+    return false;
+}
+
+} // ns inexor::util
+} // ns inexor
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace inexor {
+namespace util {
+
+/// Immutable set of banned ip ranges.
+///
+/// Prefix masks (CIDR ranges, the common case) are merged into a
+/// sorted table of disjoint [first, last] ranges, so a lookup is a
+/// binary search instead of a scan over every ban.
+/// The rare non-contiguous masks are kept aside and checked linearly.
+/// Addresses and masks are in host byte order.
+class IpBanTable {
+public:
+    class Builder {
+    public:
+        void add(uint32_t ip, uint32_t mask);
+        /// Sort and merge the collected bans into a new table.
+        std::shared_ptr<const IpBanTable> build() const;
+        size_t size() const { return ranges.size() + irregular.size(); }
+
+    private:
+        std::vector<std::pair<uint32_t, uint32_t>> ranges, irregular;
+    };
+
+    bool contains(uint32_t host) const;
+    /// Number of disjoint ranges left after merging.
+    size_t size() const { return first.size(); }
+
+private:
+    std::vector<uint32_t> first, last;
+    std::vector<std::pair<uint32_t, uint32_t>> irregular;
+};
+
+/// Holds the current IpBanTable.
+/// Lookups work on a snapshot, so publishing a rebuilt table never has to wait for them.
+class IpBanList {
+public:
+    IpBanList() : current(IpBanTable::Builder().build()) {}
+
+    std::shared_ptr<const IpBanTable> snapshot() const { return std::atomic_load(&current); }
+    void publish(std::shared_ptr<const IpBanTable> table) { std::atomic_store(&current, std::move(table)); }
+    bool contains(uint32_t host) const { return snapshot()->contains(host); }
+
+private:
+    std::shared_ptr<const IpBanTable> current;
+};
+
+} // ns inexor::util
+} // ns inexor
@@ -0,0 +1,82 @@
+#include "inexor/util/ServerList.hpp"
+
+#include <cstring>
+
+#include "inexor/util/ChangeJournal.hpp"
+
+namespace inexor {
+namespace util {
+
+namespace {
+
+const size_t HEADER_SIZE = 21, ENTRY_SIZE = 6;
+
+void put_binary(std::string &out, uint32_t n, int size)
+{
+    for(int i = 0; i < size; i++) out.push_back(char((n >> (8*i)) & 0xFF));
+}
+
+uint32_t get_binary(const unsigned char *p, int size)
+{
+    uint32_t n = 0;
+    for(int i = 0; i < size; i++) n |= uint32_t(p[i]) << (8*i);
+    return n;
+}
+
+void put_server(std::string &out, const listed_server &s)
+{
+    out.append((const char *)&s.host, 4); // already in network byte order
+    put_binary(out, s.port, 2);
+}
+
+listed_server get_server(const unsigned char *p)
+{
+    listed_server s;
+    memcpy(&s.host, p, 4);
+    s.port = uint16_t(get_binary(p+4, 2));
+    return s;
+}
+
+} // anonymous namespace
+
+void server_list_reply::add_changes(const std::vector<server_change> &journal)
+{
+    std::vector<uint64_t> keys;
+    keys.reserve(journal.size());
+    for(const server_change &c : journal) keys.push_back(uint64_t(c.server.host)<<16 | c.server.port);
+    for(size_t i : last_change_per_key(keys))
+        (journal[i].add ? added : removed).push_back(journal[i].server);
+}
+
+std::string server_list_reply::write_binary() const
+{
+    std::string out("SLB1");
+    out.reserve(HEADER_SIZE + (added.size() + removed.size())*ENTRY_SIZE);
+    put_binary(out, epoch, 4);
+    put_binary(out, version, 4);
+    out.push_back(full ? 1 : 0);
+    put_binary(out, uint32_t(added.size()), 4);
+    put_binary(out, uint32_t(removed.size()), 4);
+    for(const listed_server &s : added) put_server(out, s);
+    for(const listed_server &s : removed) put_server(out, s);
+    return out;
+}
+
+bool server_list_reply::read_binary(const unsigned char *p, size_t len)
+{
+    if(len < HEADER_SIZE || memcmp(p, "SLB1", 4)) return false;
+    uint64_t adds = get_binary(p+13, 4), removes = get_binary(p+17, 4);
+    if((len - HEADER_SIZE)/ENTRY_SIZE < adds + removes) return false;
+    epoch = get_binary(p+4, 4);
+    version = get_binary(p+8, 4);
+    full = p[12] != 0;
+    added.clear();
+    removed.clear();
+    p += HEADER_SIZE;
+    for(uint64_t i = 0; i < adds; i++, p += ENTRY_SIZE) added.push_back(get_server(p));
+    for(uint64_t i = 0; i < removes; i++, p += ENTRY_SIZE) removed.push_back(get_server(p));
+    return true;
+}
+
+} // ns inexor::util
+} // ns inexor
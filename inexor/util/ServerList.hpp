@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace inexor {
+namespace util {
+
+/// A game server as the master lists it: the address in network byte order and the port.
+struct listed_server
+{
+    uint32_t host;
+    uint16_t port;
+
+    bool operator==(const listed_server &o) const { return host == o.host && port == o.port; }
+};
+
+/// An entry of the master's journal: a server which entered (add) or left the list.
+struct server_change
+{
+    listed_server server;
+    bool add;
+};
+
+/// A server list reply of the master: either the whole list or the changes since a list version.
+///
+/// The binary format is "SLB1", epoch, version, full flag, number of adds and removes (all little endian),
+/// then each added and each removed server as 4 byte address in network byte order and 2 byte port.
+struct server_list_reply
+{
+    uint32_t epoch = 0, version = 0;
+    /// The whole list rather than the changes since the version the client announced.
+    bool full = false;
+    std::vector<listed_server> added, removed;
+
+    /// The changes of a stretch of the journal (oldest first), only the last one of every server.
+    /// Clients may apply them in any order then, a server which got removed and added again stays listed.
+    void add_changes(const std::vector<server_change> &journal);
+
+    std::string write_binary() const;
+    /// false if this is not a binary list reply or it is cut short.
+    bool read_binary(const unsigned char *p, size_t len);
+
+    /// Apply the reply to a client's list: clear() for a full list, then add() and remove() per server.
+    template<typename Clear, typename Add, typename Remove>
+    void apply(Clear clear, Add add, Remove remove) const
+    {
+        if(full) clear();
+        for(const listed_server &s : added) add(s);
+        for(const listed_server &s : removed) remove(s);
+    }
+};
+
+} // ns inexor::util
+} // ns inexor
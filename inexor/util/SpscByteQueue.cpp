@@ -0,0 +1,44 @@
+#include "inexor/util/SpscByteQueue.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace inexor {
+namespace util {
+
+SpscByteQueue::SpscByteQueue(size_t capacity) : head(0), tail(0)
+{
+    size_t size = 1;
+    while(size < capacity) size <<= 1;
+    buffer.resize(size);
+    mask = size - 1;
+}
+
+size_t SpscByteQueue::write(const void *data, size_t len)
+{
+    size_t h = head.load(std::memory_order_relaxed), t = tail.load(std::memory_order_acquire);
+    len = std::min(len, buffer.size() - (h - t));
+    if(!len) return 0;
+    const unsigned char *src = static_cast<const unsigned char *>(data);
+    size_t offset = h & mask, first = std::min(len, buffer.size() - offset);
+    memcpy(&buffer[offset], src, first);
+    memcpy(&buffer[0], src + first, len - first);
+    head.store(h + len, std::memory_order_release);
+    return len;
+}
+
+size_t SpscByteQueue::read(void *data, size_t len)
+{
+    size_t t = tail.load(std::memory_order_relaxed), h = head.load(std::memory_order_acquire);
+    len = std::min(len, h - t);
+    if(!len) return 0;
+    unsigned char *dst = static_cast<unsigned char *>(data);
+    size_t offset = t & mask, first = std::min(len, buffer.size() - offset);
+    memcpy(dst, &buffer[offset], first);
+    memcpy(dst + first, &buffer[0], len - first);
+    tail.store(t + len, std::memory_order_release);
+    return len;
+}
+
+} // ns inexor::util
+} // ns inexor
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace inexor {
+namespace util {
+
+/// Bounded lock-free byte queue for exactly one producer and one consumer thread.
+///
+/// The producer appends with write(), the consumer takes the
+/// bytes out in the same order with read(). Both never block:
+/// they transfer as many bytes as fit (or are available) and
+/// return that amount, so the caller decides whether to wait
+/// or to retry.
+class SpscByteQueue {
+public:
+    /// @param capacity the size of the ring, rounded up to the next power of two.
+    explicit SpscByteQueue(size_t capacity);
+
+    /// Producer side: append up to len bytes.
+    /// @return the number of bytes actually written.
+    size_t write(const void *data, size_t len);
+
+    /// Consumer side: take up to len bytes out of the queue.
+    /// @return the number of bytes actually read.
+    size_t read(void *data, size_t len);
+
+    bool empty() const { return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire); }
+
+    /// Bytes ready to be read: can only grow behind the consumer's back.
+    size_t size() const { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire); }
+
+    /// Bytes that fit into the queue: can only grow behind the producer's back.
+    /// Producers writing records which must not be split check this first.
+    size_t space() const { return buffer.size() - size(); }
+
+    size_t capacity() const { return buffer.size(); }
+
+private:
+    std::vector<unsigned char> buffer;
+    size_t mask;
+    /// total number of bytes written (only modified by the producer)
+    std::atomic<size_t> head;
+    /// total number of bytes read (only modified by the consumer)
+    std::atomic<size_t> tail;
+};
+
+} // ns inexor::util
+} // ns inexor
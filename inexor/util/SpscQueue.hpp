@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace inexor {
+namespace util {
+
+/// Bounded lock-free queue of objects for exactly one producer and one consumer thread.
+///
+/// Like SpscByteQueue, but moves whole objects: push() and pop() never block
+/// and just return false if the queue is full (or empty).
+/// The slots are constructed once, objects get move assigned in and out.
+template<typename T>
+class SpscQueue {
+public:
+    /// @param capacity the number of slots, rounded up to the next power of two.
+    explicit SpscQueue(size_t capacity) : head(0), tail(0)
+    {
+        size_t size = 1;
+        while(size < capacity) size <<= 1;
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    /// Producer side: append an element.
+    /// @return false if the queue is full, item is left untouched then.
+    bool push(T &&item)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if(h - tail.load(std::memory_order_acquire) >= slots.size()) return false;
+        slots[h & mask] = std::move(item);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool push(const T &item)
+    {
+        T copy(item);
+        return push(std::move(copy));
+    }
+
+    /// Consumer side: take the oldest element out.
+    /// @return false if the queue is empty.
+    bool pop(T &item)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if(t == head.load(std::memory_order_acquire)) return false;
+        item = std::move(slots[t & mask]);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const { return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire); }
+
+    /// Elements ready to be popped: can only grow behind the consumer's back.
+    size_t size() const { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire); }
+
+    size_t capacity() const { return slots.size(); }
+
+private:
+    std::vector<T> slots;
+    size_t mask;
+    /// number of elements pushed (only modified by the producer)
+    std::atomic<size_t> head;
+    /// number of elements popped (only modified by the consumer)
+    std::atomic<size_t> tail;
+};
+
+} // ns inexor::util
+} // ns inexor
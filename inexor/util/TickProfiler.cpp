@@ -0,0 +1,91 @@
+#include "inexor/util/TickProfiler.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+
+namespace inexor {
+namespace util {
+
+int LatencyHistogram::bucket_index(uint64_t value)
+{
+    if(value < SUB_BUCKETS) return int(value);
+    int msb = 0;
+    for(uint64_t v = value; v > 1; v >>= 1) msb++;
+    // msb >= 4: the four bits below the highest one select the linear sub bucket
+    int sub = int((value >> (msb - 4)) & (SUB_BUCKETS - 1));
+    return (msb - 3) * SUB_BUCKETS + sub;
+}
+
+uint64_t LatencyHistogram::bucket_value(int index)
+{
+    if(index < SUB_BUCKETS) return uint64_t(index);
+    int msb = index / SUB_BUCKETS + 3, sub = index % SUB_BUCKETS;
+    return uint64_t(SUB_BUCKETS + sub) << (msb - 4);
+}
+
+void LatencyHistogram::record(uint64_t value)
+{
+    buckets[bucket_index(value)]++;
+    total++;
+    if(value > maximum) maximum = value;
+}
+
+void LatencyHistogram::reset()
+{
+    memset(buckets, 0, sizeof(buckets));
+    total = maximum = 0;
+}
+
+uint64_t LatencyHistogram::percentile(double fraction) const
+{
+    if(!total) return 0;
+    uint64_t target = uint64_t(fraction * total), seen = 0;
+    if(target >= total) return maximum;
+    for(int i = 0; i < NUM_BUCKETS; i++)
+    {
+        seen += buckets[i];
+        // report the upper end of the bucket, so latencies never look better than they were
+        if(seen > target) return i + 1 < NUM_BUCKETS ? std::min(bucket_value(i + 1) - 1, maximum) : maximum;
+    }
+    return maximum;
+}
+
+TickProfiler::TickProfiler(const char * const *names, int numphases)
+    : names(names), phases(numphases), ticktimes(numphases, 0), ran(numphases, false)
+{
+}
+
+void TickProfiler::endtick()
+{
+    for(size_t i = 0; i < phases.size(); i++) if(ran[i])
+    {
+        phases[i].record(ticktimes[i]);
+        ticktimes[i] = 0;
+        ran[i] = false;
+    }
+}
+
+std::string TickProfiler::summary() const
+{
+    std::ostringstream s;
+    for(size_t i = 0; i < phases.size(); i++)
+    {
+        const LatencyHistogram &h = phases[i];
+        s << names[i] << ": n=" << h.count()
+          << " p50=" << h.percentile(0.5) << "us"
+          << " p99=" << h.percentile(0.99) << "us"
+          << " max=" << h.max() << "us\n";
+    }
+    return s.str();
+}
+
+void TickProfiler::reset()
+{
+    for(auto &h : phases) h.reset();
+    std::fill(ticktimes.begin(), ticktimes.end(), 0);
+    std::fill(ran.begin(), ran.end(), false);
+}
+
+} // ns inexor::util
+} // ns inexor
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace inexor {
+namespace util {
+
+/// Latency histogram with logarithmic buckets in the spirit of HdrHistogram.
+///
+/// Values are sorted into power of two ranges, each split into
+/// SUB_BUCKETS linear buckets, so every reported percentile is
+/// within 1/SUB_BUCKETS of the real value.
+/// Recording does not allocate and costs a handful of integer
+/// operations, so it can stay enabled in production.
+class LatencyHistogram {
+public:
+    static const int SUB_BUCKETS = 16;
+    static const int NUM_BUCKETS = (64 - 3) * SUB_BUCKETS;
+
+    LatencyHistogram() { reset(); }
+
+    void record(uint64_t value);
+    void reset();
+
+    /// The value below which the given fraction (0..1) of all recorded values lie (rounded up to the bucket end).
+    uint64_t percentile(double fraction) const;
+    uint64_t max() const { return maximum; }
+    uint64_t count() const { return total; }
+
+private:
+    static int bucket_index(uint64_t value);
+    static uint64_t bucket_value(int index);
+
+    uint32_t buckets[NUM_BUCKETS];
+    uint64_t total, maximum;
+};
+
+/// Collects one LatencyHistogram (in microseconds) per phase of a recurring loop, like the server tick.
+/// A phase running several times per tick (e.g. once per network event) yields a single sample: their sum.
+class TickProfiler {
+public:
+    /// @param names the names of the phases, the phase ids are the indices into this array.
+    TickProfiler(const char * const *names, int numphases);
+
+    void record(int phase, uint64_t microseconds)
+    {
+        if(enabled) phases[phase].record(microseconds);
+    }
+
+    /// Add to the time a phase takes in the current tick.
+    void add(int phase, uint64_t microseconds)
+    {
+        if(!enabled) return;
+        ticktimes[phase] += microseconds;
+        ran[phase] = true;
+    }
+
+    /// End the current tick: record one sample for every phase which ran in it.
+    void endtick();
+
+    /// One line per phase: name, number of samples, p50, p99 and max in microseconds.
+    std::string summary() const;
+
+    void reset();
+
+    bool enabled = true;
+
+private:
+    const char * const *names;
+    std::vector<LatencyHistogram> phases;
+    /// The current tick so far.
+    std::vector<uint64_t> ticktimes;
+    std::vector<bool> ran;
+};
+
+/// Adds the lifetime of this object to a phase of the current tick of a TickProfiler.
+class ScopedPhaseTimer {
+public:
+    typedef std::chrono::steady_clock clock;
+
+    ScopedPhaseTimer(TickProfiler &profiler, int phase)
+        : profiler(profiler), phase(phase), start(profiler.enabled ? clock::now() : clock::time_point()) {}
+
+    ~ScopedPhaseTimer()
+    {
+        if(!profiler.enabled) return;
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start);
+        profiler.add(phase, elapsed.count());
+    }
+
+private:
+    TickProfiler &profiler;
+    int phase;
+    clock::time_point start;
+};
+
+} // ns inexor::util
+} // ns inexor